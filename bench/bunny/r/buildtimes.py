@@ -0,0 +1,32 @@
+import csv, sys
+
+# Averages structure build times from a stats CSV dump by acceleration method, printing each in the same format as bvhbuild.csv.
+# Columns are found by name, as they've moved around between versions.
+
+times = {}
+tris = {}
+
+with open(sys.argv[1], "r") as f:
+    csvf = csv.reader(f)
+    header = next(csvf)
+    mapCol = header.index("Map Name")
+    trisCol = header.index("# Tris")
+    methodCol = header.index("Acceleration Method")
+    buildCol = header.index("Structure build time (ms)")
+    for l in csvf:
+        if l[0] == "Map Name" or l[buildCol] in ("", "N/A"):
+            continue
+        method = l[methodCol]
+        if method not in times:
+            times[method] = {}
+        if l[mapCol] not in times[method]:
+            times[method][l[mapCol]] = []
+        times[method][l[mapCol]].append(float(l[buildCol]))
+        tris[l[mapCol]] = int(l[trisCol])
+
+for method in times:
+    print(f"# {method}")
+    print("Triangle Count, Build Time (ms)")
+    for m in sorted(times[method], key=lambda m: tris[m]):
+        t = times[method][m]
+        print(f"{tris[m]},{sum(t) / len(t):.1f}")
@@ -1,10 +1,15 @@
 #ifndef ACCEL
 #define ACCEL
 
+#include <cstdint>
 #include "shape.hpp"
 #include "vec.hpp"
 
-extern const char *accelerators[5];
+extern const char *accelerators[12];
+// Order accelerators are listed in the UI, so related ones sit together regardless of their index.
+extern const int acceleratorOrder[12];
+
+class ThreadPool;
 
 namespace Accel {
     const int DivideObjectsEqually = 0;
@@ -12,25 +17,78 @@ namespace Accel {
     const int Voxel = 2;
     const int BiTree = 3;
     const int FalseOctree = 4;
+    const int BinnedSAH = 5;
+    const int InPlaceSAH = 6;
+    const int WideBVH = 7;
+    const int TwoLevelGrid = 8;
+    const int SpatialSplitBVH = 9;
+    const int MortonBVH = 10;
+    const int PLOC = 11;
     const int None = -1;
 }
 
+// Sets the pool builders submit work to. With none set (the default), everything runs on the calling thread.
+void setBuildPool(ThreadPool *pool);
+
+// Memory allocated by builders since the last resetBuildStats().
+struct BuildStats {
+    size_t allocations;
+    // Most bytes held at once by the structure being built (not including temporary buffers).
+    size_t peakBytes;
+};
+void resetBuildStats();
+BuildStats getBuildStats();
+// Records "allocations" allocations totalling "bytes" (negative when freeing) made while building.
+void countBuildMemory(int64_t bytes, int64_t allocations);
+
 // A bvhSplitter returns 1 if it believes a split should not occur.
 typedef int (&bvhSplitter)(Container *o, float *split, Bound *b0, Bound *b1, int *splitAxis, bool bvh, int lastAxis, int);
 
 int splitSAH(Container *o, float *split, Bound *b0, Bound *b1, int *splitAxis, bool bvh, int lastAxis = 0, float costTriSphereRatio = 1.5f);
 int splitEqually(Container *o, float *split, Bound *b0, Bound *b1, int *splitAxis, bool bvh, int lastAxis, int);
 int splitBitree(Container *o, float *split, Bound *b0, Bound *b1, int *splitAxis, bool bvh, int lastAxis, int maxNodesPerVox = 2);
+int splitBinnedSAH(Container *o, float *split, Bound *b0, Bound *b1, int *splitAxis, int maxLeafSize = 2, float costTriSphereRatio = 1.5f, int nBins = 16);
+int splitKdSAH(Container *o, float *split, int *splitAxis, int lastAxis, int maxNodesPerVox = 2, float costTriSphereRatio = 1.5f);
 
-Container* generateHierarchy(Container *o, int accel, bool bvh, int splitLimit, int splitCount = 0, int lastAxis = -1, int colorIndex = 0, int extra = 0, float fextra = 0.f);
-Container* generateOctreeHierarchy(Container *o, int splitLimit, int splitCount, int colorIndex, int maxNodesPerVox, int parentId = 1);
+// Cost of intersecting a shape of the given type, relative to traversing a node. Used by the SAH builders.
+// Unless setShapeCosts has been given measured costs, these are guesses: 1 for most shapes, with triangles costing costTriSphereRatio.
+float shapeCost(int type, float costTriSphereRatio);
+// Uses "costs" (indexed by ShapeType, e.g. from calibrateShapeCosts, see costs.hpp) for every shape, including triangles, from now on. NULL goes back to the guesses.
+void setShapeCosts(const float *costs);
+// Surface area of the box between a and b.
+float aabbSA(Vec3 a, Vec3 b);
+
+Container* generateHierarchy(Container *o, int accel, bool bvh, int splitLimit, int splitCount = 0, int lastAxis = -1, int extra = 0, float fextra = 0.f, int bins = 16);
+Container* generateOctreeHierarchy(Container *o, int splitLimit, int splitCount, int maxNodesPerVox, int parentId = 1);
 
 void printShapes(Container *c, int tabIndex = 0);
 
-void containerCube(Container *c, Vec3 color);
-void containerSphereCorners(Container *c, Vec3 color);
+// Colour the debug overlay draws a node's box in, going by how deep in the hierarchy it is.
+Vec3 debugColor(int depth);
+
+// Finds the cell of the res[0]*res[1]*res[2] grid between min and max that the ray starts in (or first enters, at distance t). x is -1 if it misses.
+void getVoxelIndex(Vec3 min, Vec3 max, const int *res, const Ray &r, int *x, int *y, int *z, float *t);
 
-Container* splitVoxels(Container *o, int subdivision);
-void getVoxelIndex(Container *c, int subdivision, Vec3 p, Vec3 delta, int *x, int *y, int *z, float *t);
+// VoxelWalk: Steps a ray through the cells of a grid, in the order it passes through them.
+// "Amanatides J., Woo A.: A Fast Voxel Traversal Algorithm for Ray Tracing"
+// All distances are along the original ray (p0 + t*delta).
+struct VoxelWalk {
+    int x, y, z;
+    // Cells along each axis.
+    int res[3];
+    int step[3];
+    // tMax: Distance at which the ray crosses the current cell's next x/y/z boundary.
+    // tDelta: Distance taken to cross a whole cell on each axis.
+    Vec3 tMax, tDelta;
+    // Starts at the cell of the res[0]*res[1]*res[2] grid between min and max the ray's in, or first enters.
+    // Returns false if the ray misses the grid.
+    bool begin(Vec3 min, Vec3 max, const int *gridRes, const Ray &r);
+    // Moves to the next cell, returns false when leaving the grid.
+    bool next();
+    // Index of the current cell in the grid's Bound array.
+    int index() { return x + res[0] * (y + res[1] * z); };
+    // Distance at which the ray leaves the current cell.
+    float exit() { return std::fmin(tMax.x, std::fmin(tMax.y, tMax.z)); };
+};
 
 #endif
@@ -0,0 +1,137 @@
+#ifndef BVH
+#define BVH
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+#include "shape.hpp"
+#include "vec.hpp"
+
+// Max. number of nodes that can be waiting on the traversal stack.
+#define BVH_STACK_SIZE 256
+
+// A node waiting to be visited, and the distance at which the ray enters it.
+struct BVHStackEntry {
+    uint32_t node;
+    float t;
+};
+
+// BVHNode: 32 bytes, so two share a cache line.
+// Interior nodes have "childCount" children stored contiguously from nodes[offset],
+// leaves (childCount == 0) reference "primCount" primitives from primIndices[offset].
+struct alignas(32) BVHNode {
+    Vec3 min;
+    uint32_t offset;
+    Vec3 max;
+    uint16_t primCount;
+    uint8_t childCount;
+    // For nodes with two children, the axis they're furthest apart on (children are stored low to high on it), otherwise 255.
+    uint8_t axis;
+    bool leaf() const { return childCount == 0; };
+};
+
+// Size of a cache line, which BVH node arrays are aligned to.
+#define BVH_CACHE_LINE 64
+
+// CacheAlignedAllocator: Allocates arrays starting on a cache line, so a node's place in a line follows from its index
+// (std::allocator only guarantees 16 bytes).
+template <typename T>
+struct CacheAlignedAllocator {
+    using value_type = T;
+    CacheAlignedAllocator() = default;
+    template <typename U>
+    CacheAlignedAllocator(const CacheAlignedAllocator<U>&) {};
+    T *allocate(size_t n) {
+        return static_cast<T*>(::operator new(n*sizeof(T), std::align_val_t(BVH_CACHE_LINE)));
+    };
+    void deallocate(T *p, size_t) {
+        ::operator delete(p, std::align_val_t(BVH_CACHE_LINE));
+    };
+    template <typename U>
+    bool operator==(const CacheAlignedAllocator<U>&) const { return true; };
+};
+
+// LinearBVH: A hierarchy built by one of the Container-based builders, flattened into a single array.
+// Nodes reference primitives by index rather than pointer, so it can be traversed without recursion, pointer chasing or dynamic_casts.
+struct LinearBVH {
+    // Starts on a cache line, so each pair of nodes from an even index shares one.
+    std::vector<BVHNode, CacheAlignedAllocator<BVHNode>> nodes;
+    std::vector<uint32_t> primIndices;
+    std::vector<Shape*> prims;
+    // Most entries the traversal stack will need.
+    int stackDepth;
+    size_t memoryUsage() {
+        return nodes.size()*sizeof(BVHNode) + primIndices.size()*sizeof(uint32_t) + prims.size()*sizeof(Shape*);
+    };
+};
+
+class ThreadPool;
+
+// Flattens the Container tree at "root" into a LinearBVH, leaving out debug objects.
+// Returns NULL if the tree is too deep to be traversed with a stack of BVH_STACK_SIZE.
+LinearBVH *flattenHierarchy(Container *root);
+
+// Max. bins buildLinearBVH will use.
+#define BVH_MAX_BINS 64
+
+// Builds a LinearBVH over the shapes in "flat" directly, splitting with binned SAH like splitBinnedSAH, without a Container tree in between.
+// Shapes are referenced from a single array which is partitioned in place at each node (like quicksort), so the build makes the same handful of allocations
+// however big the scene is. Subtrees are built in parallel on "pool", if given.
+// Returns NULL if the tree is too deep to be traversed with a stack of BVH_STACK_SIZE.
+LinearBVH *buildLinearBVH(Container *flat, int maxDepth, int maxLeafSize = 2, float costTriSphereRatio = 1.5f, int nBins = 16, ThreadPool *pool = NULL);
+
+// Recomputes the boxes of the leaves holding any of the shapes flagged in "dirty" (indexed like prims), after they've moved, then of every node above them.
+// The tree's structure is kept, so it stays correct, but gets slower to traverse the further shapes move from where it was built for them.
+void refitBVH(LinearBVH *bvh, const std::vector<bool> &dirty);
+
+// Expected cost of tracing a ray through the tree, going by the surface area heuristic:
+// each node's surface area relative to the root's, times the cost of visiting it (1 for interior nodes, shapeCost of its shapes for leaves).
+// If rootSA is given and non-zero, areas are relative to it instead, so a tree's cost after refitting can be compared with its cost when built; otherwise it's set to the root's area.
+float bvhCost(const LinearBVH *bvh, float costTriSphereRatio, float *rootSA = NULL);
+
+extern const char *bvhLayouts[3];
+
+// Orders layoutBVH can store a LinearBVH's nodes in.
+namespace BVHLayout {
+    // Whatever order the builder left them in (for the parallel builders, the order subtrees happened to finish in).
+    const int AsBuilt = 0;
+    const int DepthFirst = 1;
+    const int Treelets = 2;
+};
+
+// Levels of the tree in each treelet of BVHLayout::Treelets: a binary one (126 nodes) fits in a 4KiB page.
+#define BVH_LAYOUT_TREELET_LEVELS 6
+
+// Stores the nodes of "bvh" in the given BVHLayout, so those a ray is likely to visit one after another are close together in memory.
+// DepthFirst puts each node's subtrees one after another, Treelets cuts the tree into BVH_LAYOUT_TREELET_LEVELS-deep treelets (stored depth-first),
+// storing each breadth-first so the top of the tree, and the top of each subtree, take up as few pages as possible.
+// Siblings stay contiguous and after their parents in both, and a pair of them is kept to one cache line (starting at an even index, after an empty leaf where needed). Primitives are then copied into prims in the order their leaves are stored,
+// so each leaf's are contiguous (and primIndices becomes 0, 1, 2, ...). Shapes referenced by more than one leaf are stored once per leaf.
+void layoutBVH(LinearBVH *bvh, int layout);
+
+// BVHTraceStats: Memory touched per ray by measureBVH, on average.
+struct BVHTraceStats {
+    double nodes, prims;
+    // Distinct 64-byte cache lines of nodes, primIndices, prims and shapes, and the bytes in them.
+    double lines, bytes;
+};
+
+// Traces "rays" through "bvh" (closest hit, nearest child first, as WorldMap::bvhRay does) recording the memory each one reads.
+BVHTraceStats measureBVH(const LinearBVH *bvh, const std::vector<Ray> &rays);
+
+// Slab test of a ray against a node's bounding box, only counting the part of the ray within [tMin, tMax].
+// If hit, stores the distance at which the ray enters the box (tMin if it starts inside) in tEntry.
+inline bool meetsNode(const BVHNode *n, const Ray &r, float *tEntry) {
+    const Vec3 *bounds[2] = {&(n->min), &(n->max)};
+    float tmin = r.tMin;
+    float tmax = r.tMax;
+    for (int i = 0; i < 3; i++) {
+        tmin = std::fmax(tmin, ((*bounds[r.sign[i]])(i) - r.p0(i)) * r.invDelta(i));
+        tmax = std::fmin(tmax, ((*bounds[1-r.sign[i]])(i) - r.p0(i)) * r.invDelta(i));
+    }
+    *tEntry = tmin;
+    return tmin <= tmax;
+}
+
+#endif
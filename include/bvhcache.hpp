@@ -0,0 +1,32 @@
+#ifndef BVHCACHE
+#define BVHCACHE
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include "bvh.hpp"
+#include "shape.hpp"
+
+// Bumped whenever the layout of cache files (or of BVHNode) changes, so old ones are ignored rather than misread.
+#define BVH_CACHE_VERSION 1
+
+// FNV-1a hash of "size" bytes at "data", continuing from "h".
+uint64_t hashBytes(const void *data, size_t size, uint64_t h = 14695981039346656037ull);
+
+template <typename T>
+uint64_t hashValue(T v, uint64_t h) {
+    return hashBytes(&v, sizeof(T), h);
+}
+
+// Hash of everything about the shapes in "flat" a hierarchy build can depend on: their order, types, bounds and (for triangles) vertices.
+uint64_t hashGeometry(Container *flat);
+
+// Writes "bvh" to "path" (via a temporary file, so a reader never sees it half-written), under "key". Shapes are stored by their Shape::id.
+// Returns false (and prints why) if it can't be written.
+bool saveBVHCache(const std::string &path, uint64_t key, const LinearBVH *bvh);
+
+// Reads a LinearBVH written by saveBVHCache for "key" back from "path" by mapping it into memory, pointing it at the shapes in "flat" by their Shape::id.
+// Returns NULL if there's no such file, or it's from a different version or key.
+LinearBVH *loadBVHCache(const std::string &path, uint64_t key, Container *flat);
+
+#endif
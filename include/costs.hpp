@@ -0,0 +1,25 @@
+#ifndef COSTS
+#define COSTS
+
+#include <string>
+#include "shape.hpp"
+
+// Bumped whenever what calibrateShapeCosts measures changes, so costs saved by an older version are measured again.
+#define SHAPE_COSTS_VERSION 1
+// Name of the file costs are saved in, within the hierarchy cache directory.
+#define SHAPE_COSTS_FILE "shapecosts.txt"
+
+// Times intersecting rays with n random shapes (from shapeList, see test.hpp) of each ShapeType on this machine, storing in "costs" (indexed by ShapeType)
+// each one's time relative to testing a ray against a BVHNode's box, the SAH's traversal cost. Takes the fastest of "repeats" runs.
+// Instances are of a Mesh of meshSize small triangles, so the cost of a much bigger or smaller mesh will be a bit off.
+void calibrateShapeCosts(float *costs, int n = 2000, int repeats = 32, int meshSize = 256);
+
+// "Sphere 1.23, Triangle 2.34, ..."
+std::string describeShapeCosts(const float *costs);
+
+// Reads costs written by saveShapeCosts from "path". Returns false if there aren't any, or they're from a different version.
+bool loadShapeCosts(const std::string &path, float *costs);
+// Returns false (and prints why) if they can't be written.
+bool saveShapeCosts(const std::string &path, const float *costs);
+
+#endif
@@ -39,15 +39,36 @@ struct GLWindowState {
     std::string mapPath;
     MapStats *mapStats;
     bool reloadMap;
+    // Copied to WorldMap::instanceIncludes when the map's (re)loaded.
+    bool instanceIncludes;
     bool useOptimizedMap;
     bool renderOptimizedHierarchy;
     Container *optimizedMap;
     double lastOptimizeTime;
+    // Memory allocated by the last hierarchy build.
+    size_t lastOptimizeAllocations, lastOptimizePeakBytes;
+    // SAH cost of the last hierarchy built, and of the last built with splitSAH, or 0 if either wasn't a BVH.
+    float lastOptimizeCost, splitSAHCost;
     double lastLoadTime;
     int accelIndex;
     int accelDepth;
     int accelParam;
     float accelFloatParam;
+    int accelBins;
+    int accelWidth;
+    float accelSplitAlpha;
+    int accelTreeletLevels;
+    int accelSearchRadius;
+    int accelLayout;
+    bool accelLayoutStats;
+    bool useMeasuredCosts;
+    // Set to have the map measure its shape costs again.
+    bool remeasureCosts;
+    // WorldMap::shapeCosts, or NULL if they haven't been measured.
+    const float *shapeCosts;
+    // Shapes moved in the editor since the map last refit its hierarchy around them.
+    std::vector<Shape*> movedShapes;
+    float refitRebuildRatio;
     bool useBVH;
     bool staleAccelConfig;
     int threadCount;
@@ -143,6 +164,7 @@ class GLWindow {
 
         bool vl(bool t);
         
+        void markMoved(Shape *sh);
         void showShapeEditor(Shape *shape = NULL, bool hideTransforms = false);
         void showMaterialEditor(Material *m = NULL);
 };
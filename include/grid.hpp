@@ -0,0 +1,68 @@
+#ifndef GRID
+#define GRID
+
+#include <cstdint>
+#include <vector>
+#include "shape.hpp"
+#include "vec.hpp"
+
+class ThreadPool;
+
+// Most cells a sub-grid of a TwoLevelGrid can have along an axis.
+#define GRID_MAX_SUB_RES 64
+
+// Picks how many cells a grid covering "extent" should have along each axis, with "longest" along the longest axis (capped at maxRes)
+// and the others in proportion, so cells stay roughly cubic whatever the shape of the box. Every axis gets at least one.
+void gridResolution(Vec3 extent, float longest, int maxRes, int *res);
+
+// GridCell: The shapes in a cell, primIndices[offset] to primIndices[offset+count-1].
+// Cells of the top grid holding more than a few shapes instead have a finer grid of their own, grids[sub].
+struct GridCell {
+    uint32_t offset;
+    uint32_t count;
+    int32_t sub;
+};
+
+// Grid: res[0]*res[1]*res[2] cells between min and max, stored x-first from cells[firstCell].
+struct Grid {
+    Vec3 min, max;
+    int res[3];
+    uint32_t firstCell;
+    uint32_t cellCount() const { return uint32_t(res[0]) * res[1] * res[2]; };
+};
+
+// TwoLevelGrid: A coarse grid (grids[0]), where each cell with more than a handful of shapes gets its own finer grid, sized by how many it has.
+// Dense parts of the scene get small cells without the empty space around them needing millions.
+// "Kalojanov J., Billeter M., Slusallek P.: Two-Level Grids for Ray Tracing on GPUs"
+struct TwoLevelGrid {
+    std::vector<Grid> grids;
+    std::vector<GridCell> cells;
+    std::vector<uint32_t> primIndices;
+    std::vector<Shape*> prims;
+    size_t memoryUsage() {
+        return grids.size()*sizeof(Grid) + cells.size()*sizeof(GridCell) + primIndices.size()*sizeof(uint32_t) + prims.size()*sizeof(Shape*);
+    };
+};
+
+// UniformGrid: A single grid, stored compressed-sparse-row style.
+// The shapes in cell i are primIndices[cellStart[i]] to primIndices[cellStart[i+1]-1], so an empty cell costs 4 bytes.
+struct UniformGrid {
+    Grid g;
+    std::vector<uint32_t> cellStart;
+    std::vector<uint32_t> primIndices;
+    std::vector<Shape*> prims;
+    size_t memoryUsage() {
+        return cellStart.size()*sizeof(uint32_t) + primIndices.size()*sizeof(uint32_t) + prims.size()*sizeof(Shape*);
+    };
+};
+
+// Builds a uniform grid over the shapes in "o", with cbrt(density*N) cells along the longest axis (for N shapes, capped at maxRes)
+// and the other axes in proportion. Shapes are counted into cells, then written into place, with both passes split across "pool" if given.
+UniformGrid *buildUniformGrid(Container *o, int maxRes, float density = 1.5f, ThreadPool *pool = NULL);
+
+// Builds a two-level grid over the shapes in "o", with topRes cells along the longest axis of the top grid.
+// Top cells with more than maxCellPrims shapes get a sub-grid of around "density" cells per shape.
+// Sub-grids are built in parallel on "pool" if given.
+TwoLevelGrid *buildTwoLevelGrid(Container *o, int topRes, int maxCellPrims = 2, float density = 1.5f, ThreadPool *pool = NULL);
+
+#endif
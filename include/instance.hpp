@@ -0,0 +1,68 @@
+#ifndef INSTANCE
+#define INSTANCE
+
+#include <string>
+#include <vector>
+#include "bvh.hpp"
+#include "mat.hpp"
+#include "shape.hpp"
+
+class ThreadPool;
+
+// Mesh: The shapes of a file included by a map, loaded once in the file's own (object) space, with a hierarchy over them
+// shared by every Instance of it.
+struct Mesh {
+    std::string path;
+    Container shapes;
+    LinearBVH *bvh;
+    // Lights and planes can't go in the hierarchy, so are copied into the map for each instance.
+    std::vector<PointLight> lights;
+    std::vector<Triangle*> planes;
+    // Identifies the settings bvh was last built with, so it's only rebuilt when they change. Set by whoever builds it.
+    uint64_t buildKey;
+    Mesh(): bvh(NULL), buildKey(0) {};
+    // Builds bvh over "shapes" (with buildLinearBVH), taking shapes' costs from shapeCost as any other build does.
+    void build(int maxLeafSize = 2, float costTriSphereRatio = 1.5f, int nBins = 16, ThreadPool *pool = NULL);
+    // Closest hit of r with the mesh's shapes, as Shape::intersect, also giving the shape hit.
+    float intersect(const Ray &r, Shape **hit = NULL, Vec3 *normal = NULL, Vec2 *uv = NULL);
+    ~Mesh();
+};
+
+// Instance: A Mesh placed in the map, which goes in the map's hierarchy like any other shape, so memory and build time scale with the unique geometry.
+// Rays are moved into the mesh's space to be traced through its hierarchy. Their direction isn't normalized,
+// so distances along them are the same in both spaces and can be compared with hits on other shapes.
+class Instance: public Shape {
+    public:
+        Mesh *mesh;
+        // Where the include directive placed the mesh, before any transform from the editor.
+        Mat4 placement;
+        Mat4 toWorld, toObject;
+        // Inverse transpose of toWorld's rotation & scale, which moves normals.
+        Mat3 normalToWorld;
+        Instance(Mesh *m, Mat4 placement);
+        Instance(Shape *sh): Shape(sh) {
+            Instance *in = static_cast<Instance*>(sh);
+            mesh = in->mesh;
+            placement = in->placement;
+            toWorld = in->toWorld;
+            toObject = in->toObject;
+            normalToWorld = in->normalToWorld;
+        };
+        virtual Shape *clone() {
+            return new Instance(this);
+        };
+        virtual void bounds(Bound *bo);
+        virtual float intersect(const Ray &r, Vec3 *normal = NULL, Vec2 *uv = NULL, float *t1 = NULL, Vec3 *normal1 = NULL, Vec2 *uv1 = NULL);
+        virtual bool intersects(const Ray &r);
+        virtual void applyTransform();
+        virtual void bakeTransform();
+        virtual void refract(float ri, Vec3 p0, Vec3 delta, Vec3 *p1, Vec3 *delta1);
+        virtual std::string name() { return std::string("Instance"); };
+        virtual int type() { return ShapeType::Instance; };
+        Ray toObjectSpace(const Ray &r);
+        Vec3 pointToWorld(Vec3 p) { return p * toWorld; };
+        Vec3 directionToWorld(Vec3 d);
+        Vec3 normalToWorldSpace(Vec3 n) { return norm(normalToWorld * n); };
+};
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef KDTREE
+#define KDTREE
+
+#include <cstdint>
+#include <vector>
+#include "shape.hpp"
+#include "vec.hpp"
+
+// Max. number of nodes that can be waiting on the kd-tree traversal stack.
+#define KD_STACK_SIZE 128
+
+// KdNode: 12 bytes. Interior nodes split their cell at "split" along "axis", with the part below it at nodes[offset], and above at nodes[offset+1].
+// Leaves (axis == 3) reference "primCount" primitives from primIndices[offset].
+struct KdNode {
+    float split;
+    uint32_t offset;
+    uint32_t primCount: 30;
+    uint32_t axis: 2;
+    bool leaf() const { return axis == 3; };
+};
+
+// The far child of a node, and the part of the ray that passes through it, waiting to be visited.
+struct KdStackEntry {
+    uint32_t node;
+    float tMin, tMax;
+};
+
+// KdTree: A Bi-tree (kd-tree) built by generateHierarchy, flattened so it can be walked front to back.
+// Unlike a BVH, the children of a node don't overlap, so once something's hit within a cell, nothing further away need be visited.
+struct KdTree {
+    std::vector<KdNode> nodes;
+    std::vector<uint32_t> primIndices;
+    std::vector<Shape*> prims;
+    // Bounds of the root cell.
+    Vec3 min, max;
+    // Finds the part of the ray [tMin, tMax] within the root cell, returns false if there isn't one.
+    bool clip(const Ray &r, float *tMin, float *tMax) {
+        Vec3 bounds[2] = {min, max};
+        *tMin = r.tMin;
+        *tMax = r.tMax;
+        for (int i = 0; i < 3; i++) {
+            *tMin = std::fmax(*tMin, (bounds[r.sign[i]](i) - r.p0(i)) * r.invDelta(i));
+            *tMax = std::fmin(*tMax, (bounds[1-r.sign[i]](i) - r.p0(i)) * r.invDelta(i));
+        }
+        return *tMin <= *tMax;
+    };
+    size_t memoryUsage() {
+        return nodes.size()*sizeof(KdNode) + primIndices.size()*sizeof(uint32_t) + prims.size()*sizeof(Shape*);
+    };
+};
+
+// Flattens the Bi-tree at "root", leaving out debug objects.
+// Returns NULL if the tree is deeper than KD_STACK_SIZE.
+KdTree *flattenKdTree(Container *root);
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef LBVH
+#define LBVH
+
+#include "bvh.hpp"
+#include "shape.hpp"
+
+// Max. shapes in a treelet restructured by buildLBVH. The optimal tree over n leaves is found by trying every split of every subset, so this can't be much more.
+#define LBVH_TREELET_SIZE 7
+
+class ThreadPool;
+
+// Builds a LinearBVH over the shapes in "flat" from their Morton codes, rather than by evaluating splits.
+// "Lauterbach C. et al.: Fast BVH Construction on GPUs"
+// The centroid of each shape's Bound is quantized to a 30-bit Morton code (10 bits per axis, interleaved), so that sorting the codes (with a parallel radix sort)
+// orders the shapes along a Z-order curve. Any range of the sorted shapes sharing a prefix is then a cell of an implicit octree, so each node is split where the
+// highest bit differing between its first and last code changes, found by binary search. Nodes with maxLeafSize shapes or less (or maxDepth deep) become leaves.
+// If "treeletLevels" is non-zero, the nodes in that many levels from the root are then restructured, deepest first, into the tree over (up to) LBVH_TREELET_SIZE
+// of their descendants with the lowest SAH cost, improving the top of the tree where the Morton order is coarsest.
+// "Karras T., Aila T.: Fast Parallel Construction of High-Quality Bounding Volume Hierarchies"
+// Returns NULL if the tree is too deep to be traversed with a stack of BVH_STACK_SIZE.
+LinearBVH *buildLBVH(Container *flat, int maxDepth, int maxLeafSize = 2, float costTriSphereRatio = 1.5f, int treeletLevels = 0, ThreadPool *pool = NULL);
+
+// Builds a LinearBVH over the shapes in "flat" bottom-up, by Parallel Locally-Ordered Clustering.
+// "Meister D., Bittner J.: Parallel Locally-Ordered Clustering for Bounding Volume Hierarchy Construction"
+// The shapes are sorted by Morton code as in buildLBVH, and start as a cluster each. Each round, every cluster finds the one among the "radius" either side
+// of it in that order whose box combined with its own has the smallest surface area, and pairs that find each other are merged, until one's left.
+// As with agglomerative clustering, this gives trees with a lower SAH cost than top-down builders, with the larger radii slower but closer to a full search.
+// Subtrees of up to maxLeafSize shapes are then made into leaves where that's cheaper by the SAH.
+// Returns NULL if the tree is too deep to be traversed with a stack of BVH_STACK_SIZE.
+LinearBVH *buildPLOC(Container *flat, int maxDepth, int maxLeafSize = 2, float costTriSphereRatio = 1.5f, int radius = 16, ThreadPool *pool = NULL);
+
+#endif
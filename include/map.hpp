@@ -1,16 +1,34 @@
 #ifndef MAP
 #define MAP
 
+#include <cstdint>
 #include <sstream>
+#include <string>
+#include <unordered_map>
 #include <vector>
 #include "shape.hpp"
 #include "cam.hpp"
 #include "img.hpp"
 #include "mat.hpp"
 #include "tex.hpp"
+#include "accel.hpp"
 
 extern const char *modes[3];
 
+// Width/height (px) of the square tiles the image is split into for rendering.
+#define RENDER_TILE_SIZE 16
+
+class TileScheduler;
+class ThreadPool;
+struct LinearBVH;
+template <int W> struct WideBVH;
+struct KdTree;
+struct Octree;
+struct UniformGrid;
+struct TwoLevelGrid;
+struct Mesh;
+class Instance;
+
 struct RenderConfig {
     int *threadStates;
     int nthreads;
@@ -52,6 +70,8 @@ struct RayResult {
     // Vec3 normal;
     Vec3 norm;
     Shape *obj;
+    // The Instance obj was hit through, if any, in whose space obj is.
+    Instance *instance;
     RayResult() { resetObj(); };
     bool hit() {
         return obj != NULL;
@@ -71,6 +91,7 @@ struct RayResult {
         // normal = {0,0,0};
         norm = {0,0,0};
         obj = NULL;
+        instance = NULL;
     };
 };
 
@@ -78,6 +99,8 @@ struct MapStats {
     std::string name;
     int spheres, tris, lights, planes, aabs, csgs, cylinders, cones;
     int tex, norm;
+    // Instances of included files, and the shapes in those files (counted once, however many times they're included).
+    int instances, instancedShapes;
     int missingTex, missingNorm, missingRef, missingObj;
     int allocs = 0;
     float moveSpeedMultiplier;
@@ -92,6 +115,8 @@ struct MapStats {
         cones = 0;
         tex = 0;
         norm = 0;
+        instances = 0;
+        instancedShapes = 0;
         missingTex = 0;
         missingNorm = 0;
         missingRef = 0;
@@ -101,7 +126,7 @@ struct MapStats {
         name.clear();
     }
     int size() {
-        return lights + spheres + tris + planes + aabs + csgs + cylinders + cones;
+        return lights + spheres + tris + planes + aabs + csgs + cylinders + cones + instances;
     }
 };
 
@@ -112,13 +137,56 @@ class WorldMap {
         float w, h, d;
         float baseBrightness, globalShininess;
         void loadFile(char const* path, double (*getTime)(void));
-        void loadObjFile(char const* path, Mat4 transform = mat44Identity);
+        // Loads the shapes in a map file into the map, or into "mesh" if given.
+        void loadObjFile(char const* path, Mat4 transform = mat44Identity, Mesh *mesh = NULL);
         void optimizeMap(double (*getTime)(void), int level = 1, int accelIdx = 1);
         int optimizeLevel;
         int accelIndex;
         bool bvh;
         int accelParam;
         float accelFloatParam;
+        // Number of bins used by the binned SAH builder.
+        int accelBins;
+        // Children per node (4 or 8) for Accel::WideBVH.
+        int accelWidth;
+        // How much (relative to the whole scene) the children of a node must overlap before Accel::SpatialSplitBVH tries splitting space.
+        float accelSplitAlpha;
+        // Levels from the root whose treelets Accel::MortonBVH restructures with the SAH once built.
+        int accelTreeletLevels;
+        // Clusters either side of each that Accel::PLOC searches for its nearest neighbour.
+        int accelSearchRadius;
+        // Directory hierarchies are cached in (see bvhcache.hpp), or empty to not cache them.
+        std::string accelCachePath;
+        // BVHLayout linearBVH is stored in once built (or loaded from the cache), see layoutBVH.
+        int accelLayout;
+        // Whether to report the memory (see measureBVH) the camera's rays touch in linearBVH, before and after it's laid out.
+        bool accelLayoutStats;
+        // Whether the SAH builders use shapeCosts, measured on this machine, rather than guessing and taking the triangle/sphere ratio from accelFloatParam.
+        bool useMeasuredCosts;
+        // Cost of intersecting each ShapeType relative to traversing a node (see calibrateShapeCosts), once shapeCostsMeasured.
+        float shapeCosts[ShapeType::Count];
+        bool shapeCostsMeasured;
+        // Set to have the next optimizeMap measure shapeCosts again (on its own thread), rather than reading them from accelCachePath.
+        bool remeasureCosts;
+        // Whether each file a map includes is loaded once into a Mesh with its own hierarchy, and placed as an Instance wherever it's included,
+        // rather than its shapes being copied into the map every time. Only takes effect when the map is next loaded.
+        bool instanceIncludes;
+        // Meshes loaded for instanceIncludes, by path.
+        std::unordered_map<std::string, Mesh*> meshes;
+        // Updates the hierarchy in use after the given shapes (from flatObj) have been moved, rather than rebuilding it.
+        // Returns true if it needs rebuilding anyway: only BVHs can be refit, and once refitting has made one's SAH cost more than refitRebuildRatio times what it was when built,
+        // it's likely to be faster to rebuild than to keep tracing rays through it.
+        bool refitMap(const std::vector<Shape*> &moved, double (*getTime)(void));
+        float refitRebuildRatio;
+        // SAH cost (see bvhCost) of the BVH in use when it was last built, or 0 if there isn't one.
+        float builtCost;
+        // Surface area of that BVH's root when it was built, which costs after refitting are taken relative to.
+        float builtRootSA;
+        // builtCost and build time (in seconds) of the last hierarchy built with Accel::SAH (i.e. splitSAH) for this map, for others to be compared against, or 0 if there hasn't been one.
+        float splitSAHCost;
+        double splitSAHBuildTime;
+        // Fraction of the last hierarchy build each thread spent working, indexed like ThreadPool::busyTimes().
+        std::vector<double> buildUtilization;
         std::vector<PointLight> pointLights;
         std::vector<CamPreset> camPresets;
         const char **camPresetNames;
@@ -126,6 +194,26 @@ class WorldMap {
         Container *obj;
         Container *flatObj;
         Container *optimizedObj;
+        // optimizedObj flattened for traversal, or NULL if it couldn't be.
+        LinearBVH *linearBVH;
+        // linearBVH collapsed to 4 or 8 children per node, for Accel::WideBVH (only one is set).
+        WideBVH<4> *wideBVH4;
+        WideBVH<8> *wideBVH8;
+        // optimizedObj flattened for front-to-back traversal, for Accel::BiTree.
+        KdTree *kdTree;
+        // optimizedObj flattened for parametric traversal, for Accel::FalseOctree.
+        Octree *octree;
+        // Built straight from flatObj for Accel::Voxel and Accel::TwoLevelGrid, with optimizedObj just an empty box.
+        UniformGrid *uniformGrid;
+        TwoLevelGrid *twoLevelGrid;
+        // Wireframe of the boxes of whichever of the above is in use, drawn over renders when RenderConfig::showDebugObjects is set.
+        // Each edge is a thin box, with its own BVH. Only built (by castRays) when needed, and thrown away with the hierarchy.
+        Container debugOverlay;
+        LinearBVH *debugOverlayBVH;
+        bool debugOverlayStale;
+        Material debugOverlayColors[16];
+        // Shapes marked "debug" in the map file, which the hierarchies leave out, to be shown alongside the overlay.
+        std::vector<Shape*> debugShapes;
         Container unoptimizable;
         char **objectNames;
         int objectCount;
@@ -138,6 +226,9 @@ class WorldMap {
        
         Decoder dec;
 
+        // Long-lived workers used for rendering, building hierarchies and loading textures.
+        ThreadPool *pool;
+
         Image *aaOffsetImage;
         bool aaOffsetImageDirty;
         MapStats mapStats;
@@ -147,22 +238,56 @@ class WorldMap {
         bool currentlyLoading;
         double lastRenderTime;
         double lastOptimizeTime;
+        BuildStats lastBuildStats;
         double lastLoadTime;
         void createSphere(Vec3 center, float radius, Vec3 color, float opacity = 1.f, float reflectiveness = 0.f, float specular = 1.f, float shininess = -1.f, float thickness = -1.f);
         void createTriangle(Vec3 a, Vec3 b, Vec3 c, Vec3 color, float opacity = 1.f, float reflectiveness = 0.f, float specular = 1.f, float shininess = -1.f); 
         void createDebugVector(Vec3 p0, Vec3 delta, Vec3 color = {1.f, 0.f, 0.f});
         void appendPointLight(Vec3 center, Vec3 color, float brightness);
         double castRays(Image *img, RenderConfig *rc, double (*getTime)(void), int nthreads = -1);
+        bool occluded(const Ray &r);
 
         void encode(char const* path);
 
         void genObjectList(Container *c);
     private:
-        void castRay(RayResult *res, Container *c, Vec3 p0, Vec3 delta, RenderConfig *rc, int callCount = 0);
+        void collectTextures(char const* path, std::vector<std::string> *t, std::vector<std::string> *n, std::vector<std::string> *r);
+        void reportBuildUtilization(double buildTime);
+        float hierarchyCost(float *rootSA = NULL);
+        uint64_t accelCacheKey();
+        std::string accelCacheFile(uint64_t key);
+        std::vector<Ray> cameraRays(int maxRays);
+        // Reads shapeCosts from accelCachePath, or measures them (and saves them there) if they aren't there or "remeasure" is set.
+        void measureShapeCosts(bool remeasure = false);
+        void castRay(RayResult *res, Container *c, const Ray &r, RenderConfig *rc, int callCount = 0);
+        void castTiles(Image *img, RenderConfig *rc, TileScheduler *tiles, int thread, int *state, Vec2 *offsets, int nOffsets);
         void castSubRays(Image *img, RenderConfig *rc, int w0, int w1, int h0, int h1, int *state, Vec2 *offsets, int nOffsets);
-        void ray(RayResult *res, Container *c, Vec3 p0, Vec3 delta, RenderConfig *rc);
-        void traversalRay(RayResult *res, Container *c, Vec3 p0, Vec3 delta, RenderConfig *rc);
-        void voxelRay(RayResult *res, Container *c, Vec3 p0, Vec3 delta, RenderConfig *rc);
+        void ray(RayResult *res, Container *c, const Ray &r, RenderConfig *rc);
+        Mesh *loadMesh(const std::string &path);
+        void buildMesh(Mesh *m);
+        uint64_t meshBuildKey();
+        void clearMeshes();
+        void hitShape(RayResult *res, Shape *current, const Ray &r);
+        void instanceRay(RayResult *res, Instance *inst, const Ray &r);
+        void bvhRay(RayResult *res, LinearBVH *bvh, const Ray &r);
+        bool shapeOccludes(Shape *current, const Ray &r);
+        bool traversalOccluded(Container *c, const Ray &r);
+        bool voxelOccluded(UniformGrid *grid, const Ray &r);
+        bool bvhOccluded(LinearBVH *bvh, const Ray &r);
+        void startMailbox();
+        void kdRay(RayResult *res, KdTree *tree, const Ray &r);
+        bool kdOccluded(KdTree *tree, const Ray &r);
+        void octreeRay(RayResult *res, Octree *tree, const Ray &r);
+        bool octreeOccluded(Octree *tree, const Ray &r);
+        void gridRay(RayResult *res, TwoLevelGrid *grid, const Ray &r);
+        void buildDebugOverlay();
+        void clearDebugOverlay();
+        void overlayRay(RayResult *res, const Ray &r);
+        bool gridOccluded(TwoLevelGrid *grid, const Ray &r);
+        template <int W> void wideBvhRay(RayResult *res, WideBVH<W> *bvh, const Ray &r);
+        template <int W> bool wideBvhOccluded(WideBVH<W> *bvh, const Ray &r);
+        void traversalRay(RayResult *res, Container *c, const Ray &r, RenderConfig *rc);
+        void voxelRay(RayResult *res, UniformGrid *grid, const Ray &r);
         void castReflectionRay(Vec3 p0, Vec3 delta, RenderConfig *rc, RayResult *res, int callCount);
         void castShadowRays(Vec3 viewDelta, Vec3 p0, RenderConfig *rc, RayResult *res);
         void castThroughSphere(Vec3 delta, RenderConfig *rc, RayResult *res, int callCount = 0);
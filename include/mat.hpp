@@ -97,6 +97,30 @@ Mat4 operator*(Mat4 const& a, Mat4 const& b) noexcept {
     return res;
 }
 
+// Inverse of a transform made of translations, rotations and scales (i.e. whose bottom row is 0, 0, 0, 1):
+// the inverse of the top-left 3x3 (by cofactors), with the translation moved back through it.
+inline
+Mat4 affineInverse(Mat4 const& m) noexcept {
+    float c00 = m(1, 1)*m(2, 2) - m(1, 2)*m(2, 1);
+    float c01 = m(1, 2)*m(2, 0) - m(1, 0)*m(2, 2);
+    float c02 = m(1, 0)*m(2, 1) - m(1, 1)*m(2, 0);
+    float invDet = 1.f / (m(0, 0)*c00 + m(0, 1)*c01 + m(0, 2)*c02);
+    Mat4 res = mat44Identity;
+    res(0, 0) = c00 * invDet;
+    res(0, 1) = (m(0, 2)*m(2, 1) - m(0, 1)*m(2, 2)) * invDet;
+    res(0, 2) = (m(0, 1)*m(1, 2) - m(0, 2)*m(1, 1)) * invDet;
+    res(1, 0) = c01 * invDet;
+    res(1, 1) = (m(0, 0)*m(2, 2) - m(0, 2)*m(2, 0)) * invDet;
+    res(1, 2) = (m(0, 2)*m(1, 0) - m(0, 0)*m(1, 2)) * invDet;
+    res(2, 0) = c02 * invDet;
+    res(2, 1) = (m(0, 1)*m(2, 0) - m(0, 0)*m(2, 1)) * invDet;
+    res(2, 2) = (m(0, 0)*m(1, 1) - m(0, 1)*m(1, 0)) * invDet;
+    for (int i = 0; i < 3; i++) {
+        res(i, 3) = -(res(i, 0)*m(0, 3) + res(i, 1)*m(1, 3) + res(i, 2)*m(2, 3));
+    }
+    return res;
+}
+
 struct Mat3 {
     float v[9];
 
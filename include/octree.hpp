@@ -0,0 +1,120 @@
+#ifndef OCTREE
+#define OCTREE
+
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include "shape.hpp"
+#include "vec.hpp"
+
+// OctNode: A node of a flattened generateOctreeHierarchy tree. Cells aren't stored, as each is just an eighth of its parent's.
+// Octants are numbered like in generateOctreeHierarchy (bit 0 set for the upper half in x, bit 1 in y, bit 2 in z).
+// Interior nodes store the octants that have anything in them in "childMask", and those children contiguously (in octant order) from nodes[offset].
+// Leaves (childMask == 0) reference "primCount" primitives from primIndices[offset].
+struct OctNode {
+    uint32_t offset;
+    uint32_t primCount: 24;
+    uint32_t childMask: 8;
+    bool leaf() const { return childMask == 0; };
+    // Index of the child in octant "o" if there is one, otherwise -1.
+    int64_t child(int o) const {
+        if (!(childMask & (1 << o))) return -1;
+        return offset + std::popcount(uint32_t(childMask & ((1 << o) - 1)));
+    };
+};
+
+// Octree: A FalseOctree hierarchy flattened for parametric traversal.
+struct Octree {
+    std::vector<OctNode> nodes;
+    std::vector<uint32_t> primIndices;
+    std::vector<Shape*> prims;
+    // Bounds of the root cell.
+    Vec3 min, max;
+    size_t memoryUsage() {
+        return nodes.size()*sizeof(OctNode) + primIndices.size()*sizeof(uint32_t) + prims.size()*sizeof(Shape*);
+    };
+};
+
+// Flattens the octree at "root", leaving out debug objects. Returns NULL if it doesn't look like it came from generateOctreeHierarchy.
+Octree *flattenOctree(Container *root);
+
+// The ray, mirrored so it travels in +x/+y/+z, and the axes it was mirrored in ("a").
+// Octant o of the mirrored ray is then octant o^a of the tree.
+struct OctRay {
+    Vec3 p0, invDelta;
+    int a;
+    float tMin;
+};
+
+// Visits the octants of "node" that the ray passes through, front to back.
+// lo/size: The node's cell, in mirrored space.
+// t0/t1: Distances at which the ray crosses the lower/upper planes of the cell on each axis.
+template <typename F>
+bool walkOctant(const Octree *tree, const OctRay &r, uint32_t node, Vec3 lo, Vec3 size, const float *t0, const float *t1, F &leaf) {
+    if (std::fmin(t1[0], std::fmin(t1[1], t1[2])) < r.tMin) return false;
+    const OctNode *n = &(tree->nodes[node]);
+    if (n->leaf()) return leaf(n, std::fmax(t0[0], std::fmax(t0[1], t0[2])), std::fmin(t1[0], std::fmin(t1[1], t1[2])));
+    Vec3 half = size / 2.f;
+    float tm[3];
+    for (int i = 0; i < 3; i++) {
+        // Not the average of t0 and t1, as for a ray parallel to the axis, they're both infinite.
+        tm[i] = (lo(i) + half(i) - r.p0(i)) * r.invDelta(i);
+        // NaN if the ray lies in the middle plane, in which case either side will do.
+        if (std::isnan(tm[i])) tm[i] = INFINITY;
+    }
+    // The first octant is found from the plane the ray entered the node through:
+    // on the other two axes, it's in the upper half if it's already crossed the middle.
+    int entry = 0;
+    if (t0[1] > t0[entry]) entry = 1;
+    if (t0[2] > t0[entry]) entry = 2;
+    int o = 0;
+    for (int i = 0; i < 3; i++) {
+        if (i != entry && tm[i] < t0[entry]) o |= 1 << i;
+    }
+    while (true) {
+        float c0[3], c1[3];
+        Vec3 clo = lo;
+        for (int i = 0; i < 3; i++) {
+            bool upper = o & (1 << i);
+            c0[i] = upper ? tm[i] : t0[i];
+            c1[i] = upper ? t1[i] : tm[i];
+            if (upper) clo(i) += half(i);
+        }
+        int64_t child = n->child(o ^ r.a);
+        if (child != -1 && walkOctant(tree, r, child, clo, half, c0, c1, leaf)) return true;
+        // Move to the neighbour across whichever face of this octant the ray leaves through, unless that's out of the node.
+        int exit = 0;
+        if (c1[1] < c1[exit]) exit = 1;
+        if (c1[2] < c1[exit]) exit = 2;
+        if (o & (1 << exit)) return false;
+        o |= 1 << exit;
+    }
+}
+
+// Walks the octree's leaves front to back, along the part of the ray between its tMin and tMax.
+// "Revelles J., Ureña C., Lastra M.: An Efficient Parametric Algorithm for Octree Traversal"
+// Mirroring the ray so it travels in +x/+y/+z means the octant it starts in, and the one it moves into next,
+// only depend on which planes it crosses first, and only octants it actually passes through are visited.
+// leaf(const OctNode *n, float tEnter, float tExit) is called for each leaf, and returns true to stop.
+template <typename F>
+void walkOctree(const Octree *tree, const Ray &r, F leaf) {
+    OctRay m = {r.p0, r.invDelta, 0, r.tMin};
+    float t0[3], t1[3];
+    for (int i = 0; i < 3; i++) {
+        if (r.sign[i]) {
+            // Mirrored about the centre of the root cell.
+            m.p0(i) = tree->min(i) + tree->max(i) - r.p0(i);
+            m.invDelta(i) = -r.invDelta(i);
+            m.a |= 1 << i;
+        }
+        t0[i] = (tree->min(i) - m.p0(i)) * m.invDelta(i);
+        t1[i] = (tree->max(i) - m.p0(i)) * m.invDelta(i);
+    }
+    float tEnter = std::fmax(t0[0], std::fmax(t0[1], t0[2]));
+    float tExit = std::fmin(t1[0], std::fmin(t1[1], t1[2]));
+    if (tEnter > tExit || tExit < r.tMin || tEnter > r.tMax) return;
+    walkOctant(tree, m, 0, tree->min, tree->max - tree->min, t0, t1, leaf);
+}
+
+#endif
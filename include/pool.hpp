@@ -0,0 +1,63 @@
+#ifndef POOL
+#define POOL
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// JobGroup: A set of jobs submitted to a ThreadPool, which can be waited on together.
+struct JobGroup {
+    std::atomic<int> pending{0};
+};
+
+// ThreadPool: A set of long-lived worker threads that jobs are submitted to, so rendering, hierarchy building and texture loading don't pay for creating threads every time.
+// A thread waiting on a JobGroup runs queued jobs itself rather than sleeping, so jobs can safely submit (and wait on) jobs of their own.
+class ThreadPool {
+    public:
+        ThreadPool(int nthreads = -1);
+        ~ThreadPool();
+        // Stops the current workers (after their current job) and starts "nthreads" new ones. Queued jobs are kept.
+        void resize(int nthreads);
+        int size() { return nworkers; };
+        void submit(JobGroup *g, std::function<void()> job);
+        // Blocks until every job in "g" has finished.
+        void wait(JobGroup *g);
+        // Time (in seconds) each thread has spent running jobs since the last resetStats(), not counting time spent blocked in wait().
+        // There's one entry per worker, then a last one for any other threads that ran jobs while waiting.
+        std::vector<double> busyTimes();
+        void resetStats();
+    private:
+        struct Job {
+            JobGroup *g;
+            std::function<void()> fn;
+        };
+        std::vector<std::thread> workers;
+        int nworkers;
+        std::deque<Job> jobs;
+        std::mutex lock;
+        // Workers sleep on jobAvailable, waiters on jobDone (which is also signalled on submit, so they can help).
+        std::condition_variable jobAvailable;
+        std::condition_variable jobDone;
+        bool stopping;
+        std::mutex resizeLock;
+        // Nanoseconds spent running jobs, indexed like busyTimes().
+        std::unique_ptr<std::atomic<int64_t>[]> busy;
+        void start(int nthreads);
+        void stop();
+        void worker(int index);
+        bool runOne();
+        void run(Job &job);
+};
+
+// Runs fn(chunk, begin, end) over [0, n) in chunks of "chunk", as jobs on "pool" if given (and there's more than one), otherwise on the calling thread.
+// Returns the number of chunks.
+uint32_t parallelChunks(ThreadPool *pool, uint32_t n, uint32_t chunk, std::function<void(uint32_t, uint32_t, uint32_t)> fn);
+
+#endif
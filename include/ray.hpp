@@ -14,7 +14,6 @@ bool meetsTriangle(Vec3 normal, Vec3 collisionPoint, Triangle *tri);
 float meetsTriangleMT(Vec3 p0, Vec3 delta, Triangle *tri, Vec3 *bary);
 Vec2 triUV(Vec3 bary, Triangle *tri);
 bool meetsAABB(Vec3 p0, Vec3 delta, Container *container);
-float meetAABB(Vec3 p0, Vec3 delta, Vec3 a, Vec3 b);
 float meetAABBWithNormal(Vec3 p0, Vec3 delta, Vec3 a, Vec3 b, Vec3 *normal);
 Vec2 aabUV(Vec3 p0, AAB *aab, Vec3 normal);
 Vec2 sphereUV(Sphere *s, Vec3 p);
@@ -0,0 +1,21 @@
+#ifndef SBVH
+#define SBVH
+
+#include "bvh.hpp"
+#include "shape.hpp"
+
+// Most references an SBVH can make to shapes beyond one each, as a multiple of the number of shapes, which bounds the memory it can take.
+#define SBVH_MAX_DUPLICATION 1.f
+
+class ThreadPool;
+
+// Builds a LinearBVH over the shapes in "flat" like buildLinearBVH, but at each node also considers splitting space rather than the shapes,
+// giving a shape straddling the split a reference on each side, with its box clipped to that side (triangles are clipped exactly).
+// "Stich M., Friedrich H., Dietrich A.: Spatial Splits in Bounding Volume Hierarchies"
+// Large shapes (e.g. walls and floors) otherwise make the children of every node they're in overlap, so rays have to visit both.
+// Spatial splits are only tried where the children of the best object split overlap by more than "alpha" of the root's surface area,
+// and stop once SBVH_MAX_DUPLICATION extra references have been made.
+// Returns NULL if the tree is too deep to be traversed with a stack of BVH_STACK_SIZE.
+LinearBVH *buildSBVH(Container *flat, int maxDepth, int maxLeafSize = 2, float costTriSphereRatio = 1.5f, int nBins = 16, float alpha = 1e-5f, ThreadPool *pool = NULL);
+
+#endif
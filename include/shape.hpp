@@ -9,6 +9,7 @@
 #include <iostream>
 #include <sstream>
 #include <cstring>
+#include <cmath>
 
 class Sphere;
 class Triangle;
@@ -26,8 +27,10 @@ namespace ShapeType {
     const int CSG = 3;
     const int Cylinder = 4;
     const int Cone = 5;
+    // A placed copy of an included file (see instance.hpp).
+    const int Instance = 6;
 
-    const int Count = 6;
+    const int Count = 7;
 }
 
 inline const float EPSILON = 0.00001f;
@@ -83,6 +86,25 @@ struct Bound {
     }
 };
 
+// Ray: p0 + t*delta, along with what every box test needs from it, worked out once when the ray is made.
+// Only distances within [tMin, tMax] count.
+struct Ray {
+    Vec3 p0, delta;
+    Vec3 invDelta;
+    // 1 where delta is negative, so the near and far planes of a box can be picked by index rather than compared.
+    // Taken from the sign bit so it always agrees with invDelta: -0 is negative, as 1/-0 is -inf.
+    int sign[3];
+    float tMin, tMax;
+    Ray(Vec3 p0, Vec3 delta, float tMin = 0.f, float tMax = 1e30f):
+        p0(p0),
+        delta(delta),
+        invDelta({1.f/delta.x, 1.f/delta.y, 1.f/delta.z}),
+        sign{std::signbit(delta.x), std::signbit(delta.y), std::signbit(delta.z)},
+        tMin(tMin),
+        tMax(tMax)
+    {};
+};
+
 class Shape {
     public:
         Material *material;
@@ -90,9 +112,12 @@ class Shape {
         bool transformDirty;
         bool debug;
         Vec2 uvScale;
+        // Index of the shape in the flattened map (or -1), so per-shape data can be kept in arrays rather than maps.
+        int id;
         Shape() {
             material = NULL;
             debug = false;
+            id = -1;
             uvScale = {1.f, 1.f};
             transformDirty = true;
             transform.reset();
@@ -103,18 +128,21 @@ class Shape {
             transformDirty = sh->transformDirty;
             debug = sh->debug;
             uvScale = sh->uvScale;
+            id = -1;
         };
         virtual Shape *clone() { return NULL; };
         virtual Material *mat() { return material; };
         virtual Transform& trans() { return transform; };
         virtual void bounds(Bound *bo) = 0;
-        virtual float intersect(Vec3 p0, Vec3 delta, Vec3 *normal = NULL, Vec2 *uv = NULL, float *t1 = NULL, Vec3 *normal1 = NULL, Vec2 *uv1 = NULL) = 0;
-        virtual bool intersects(Vec3 p0, Vec3 delta) = 0;
+        virtual float intersect(const Ray &r, Vec3 *normal = NULL, Vec2 *uv = NULL, float *t1 = NULL, Vec3 *normal1 = NULL, Vec2 *uv1 = NULL) = 0;
+        virtual bool intersects(const Ray &r) = 0;
         virtual void applyTransform() = 0;
         virtual void bakeTransform() = 0;
         virtual void refract(float ri, Vec3 p0, Vec3 delta, Vec3 *p1, Vec3 *delta1) = 0;
         virtual bool envelops(Vec3 /*min*/, Vec3 /*max*/) { return false; };
         virtual bool envelops(Bound& bo) { return envelops(bo.min, bo.max); };
+        // Unbounded shapes can't be put in a hierarchy, and are tested separately for every ray.
+        virtual bool unbounded() { return false; };
         virtual int clear(bool /*deleteShapes*/ = true) { return 0; };
         virtual std::string name() = 0;
         virtual int type() = 0;
@@ -193,7 +221,6 @@ class MaterialStore {
     Bound *end;
     bool plane;
     int splitAxis;
-    bool voxelSubdiv;
     int size;
     int id;
 }; */
@@ -226,16 +253,29 @@ class AAB: public Shape {
         virtual std::string name() { return std::string("Box"); };
         virtual int type() { return ShapeType::AAB; };
         virtual void bounds(Bound *bo);
-        virtual float intersect(Vec3 p0, Vec3 delta, Vec3 *normal = NULL, Vec2 *uv = NULL, float *t1 = NULL, Vec3 *normal1 = NULL, Vec2 *uv1 = NULL);
-        virtual bool intersects(Vec3 p0, Vec3 delta);
+        virtual float intersect(const Ray &r, Vec3 *normal = NULL, Vec2 *uv = NULL, float *t1 = NULL, Vec3 *normal1 = NULL, Vec2 *uv1 = NULL);
+        virtual bool intersects(const Ray &r);
         virtual void applyTransform();
         virtual void bakeTransform();
         virtual bool envelops(Vec3 mn, Vec3 mx);
         virtual void refract(float ri, Vec3 p0, Vec3 delta, Vec3 *p1, Vec3 *delta1);
         virtual void recalculateUVs(Texture *t = NULL);
 };
-// See note in shape.cpp for why this is here.
-float meetAABB(Vec3 p0, Vec3 delta, Vec3 a, Vec3 b);
+// Same slab test as AAB::intersect, without the normal/UV stuff. Used for BVHs and such.
+// Kept next to AAB so the two versions are centralised, and inline since it's called for every node a ray visits.
+// Returns the distance to the nearer face (negative if we're inside), -9999 if the box is behind/beyond the ray's [tMin, tMax], or -9998 if missed.
+inline float meetAABB(const Ray &r, Vec3 a, Vec3 b) {
+    Vec3 bounds[2] = {a, b};
+    float tmin = -9999.f;
+    float tmax = r.tMax;
+    for (int i = 0; i < 3; i++) {
+        tmin = std::fmax(tmin, (bounds[r.sign[i]](i) - r.p0(i)) * r.invDelta(i));
+        tmax = std::fmin(tmax, (bounds[1-r.sign[i]](i) - r.p0(i)) * r.invDelta(i));
+    }
+    if (tmax < r.tMin) return -9999.f;
+    if (tmin > tmax) return -9998.f;
+    return tmin;
+}
 
 class Container: public AAB {
     public:
@@ -243,12 +283,10 @@ class Container: public AAB {
         Bound *end;
         bool plane;
         int splitAxis;
-        bool voxelSubdiv;
         int size;
         int id;
         Container(bool isPlane = false) {
             plane = isPlane;
-            voxelSubdiv = 0;
             start = NULL;
             end = NULL;
             size = 0;
@@ -258,7 +296,6 @@ class Container: public AAB {
         Container(Shape *sh): AAB(sh) {
             Container *c = static_cast<Container*>(sh);
             plane = c->plane;
-            voxelSubdiv = c->voxelSubdiv;
             start = c->start;
             end = c->end;
             size = c->size;
@@ -308,8 +345,8 @@ class Sphere: public Shape {
         virtual std::string name() { return std::string("Sphere"); };
         virtual int type() { return ShapeType::Sphere; };
         virtual void bounds(Bound *bo);
-        virtual float intersect(Vec3 p0, Vec3 delta, Vec3 *normal = NULL, Vec2 *uv = NULL, float *t1 = NULL, Vec3 *normal1 = NULL, Vec2 *uv1 = NULL);
-        virtual bool intersects(Vec3 p0, Vec3 delta);
+        virtual float intersect(const Ray &r, Vec3 *normal = NULL, Vec2 *uv = NULL, float *t1 = NULL, Vec3 *normal1 = NULL, Vec2 *uv1 = NULL);
+        virtual bool intersects(const Ray &r);
         virtual void applyTransform();
         virtual void bakeTransform();
         virtual bool envelops(Vec3 mn, Vec3 mx);
@@ -355,15 +392,16 @@ class Triangle: public Shape {
         };
         virtual std::string name() { return plane ? std::string("Plane") : std::string("Triangle"); };
         virtual int type() { return ShapeType::Triangle; };
+        virtual bool unbounded() { return plane; };
         Vec3 visibleNormal(Vec3 delta);
-        float intersectsPlane(Vec3 p0, Vec3 delta, Vec3 normal);
+        float intersectsPlane(const Ray &r, Vec3 normal);
         bool projectAndPiP(Vec3 normal, Vec3 hit);
         bool PiP(Vec2 projHit, Vec2 projA, Vec2 projB, Vec2 projC);
-        float intersectMT(Vec3 p0, Vec3 delta, Vec3 *bary);
+        float intersectMT(const Ray &r, Vec3 *bary);
         
         virtual void bounds(Bound *bo);
-        virtual float intersect(Vec3 p0, Vec3 delta, Vec3 *normal = NULL, Vec2 *uv = NULL, float *t1 = NULL, Vec3 *normal1 = NULL, Vec2 *uv1 = NULL);
-        virtual bool intersects(Vec3 p0, Vec3 delta);
+        virtual float intersect(const Ray &r, Vec3 *normal = NULL, Vec2 *uv = NULL, float *t1 = NULL, Vec3 *normal1 = NULL, Vec2 *uv1 = NULL);
+        virtual bool intersects(const Ray &r);
         virtual void applyTransform();
         virtual void bakeTransform();
         // A triangle can't envelop a 3d object, so envelops() is left empty (returning false).
@@ -398,11 +436,11 @@ class CSG: public Shape {
         int append(Shape *sh);
         virtual Material *mat() { return a->mat(); };
         virtual void bounds(Bound *bo);
-        virtual float intersect(Vec3 p0, Vec3 delta, Vec3 *normal = NULL, Vec2 *uv = NULL, float *t1 = NULL, Vec3 *normal1 = NULL, Vec2 *uv1 = NULL);
-        virtual float intersectUnion(Vec3 p0, Vec3 delta, Vec3 *normal = NULL, Vec2 *uv = NULL, float *t1 = NULL, Vec3 *normal1 = NULL, Vec2 *uv1 = NULL);
-        virtual float intersectIntersection(Vec3 p0, Vec3 delta, Vec3 *normal = NULL, Vec2 *uv = NULL, float *t1 = NULL, Vec3 *normal1 = NULL, Vec2 *uv1 = NULL);
-        virtual float intersectDifference(Vec3 p0, Vec3 delta, Vec3 *normal = NULL, Vec2 *uv = NULL, float *t1 = NULL, Vec3 *normal1 = NULL, Vec2 *uv1 = NULL);
-        virtual bool intersects(Vec3 p0, Vec3 delta);
+        virtual float intersect(const Ray &r, Vec3 *normal = NULL, Vec2 *uv = NULL, float *t1 = NULL, Vec3 *normal1 = NULL, Vec2 *uv1 = NULL);
+        virtual float intersectUnion(const Ray &r, Vec3 *normal = NULL, Vec2 *uv = NULL, float *t1 = NULL, Vec3 *normal1 = NULL, Vec2 *uv1 = NULL);
+        virtual float intersectIntersection(const Ray &r, Vec3 *normal = NULL, Vec2 *uv = NULL, float *t1 = NULL, Vec3 *normal1 = NULL, Vec2 *uv1 = NULL);
+        virtual float intersectDifference(const Ray &r, Vec3 *normal = NULL, Vec2 *uv = NULL, float *t1 = NULL, Vec3 *normal1 = NULL, Vec2 *uv1 = NULL);
+        virtual bool intersects(const Ray &r);
         virtual void applyTransform();
         virtual void bakeTransform();
         virtual int clear(bool deleteShapes = true);
@@ -446,9 +484,9 @@ class Cylinder: public Shape {
         virtual std::string name() { return std::string("Cylinder"); };
         virtual int type() { return ShapeType::Cylinder; };
         virtual void bounds(Bound *bo);
-        virtual float intersect(Vec3 p0, Vec3 delta, Vec3 *normal = NULL, Vec2 *uv = NULL, float *t1 = NULL, Vec3 *normal1 = NULL, Vec2 *uv1 = NULL);
-        virtual bool intersects(Vec3 p0, Vec3 delta);
-        virtual float intersectFlatEndCaps(Vec3 p0, Vec3 delta, Vec3 *normal = NULL, Vec2 *uv = NULL, float *t1 = NULL, Vec3 *normal1 = NULL, Vec2 *uv1 = NULL);
+        virtual float intersect(const Ray &r, Vec3 *normal = NULL, Vec2 *uv = NULL, float *t1 = NULL, Vec3 *normal1 = NULL, Vec2 *uv1 = NULL);
+        virtual bool intersects(const Ray &r);
+        virtual float intersectFlatEndCaps(const Ray &r, Vec3 *normal = NULL, Vec2 *uv = NULL, float *t1 = NULL, Vec3 *normal1 = NULL, Vec2 *uv1 = NULL);
         virtual void applyTransform();
         virtual void bakeTransform();
         virtual void recalculateUVs(Texture* t = NULL);
@@ -493,8 +531,8 @@ class Cone: public Shape {
         virtual std::string name() { return std::string("Cone"); };
         virtual int type() { return ShapeType::Cone; };
         virtual void bounds(Bound *bo);
-        virtual float intersect(Vec3 p0, Vec3 delta, Vec3 *normal = NULL, Vec2 *uv = NULL, float *t1 = NULL, Vec3 *normal1 = NULL, Vec2 *uv1 = NULL);
-        virtual bool intersects(Vec3 p0, Vec3 delta);
+        virtual float intersect(const Ray &r, Vec3 *normal = NULL, Vec2 *uv = NULL, float *t1 = NULL, Vec3 *normal1 = NULL, Vec2 *uv1 = NULL);
+        virtual bool intersects(const Ray &r);
         virtual void applyTransform();
         virtual void bakeTransform();
         virtual void recalculateUVs(Texture* t = NULL);
@@ -539,6 +577,9 @@ struct Decoder {
 
     Material *decodeMaterial(std::string in, bool definition = false);
 
+    // Appends the names of any textures, normal maps and reflectance maps referenced on the given line, without loading them.
+    void collectTextures(std::string in, std::vector<std::string> *t, std::vector<std::string> *n, std::vector<std::string> *r);
+
     // std::string encodePointLight(PointLight *p);
 
     PointLight decodePointLight(std::string in);
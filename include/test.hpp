@@ -1,11 +1,25 @@
 #ifndef TESTS
 #define TESTS
+#include <vector>
+#include "bvh.hpp"
 #include "shape.hpp"
 
 Triangle *triList(int n = 1000, int *seed = NULL);
 Sphere *sphereList(int n = 1000, int *seed = NULL);
+// n random shapes of the given ShapeType (but not Instances, which need a Mesh), in the same space as triList's and sphereList's.
+// A seed of -9998 is replaced with a random one, as for the others.
+std::vector<Shape*> shapeList(int type, int n = 1000, int *seed = NULL);
 
 double traverseAll(Triangle *t, int n = 1000);
 double traverseAll(Sphere *s, int n = 1000);
+// Time (in ms) taken to intersect each shape with a ray from the origin to a random point within its bounds, through Shape::intersect as the renderer would.
+double traverseAll(const std::vector<Shape*> &shapes, int *seed = NULL);
+// Time (in ms) taken to test a ray from the origin to a random point within each node against it, with meetsNode as BVH traversal would.
+// "hits" is set to the number of nodes met, which should be all of them.
+double traverseAll(const std::vector<BVHNode> &nodes, int *hits, int *seed = NULL);
+
+// Checks the box tests (meetAABB, meetsNode, AAB::intersect, KdTree::clip and meetsChildren) give the same result for a ray inside a box
+// whether a zero component of its direction is +0 or -0, printing any that don't. Returns true if they all do.
+bool checkSignedZeroRays();
 
 #endif
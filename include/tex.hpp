@@ -6,6 +6,8 @@
 #include <string>
 #include <vector>
 
+class ThreadPool;
+
 struct Texture {
     Image *img;
     Vec2 scale;
@@ -25,6 +27,9 @@ class TexStore {
         Texture* from(std::string fname);
         int id(std::string fname);
         int load(std::string fname);
+        // Decodes the given textures in parallel on "pool", so the following load() calls for them return immediately.
+        // Failed loads are left for load() to report.
+        void preload(std::vector<std::string> &names, ThreadPool *pool);
         void clear();
         // Stinky way to return load success/failure
         bool lastLoadFail;
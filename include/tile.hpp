@@ -0,0 +1,37 @@
+#ifndef TILE
+#define TILE
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+
+struct Tile {
+    int w0, w1, h0, h1;
+};
+
+// TileScheduler: Splits an image into small square tiles, and hands them out to render threads.
+// Tiles are ordered along a Morton (Z-order) curve, so consecutive tiles are spatially close and primary rays stay coherent.
+// Each thread is given a contiguous run of the curve in its own deque, which it pops from the front of.
+// Once a thread runs out, it steals from the back of another thread's deque, so no core sits idle while another still has an expensive area (e.g. a mesh or reflective sphere) left.
+class TileScheduler {
+    public:
+        TileScheduler(int width, int height, int nthreads, int tileSize = 16);
+        ~TileScheduler();
+        // Stores the next tile for thread "thread" in "t". Returns false when there is no work left anywhere.
+        bool next(int thread, Tile *t);
+        int tileCount;
+        std::atomic<int> steals;
+    private:
+        struct Queue {
+            std::mutex lock;
+            std::deque<Tile> tiles;
+        };
+        Queue *queues;
+        int nqueues;
+        bool steal(int thread, Tile *t);
+};
+
+// Interleaves the bits of x and y, giving the tile's position along a Morton (Z-order) curve.
+unsigned int mortonCode2D(unsigned int x, unsigned int y);
+
+#endif
@@ -0,0 +1,133 @@
+#ifndef WIDEBVH
+#define WIDEBVH
+
+#include <cstdint>
+#include <vector>
+#include "bvh.hpp"
+#include "shape.hpp"
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#define WIDEBVH_SSE
+#endif
+
+// A child of a wide node waiting to be visited, and the distance at which the ray enters it.
+struct WideStackEntry {
+    uint32_t child;
+    // Non-zero if the child is a leaf.
+    uint32_t primCount;
+    float t;
+};
+
+// WideBVHNode: Up to W children, with their boxes stored axis by axis so a ray can be tested against all of them at once.
+template <int W>
+struct alignas(32) WideBVHNode {
+    // [min/max][axis][child]. Unused slots hold an inverted (+inf to -inf) box, which no ray can hit.
+    float bounds[2][3][W];
+    // Index of each child in WideBVH::nodes, or for leaves, where its shapes start in primIndices.
+    uint32_t child[W];
+    // Number of shapes in each leaf child, 0 for interior children.
+    uint16_t primCount[W];
+    uint8_t childCount;
+};
+
+// WideBVH: A binary LinearBVH collapsed so each node has up to W (4 or 8) children, making the tree shallower
+// and letting each visit test every child box in one SIMD pass.
+template <int W>
+struct WideBVH {
+    std::vector<WideBVHNode<W>> nodes;
+    std::vector<uint32_t> primIndices;
+    std::vector<Shape*> prims;
+    // Most entries the traversal stack will need.
+    int stackDepth;
+    size_t memoryUsage() {
+        return nodes.size()*sizeof(WideBVHNode<W>) + primIndices.size()*sizeof(uint32_t) + prims.size()*sizeof(Shape*);
+    };
+};
+
+// Collapses "bvh" into a W-wide tree, by repeatedly pulling the children of the largest (by surface area) interior child up into its parent until it's full.
+// Only built for W = 4 and 8. Returns NULL if a node of "bvh" has more than W children, or the result needs a stack bigger than BVH_STACK_SIZE.
+template <int W>
+WideBVH<W> *collapseBVH(const LinearBVH *bvh);
+
+// refitBVH and bvhCost for wide trees. Only built for W = 4 and 8.
+template <int W>
+void refitWideBVH(WideBVH<W> *bvh, const std::vector<bool> &dirty);
+template <int W>
+float wideBvhCost(const WideBVH<W> *bvh, float costTriSphereRatio, float *rootSA = NULL);
+
+// Slab test of a ray against every child box of "n", only counting the part of the ray within [tMin, tMax].
+// Stores the distance at which the ray enters each child in t, and returns a bitmask of those hit.
+template <int W>
+inline int meetsChildren(const WideBVHNode<W> *n, const Ray &r, float *t) {
+    int mask = 0;
+    for (int c = 0; c < W; c++) {
+        float tmin = r.tMin;
+        float tmax = r.tMax;
+        for (int i = 0; i < 3; i++) {
+            tmin = std::fmax(tmin, (n->bounds[r.sign[i]][i][c] - r.p0(i)) * r.invDelta(i));
+            tmax = std::fmin(tmax, (n->bounds[1-r.sign[i]][i][c] - r.p0(i)) * r.invDelta(i));
+        }
+        t[c] = tmin;
+        mask |= int(tmin <= tmax) << c;
+    }
+    return mask;
+}
+
+#ifdef WIDEBVH_SSE
+// The slab test is the same as the scalar version, with one lane per child.
+// max/min return their second argument when either is NaN (from 0 * inf, i.e. a ray parallel to and on a box face), so NaNs are passed first to be ignored.
+template <>
+inline int meetsChildren<4>(const WideBVHNode<4> *n, const Ray &r, float *t) {
+    __m128 tmin = _mm_set1_ps(r.tMin);
+    __m128 tmax = _mm_set1_ps(r.tMax);
+    for (int i = 0; i < 3; i++) {
+        __m128 p0 = _mm_set1_ps(r.p0(i));
+        __m128 inv = _mm_set1_ps(r.invDelta(i));
+        __m128 near = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n->bounds[r.sign[i]][i]), p0), inv);
+        __m128 far = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n->bounds[1-r.sign[i]][i]), p0), inv);
+        tmin = _mm_max_ps(near, tmin);
+        tmax = _mm_min_ps(far, tmax);
+    }
+    _mm_storeu_ps(t, tmin);
+    return _mm_movemask_ps(_mm_cmple_ps(tmin, tmax));
+}
+
+template <>
+inline int meetsChildren<8>(const WideBVHNode<8> *n, const Ray &r, float *t) {
+#ifdef __AVX__
+    __m256 tmin = _mm256_set1_ps(r.tMin);
+    __m256 tmax = _mm256_set1_ps(r.tMax);
+    for (int i = 0; i < 3; i++) {
+        __m256 p0 = _mm256_set1_ps(r.p0(i));
+        __m256 inv = _mm256_set1_ps(r.invDelta(i));
+        __m256 near = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(n->bounds[r.sign[i]][i]), p0), inv);
+        __m256 far = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(n->bounds[1-r.sign[i]][i]), p0), inv);
+        tmin = _mm256_max_ps(near, tmin);
+        tmax = _mm256_min_ps(far, tmax);
+    }
+    _mm256_storeu_ps(t, tmin);
+    return _mm256_movemask_ps(_mm256_cmp_ps(tmin, tmax, _CMP_LE_OQ));
+#else
+    // Without AVX (i.e. not built with -march=native), do each half with SSE.
+    int mask = 0;
+    for (int h = 0; h < 8; h += 4) {
+        __m128 tmin = _mm_set1_ps(r.tMin);
+        __m128 tmax = _mm_set1_ps(r.tMax);
+        for (int i = 0; i < 3; i++) {
+            __m128 p0 = _mm_set1_ps(r.p0(i));
+            __m128 inv = _mm_set1_ps(r.invDelta(i));
+            __m128 near = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n->bounds[r.sign[i]][i] + h), p0), inv);
+            __m128 far = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n->bounds[1-r.sign[i]][i] + h), p0), inv);
+            tmin = _mm_max_ps(near, tmin);
+            tmax = _mm_min_ps(far, tmax);
+        }
+        _mm_storeu_ps(t + h, tmin);
+        mask |= _mm_movemask_ps(_mm_cmple_ps(tmin, tmax)) << h;
+    }
+    return mask;
+#endif
+}
+#endif
+
+#endif
@@ -15,6 +15,8 @@
 
 #define WINDOW_TITLE "COMP3931 Individual Project - rt"
 #define MAP_PATH "maps/cone.map"
+// Directory built hierarchies are cached in, so reopening a map with the same settings skips the build.
+#define CACHE_PATH ".rtcache"
 // #define MAP_PATH "maps/scene.map"
 
 namespace {
@@ -29,7 +31,7 @@ namespace {
 std::string csvStats(GLWindow *window, WorldMap *map, bool header = false) {
     std::ostringstream out;
     if (header) {
-        out << "Map Name,# Tris,# Planes,# Spheres,# AABs,# Lights,Max Ray bounces,Render mode,Phi (l/r) (radians),Theta (u/d) (radians),Field of View (°),Position (x y z),Render time (ms),Width (px),Height (px),# Threads,Acceleration Method,Max splitting depth,Structure build time (ms),Accel Int Param,Accel Float Param," << ",";
+        out << "Map Name,# Tris,# Planes,# Spheres,# AABs,# Lights,Max Ray bounces,Render mode,Phi (l/r) (radians),Theta (u/d) (radians),Field of View (°),Position (x y z),Render time (ms),Width (px),Height (px),# Threads,Acceleration Method,Max splitting depth,Structure build time (ms),Accel Int Param,Accel Float Param,SAH Cost," << ",";
         out << std::endl;
     }
     // Map & Cam info
@@ -44,13 +46,14 @@ std::string csvStats(GLWindow *window, WorldMap *map, bool header = false) {
     out << window->state.rc.nthreads << ",";
     // Hierarchy Info
     if (window->state.staleAccelConfig || !(window->state.useOptimizedMap)) {
-        out << ",,,,,";
+        out << ",,,,,,";
     } else {
         out << accelerators[window->state.accelIndex] << ",";
         out << window->state.accelDepth << ",";
         out << int(window->state.lastOptimizeTime * 1000.f) << ",";
         out << map->accelParam << ",";
         out << map->accelFloatParam << ",";
+        out << map->builtCost << ",";
     }
 
     
@@ -64,11 +67,14 @@ Image *mainLoop(RenderConfig *rc) {
     if (window->state.reloadMap && !map->currentlyLoading) {
         if (!window->state.currentlyLoading) {
             window->state.currentlyLoading = true;
+            // The shapes go with the old map.
+            window->state.movedShapes.clear();
             // map->loadFile(window->state.mapPath.c_str());
             window->state.camPresetCount = 0;
             window->state.camPresetNames = NULL;
             window->state.rc.baseBrightness = -1.f;
             window->state.rc.globalShininess = -1.f;
+            map->instanceIncludes = window->state.instanceIncludes;
             std::thread load(&WorldMap::loadFile, map, window->state.mapPath.c_str(), glfwGetTime);
             load.detach();
         } else {
@@ -89,6 +95,17 @@ Image *mainLoop(RenderConfig *rc) {
         window->state.lastLoadTime = glfwGetTime() - map->lastLoadTime;
     }
 
+    map->refitRebuildRatio = window->state.refitRebuildRatio;
+    // Waits for any render in progress, as refitting changes the boxes it's traversing.
+    // Shapes moved while the hierarchy's being built, or while the unoptimized map's in use, are kept until it can be refit,
+    // otherwise it (and flatObj's bounds, which the next build takes) would be left around where they were.
+    if (!window->state.movedShapes.empty() && !map->currentlyRendering &&
+        window->state.useOptimizedMap && map->obj == map->optimizedObj && !map->currentlyOptimizing) {
+        if (map->refitMap(window->state.movedShapes, glfwGetTime)) window->state.staleAccelConfig = true;
+        window->state.movedShapes.clear();
+        change = true;
+    }
+
     if (window->state.useOptimizedMap) {
         bool hierarchyChanged = 
             (window->state.accelDepth != map->optimizeLevel ||
@@ -96,6 +113,15 @@ Image *mainLoop(RenderConfig *rc) {
             window->state.useBVH != map->bvh ||
             window->state.accelParam != map->accelParam ||
             window->state.accelFloatParam != map->accelFloatParam ||
+            window->state.accelBins != map->accelBins ||
+            window->state.accelWidth != map->accelWidth ||
+            window->state.accelSplitAlpha != map->accelSplitAlpha ||
+            window->state.accelTreeletLevels != map->accelTreeletLevels ||
+            window->state.accelSearchRadius != map->accelSearchRadius ||
+            window->state.accelLayout != map->accelLayout ||
+            window->state.accelLayoutStats != map->accelLayoutStats ||
+            window->state.useMeasuredCosts != map->useMeasuredCosts ||
+            window->state.remeasureCosts ||
             window->state.staleAccelConfig);
 
         if (hierarchyChanged && !change) { window->state.staleAccelConfig = true; }
@@ -108,12 +134,29 @@ Image *mainLoop(RenderConfig *rc) {
             map->bvh = window->state.useBVH;
             map->accelParam = window->state.accelParam;
             map->accelFloatParam = window->state.accelFloatParam;
+            map->accelBins = window->state.accelBins;
+            map->accelWidth = window->state.accelWidth;
+            map->accelSplitAlpha = window->state.accelSplitAlpha;
+            map->accelTreeletLevels = window->state.accelTreeletLevels;
+            map->accelSearchRadius = window->state.accelSearchRadius;
+            map->accelLayout = window->state.accelLayout;
+            map->accelLayoutStats = window->state.accelLayoutStats;
+            map->useMeasuredCosts = window->state.useMeasuredCosts;
+            // Measured on the optimize thread before it builds, so the costs aren't shown while they're being written.
+            map->remeasureCosts = window->state.remeasureCosts;
+            if (window->state.remeasureCosts) window->state.shapeCosts = NULL;
+            window->state.remeasureCosts = false;
             window->state.currentlyOptimizing = true;
             std::thread opt(&WorldMap::optimizeMap, map, glfwGetTime, window->state.accelDepth, map->accelIndex);
             opt.detach();
             window->state.staleAccelConfig = false;
         } else if (!map->currentlyOptimizing) {
             window->state.lastOptimizeTime = map->lastOptimizeTime;
+            window->state.lastOptimizeAllocations = map->lastBuildStats.allocations;
+            window->state.lastOptimizePeakBytes = map->lastBuildStats.peakBytes;
+            window->state.lastOptimizeCost = map->builtCost;
+            window->state.splitSAHCost = map->splitSAHCost;
+            window->state.shapeCosts = map->shapeCostsMeasured ? map->shapeCosts : NULL;
             window->state.optimizedMap = map->optimizedObj;
             window->state.objectPtrs = map->objectPtrs;
             window->state.objectNames = map->objectNames;
@@ -223,9 +266,10 @@ int main(int argc, char **argv) {
     float windowScaleFactor = INIT_SCALE_FACTOR;
     float cameraFOV = float(INIT_FOV)*M_PI / 180.f;
     std::string mapPath = MAP_PATH;
+    std::string cachePath = CACHE_PATH;
 
     int flag;
-    while ((flag = getopt(argc, argv, "hW:H:s:f:m:")) != -1) {
+    while ((flag = getopt(argc, argv, "hW:H:s:f:m:c:")) != -1) {
         switch (flag) {
             case 'W': {
                 windowWidth = std::stoi(std::string(optarg));
@@ -242,8 +286,11 @@ int main(int argc, char **argv) {
             case 'm': {
                 mapPath = std::string(optarg);
             }; break;
+            case 'c': {
+                cachePath = std::string(optarg);
+            }; break;
             case 'h': {
-                std::fprintf(stderr, "%s\n%s -W <window width> -H <window height> -s <render scale factor> -f <fov (degrees)> -m <map path>\n", WINDOW_TITLE, argv[0]);
+                std::fprintf(stderr, "%s\n%s -W <window width> -H <window height> -s <render scale factor> -f <fov (degrees)> -m <map path> -c <hierarchy cache directory (\"\" to disable)>\n", WINDOW_TITLE, argv[0]);
                 return 0;
             }; break;
             case '?': {
@@ -259,6 +306,7 @@ int main(int argc, char **argv) {
 
     window = new GLWindow(windowWidth, windowHeight, windowScaleFactor, WINDOW_TITLE);
     map = new WorldMap(mapPath.c_str());
+    map->accelCachePath = cachePath;
     if (map->camPresetNames != NULL) {
         window->state.camPresets = &(map->camPresets);
         window->state.camPresetNames = map->camPresetNames;
@@ -4,18 +4,111 @@
 #include <cstdlib>
 #include <ctime>
 #include <algorithm>
-#include <thread>
+#include <atomic>
+#include <functional>
+#include <vector>
 #include "shape.hpp"
 #include "vec.hpp"
 #include "ray.hpp"
+#include "pool.hpp"
 
-const char *accelerators[5] = {"Divide objects evenly", "Surface area heuristic (SAH)", "Voxel Grid", "Bi-tree (Disables BVH)", "Nothing like Glassner/Octree (Disables BVH)"};
+const char *accelerators[12] = {"Divide objects evenly", "Surface area heuristic (SAH)", "Voxel Grid", "Bi-tree (Disables BVH)", "Nothing like Glassner/Octree (Disables BVH)", "Binned SAH", "In-place binned SAH", "4/8-wide SAH (SIMD)", "Two-level grid", "Spatial split BVH (SBVH)", "Linear BVH (Morton codes)", "Locally-ordered clustering (PLOC)"};
+const int acceleratorOrder[12] = {Accel::DivideObjectsEqually, Accel::SAH, Accel::MortonBVH, Accel::WideBVH, Accel::Voxel, Accel::TwoLevelGrid, Accel::BiTree, Accel::FalseOctree, Accel::BinnedSAH, Accel::InPlaceSAH, Accel::SpatialSplitBVH, Accel::PLOC};
 
 namespace {
     // Line generated with distinctColors.py
+    // Pool that builders submit work to, or NULL to build on the calling thread.
+    ThreadPool *buildPool = NULL;
     Vec3 distinctColors[16] = {{0.545, 0.271, 0.075}, {0.098, 0.098, 0.439}, {0.000, 0.502, 0.000}, {0.741, 0.718, 0.420}, {0.690, 0.188, 0.376}, {1.000, 0.000, 0.000}, {1.000, 0.647, 0.000}, {1.000, 1.000, 0.000}, {0.486, 0.988, 0.000}, {0.000, 0.980, 0.604}, {0.000, 1.000, 1.000}, {0.000, 0.000, 1.000}, {1.000, 0.000, 1.000}, {0.392, 0.584, 0.929}, {0.933, 0.510, 0.933}, {0.902, 0.902, 0.980}};
 }
 
+void setBuildPool(ThreadPool *pool) {
+    buildPool = pool;
+}
+
+Vec3 debugColor(int depth) {
+    return distinctColors[depth % 16];
+}
+
+namespace {
+    std::atomic<int64_t> buildAllocations{0};
+    std::atomic<int64_t> buildBytes{0};
+    std::atomic<int64_t> buildPeakBytes{0};
+}
+
+void resetBuildStats() {
+    buildAllocations = 0;
+    buildBytes = 0;
+    buildPeakBytes = 0;
+}
+
+BuildStats getBuildStats() {
+    return {size_t(buildAllocations), size_t(buildPeakBytes)};
+}
+
+void countBuildMemory(int64_t bytes, int64_t allocations) {
+    buildAllocations += allocations;
+    int64_t now = (buildBytes += bytes);
+    int64_t peak = buildPeakBytes;
+    while (now > peak && !buildPeakBytes.compare_exchange_weak(peak, now));
+}
+
+namespace {
+    // Nodes with fewer shapes than this are built on the current thread, as a task wouldn't be worth the overhead.
+    const int minParallelBuildSize = 256;
+    // Nodes with more shapes than this have them partitioned between children in chunks on the pool.
+    const int minParallelPartitionSize = 32768;
+    const int partitionChunkSize = 8192;
+
+    // Moves all of src's bounds onto the end of dst.
+    void joinContainers(Container *dst, Container *src) {
+        if (src->size == 0) return;
+        if (dst->start == NULL) dst->start = src->start;
+        else dst->end->next = src->start;
+        dst->end = src->end;
+        dst->size += src->size;
+        src->start = NULL;
+        src->end = NULL;
+        src->size = 0;
+    }
+
+    // Calls partition(from, to, parts) to distribute the shapes in [from, to) between "n" containers.
+    // Large nodes are split into chunks done in parallel, each filling their own set of containers, which are joined onto dst in order,
+    // so the result is the same as doing it in one go.
+    void partitionShapes(Container *o, Container **dst, int n, std::function<void(Bound*, Bound*, Container**)> partition) {
+        if (buildPool == NULL || o->size < minParallelPartitionSize) {
+            partition(o->start, o->end->next, dst);
+            return;
+        }
+        std::vector<Bound*> chunkStarts;
+        int i = 0;
+        Bound *bo = o->start;
+        while (bo != o->end->next) {
+            if (i % partitionChunkSize == 0) chunkStarts.emplace_back(bo);
+            i++;
+            bo = bo->next;
+        }
+        chunkStarts.emplace_back(o->end->next);
+        int nChunks = chunkStarts.size() - 1;
+        std::vector<Container> parts(nChunks*n);
+        std::vector<Container*> partPtrs(nChunks*n);
+        for (int j = 0; j < nChunks*n; j++) partPtrs[j] = &(parts[j]);
+
+        JobGroup chunks;
+        for (int j = 0; j < nChunks; j++) {
+            buildPool->submit(&chunks, [&, j]() {
+                partition(chunkStarts[j], chunkStarts[j+1], &(partPtrs[j*n]));
+            });
+        }
+        buildPool->wait(&chunks);
+        for (int j = 0; j < nChunks; j++) {
+            for (int k = 0; k < n; k++) {
+                joinContainers(dst[k], partPtrs[j*n + k]);
+            }
+        }
+    }
+}
+
 int whichSide(float bmin, float bmax, float a, float mid, float b) {
     bool left = false, right = false;
     if (
@@ -88,7 +181,7 @@ int splitBitree(Container *o, float *split, Bound *, Bound *, int *splitAxis, bo
     int axis = lastAxis+1;
     if (axis > 2) axis = 0;
     *splitAxis = axis;
-    *split = o->max(axis) + 0.5f*(o->max(axis) - o->min(axis));
+    *split = o->min(axis) + 0.5f*(o->max(axis) - o->min(axis));
     // *split = o->centroid(axis);
     return 0;
     /*
@@ -107,15 +200,26 @@ int splitBitree(Container *o, float *split, Bound *, Bound *, int *splitAxis, bo
 }
 
 namespace {
-    // Assumed cost values (C_o)
     // Assumed added cost of traversing the extra nodes added when splitting (C_i)
     const float cTraverse = 1.f;
-    const float cSphere = 1.f;
-    const float cAAB = 1.f;
+    // Assumed cost values (C_o), indexed by ShapeType. Triangles cost whatever ratio the builder's given.
+    // A CSG shape is two shapes. An instance is a traversal of its mesh's hierarchy, the ray moved into its space, and a few of its shapes.
+    const float assumedCosts[ShapeType::Count] = {1.f, 1.5f, 1.f, 2.f, 1.f, 1.f, 4.f};
+    // Set by setShapeCosts, in place of the above.
+    float measuredCosts[ShapeType::Count];
+    bool costsMeasured = false;
+}
+
+void setShapeCosts(const float *costs) {
+    costsMeasured = costs != NULL;
+    if (costsMeasured) std::memcpy(measuredCosts, costs, sizeof(measuredCosts));
 }
 
 void sahAxisSplits(int i, Container *o, float *spl, int *bestIndex, float *bestCost, Bound *bestBound, bool bvh, int *shapeCount, float costTriSphereRatio) {
-    float cTri = costTriSphereRatio;
+    float costs[ShapeType::Count];
+    for (int type = 0; type < ShapeType::Count; type++) {
+        costs[type] = shapeCost(type, costTriSphereRatio);
+    }
 
     int splitIndex = 0;
     bool countComplete = false;
@@ -131,7 +235,7 @@ void sahAxisSplits(int i, Container *o, float *spl, int *bestIndex, float *bestC
         splitBounds[0].max = {-1e30f, -1e30f, -1e30f};
         std::memcpy(&(splitBounds[1]), &(splitBounds[0]), sizeof(Bound));
         // int h = 0;
-        int h0[3] = {0, 0, 0}, h1[3] = {0, 0, 0};
+        int h0[ShapeType::Count] = {0}, h1[ShapeType::Count] = {0};
         Bound *bo = o->start;
         while (bo != o->end->next) {
             int shapeIndex = bo->s->type();
@@ -165,14 +269,13 @@ void sahAxisSplits(int i, Container *o, float *spl, int *bestIndex, float *bestC
         // We don't need to divide by totalSA, since its the same for all compared values
         
         float sa[2] = {aabbSA(splitBounds[0].min, splitBounds[0].max), aabbSA(splitBounds[1].min, splitBounds[1].max)};
-        if (h0[0] + h0[1] == 0) {
-            sa[0] = 0.f;
-        }
-        if (h1[0] + h1[1] == 0) {
-            sa[1] = 0.f;
+        // An empty side's box is inverted, so its area is meaningless, but it has no shapes to cost anyway.
+        float sideCosts[2] = {0.f, 0.f};
+        for (int type = 0; type < ShapeType::Count; type++) {
+            sideCosts[0] += h0[type]*costs[type];
+            sideCosts[1] += h1[type]*costs[type];
         }
-
-        float cost = cTraverse + (sa[0]*(h0[ShapeType::Sphere]*cSphere + h0[ShapeType::Triangle]*cTri + h0[ShapeType::AAB]*cAAB)) + (sa[1]*(h1[ShapeType::Sphere]*cSphere + h1[ShapeType::Triangle]*cTri + h1[ShapeType::AAB]*cAAB));
+        float cost = cTraverse + (sideCosts[0] == 0.f ? 0.f : sa[0]*sideCosts[0]) + (sideCosts[1] == 0.f ? 0.f : sa[1]*sideCosts[1]);
         if (cost < *bestCost) {
             *bestIndex = splitIndex;
             *bestCost = cost;
@@ -194,8 +297,6 @@ int splitSAH(Container *o, float *split, Bound *b0, Bound *b1, int *splitAxis, b
     // NOTES
     // Cost function given in paper IS suitable for now, as we do not yet cache intersections per ray (i.e. if leaf is in two AABBs, we currently test it twice).
     // Also see notes in sah.md
-   
-    const float cTri = costTriSphereRatio;
 
     Vec3 spl;
 
@@ -204,24 +305,22 @@ int splitSAH(Container *o, float *split, Bound *b0, Bound *b1, int *splitAxis, b
     Bound bestBounds[3][2];
 
     // float *surfaceAreas = (float*)malloc(sizeof(float)*o->size);
-    // shapeCount[0]: number of spheres, [1]: number of tris, [2]: number of aabs.
-    int shapeCount[3] = {0, 0, 0};
-
-    std::thread *axisThreads = new std::thread[3];
-
-    for (int i = 0; i < 3; i++) {
-        axisThreads[i] = std::thread(&sahAxisSplits, i, o, &(spl(i)), &(bestIndices[i]), &(bestCosts[i]), &(bestBounds[i][0]), bvh, i == 0 ? &shapeCount[0] : NULL, costTriSphereRatio);
-        // sahAxisSplits(i, o, &(spl(i)), &(bestIndices[i]), &(bestCosts[i]), &(bestBounds[i][0]), bvh, i == 0 ? &shapeCount[0] : NULL);
-        /*axisThreads[i] = std::thread([&, i]() {
-        });
-        */
-    }
-
-    for (int i = 0; i < 3; i++) {
-        axisThreads[i].join();
+    // Number of shapes of each ShapeType.
+    int shapeCount[ShapeType::Count] = {0};
+
+    // Y and Z are evaluated by the pool while we do X.
+    JobGroup axes;
+    for (int i = 1; i < 3; i++) {
+        if (buildPool != NULL) {
+            buildPool->submit(&axes, [&, i]() {
+                sahAxisSplits(i, o, &(spl(i)), &(bestIndices[i]), &(bestCosts[i]), &(bestBounds[i][0]), bvh, NULL, costTriSphereRatio);
+            });
+        } else {
+            sahAxisSplits(i, o, &(spl(i)), &(bestIndices[i]), &(bestCosts[i]), &(bestBounds[i][0]), bvh, NULL, costTriSphereRatio);
+        }
     }
-
-    delete[] axisThreads;
+    sahAxisSplits(0, o, &(spl(0)), &(bestIndices[0]), &(bestCosts[0]), &(bestBounds[0][0]), bvh, &shapeCount[0], costTriSphereRatio);
+    if (buildPool != NULL) buildPool->wait(&axes);
     // free(surfaceAreas);
 
     int bestAxis = 0;
@@ -240,8 +339,11 @@ int splitSAH(Container *o, float *split, Bound *b0, Bound *b1, int *splitAxis, b
     }
 
     // Determine the cost of just not traversing the given node unsplit, and check if it's any better.
-    // float noSplitCost = (cSphere*shapeCount[0]*totalSA[0]) + (cTri*shapeCount[1]*totalSA[1]);
-    float noSplitCost = aabbSA(o->min, o->max)*(cSphere*shapeCount[ShapeType::Sphere] + cTri*shapeCount[ShapeType::Triangle] + cAAB*shapeCount[ShapeType::AAB]);
+    float noSplitCost = 0.f;
+    for (int type = 0; type < ShapeType::Count; type++) {
+        noSplitCost += shapeCount[type]*shapeCost(type, costTriSphereRatio);
+    }
+    noSplitCost *= aabbSA(o->min, o->max);
     if (bestCost >= noSplitCost) {
         return 1;
     }
@@ -252,6 +354,217 @@ int splitSAH(Container *o, float *split, Bound *b0, Bound *b1, int *splitAxis, b
     return 0;
 }
 
+float shapeCost(int type, float costTriSphereRatio) {
+    if (costsMeasured) return measuredCosts[type];
+    if (type == ShapeType::Triangle) return costTriSphereRatio;
+    return assumedCosts[type];
+}
+
+// splitBinnedSAH: SAH, but only evaluated at the boundaries of "nBins" equal-width bins on each axis, spanning the node's centroids.
+// "WALD I.: On fast Construction of SAH-based Bounding Volume Hierarchies"
+// Each shape is placed in a bin once, then the cost of every candidate split is found from running totals over the bins,
+// so a node takes O(n) rather than splitSAH's O(n^2).
+// Stops when a node has maxLeafSize shapes or less and splitting isn't any cheaper.
+// Always makes a BVH (splits by centroid).
+int splitBinnedSAH(Container *o, float *split, Bound *b0, Bound *b1, int *splitAxis, int maxLeafSize, float costTriSphereRatio, int nBins) {
+    if (maxLeafSize < 1) maxLeafSize = 1;
+    if (nBins < 2) nBins = 2;
+    if (o->size <= 1) return 1;
+
+    struct Bin {
+        Bound bound;
+        int count;
+        float cost;
+        // Largest centroid in the bin on the current axis.
+        float maxCentroid;
+    };
+    // Best split found on each axis.
+    struct AxisSplit {
+        float cost;
+        float split;
+        Bound b0, b1;
+    };
+
+    Bound centroids = Bound::forGrowing();
+    float leafCost = 0.f;
+    Bound *bo = o->start;
+    while (bo != o->end->next) {
+        for (int i = 0; i < 3; i++) {
+            centroids.min(i) = std::min(centroids.min(i), bo->centroid(i));
+            centroids.max(i) = std::max(centroids.max(i), bo->centroid(i));
+        }
+        leafCost += shapeCost(bo->s->type(), costTriSphereRatio);
+        bo = bo->next;
+    }
+
+    float parentSA = aabbSA(o->min, o->max);
+    AxisSplit axisSplits[3];
+    auto splitAxisBins = [&](int axis) {
+        AxisSplit *best = &(axisSplits[axis]);
+        best->cost = 1e30f;
+        float extent = centroids.max(axis) - centroids.min(axis);
+        if (extent <= 0.f) return;
+        float scale = float(nBins) / extent;
+        std::vector<Bin> bins(nBins);
+        std::vector<Bound> rightBounds(nBins);
+        std::vector<float> rightCosts(nBins);
+        for (auto &b: bins) {
+            b.bound = Bound::forGrowing();
+            b.count = 0;
+            b.cost = 0.f;
+            b.maxCentroid = -1e30f;
+        }
+        Bound *bo = o->start;
+        while (bo != o->end->next) {
+            int idx = std::min(nBins-1, int((bo->centroid(axis) - centroids.min(axis)) * scale));
+            bins[idx].bound.grow(bo);
+            bins[idx].count++;
+            bins[idx].cost += shapeCost(bo->s->type(), costTriSphereRatio);
+            bins[idx].maxCentroid = std::max(bins[idx].maxCentroid, bo->centroid(axis));
+            bo = bo->next;
+        }
+
+        // Sweep from the right to get the bounds/cost of everything right of each boundary,
+        // then from the left, evaluating the split at each one.
+        Bound right = Bound::forGrowing();
+        float rightCost = 0.f;
+        for (int i = nBins-1; i > 0; i--) {
+            right.grow(&(bins[i].bound));
+            rightCost += bins[i].cost;
+            rightBounds[i] = right;
+            rightCosts[i] = rightCost;
+        }
+        Bound left = Bound::forGrowing();
+        float leftCost = 0.f;
+        int leftCount = 0;
+        float leftMaxCentroid = -1e30f;
+        for (int i = 0; i < nBins-1; i++) {
+            left.grow(&(bins[i].bound));
+            leftCost += bins[i].cost;
+            leftCount += bins[i].count;
+            leftMaxCentroid = std::max(leftMaxCentroid, bins[i].maxCentroid);
+            // Don't leave either side empty.
+            if (leftCount == 0 || leftCount == o->size) continue;
+            float cost = cTraverse + (aabbSA(left.min, left.max)*leftCost + aabbSA(rightBounds[i+1].min, rightBounds[i+1].max)*rightCosts[i+1]) / parentSA;
+            if (cost < best->cost) {
+                best->cost = cost;
+                best->b0 = left;
+                best->b1 = rightBounds[i+1];
+                // Splitting on the largest centroid on the left puts exactly the same shapes each side as the bins did.
+                best->split = leftMaxCentroid;
+            }
+        }
+    };
+
+    // As with splitSAH, Y and Z are done by the pool while we do X, if the node's big enough to make it worthwhile.
+    JobGroup axes;
+    bool parallel = buildPool != NULL && o->size >= minParallelBuildSize;
+    for (int axis = 1; axis < 3; axis++) {
+        if (parallel) {
+            buildPool->submit(&axes, [&, axis]() { splitAxisBins(axis); });
+        } else {
+            splitAxisBins(axis);
+        }
+    }
+    splitAxisBins(0);
+    if (parallel) buildPool->wait(&axes);
+
+    float bestCost = 1e30f;
+    int bestAxis = -1;
+    for (int axis = 0; axis < 3; axis++) {
+        if (axisSplits[axis].cost < bestCost) {
+            bestCost = axisSplits[axis].cost;
+            bestAxis = axis;
+            *b0 = axisSplits[axis].b0;
+            *b1 = axisSplits[axis].b1;
+            *split = axisSplits[axis].split;
+        }
+    }
+
+    // All centroids are in the same place, so we can't separate anything.
+    if (bestAxis == -1) return 1;
+    if (o->size <= maxLeafSize && bestCost >= leafCost) return 1;
+    *splitAxis = bestAxis;
+    return 0;
+}
+
+// splitKdSAH: Picks a kd-tree (Bi-tree) split with SAH, rather than always halving the node.
+// "HAVRAN V.: Heuristic Ray Shooting Algorithms", "WALD I., HAVRAN V.: On building fast kd-Trees for Ray Tracing, and on doing that in O(N log^2 N)"
+// Candidate planes are the faces of every shape's bounds (clipped to the node), and shapes straddling a plane count towards both sides.
+// If no split is cheaper than a leaf, but there are still more than maxNodesPerVox shapes, falls back to splitBitree's halving as long as both halves lose something.
+int splitKdSAH(Container *o, float *split, int *splitAxis, int lastAxis, int maxNodesPerVox, float costTriSphereRatio) {
+    if (maxNodesPerVox < 1) return 1;
+    if (o->size <= 1) return 1;
+
+    struct Edge {
+        float t;
+        float cost;
+        bool start;
+    };
+    std::vector<Edge> edges;
+    edges.reserve(2*o->size);
+    float leafCost = 0.f;
+    Bound *bo = o->start;
+    while (bo != o->end->next) {
+        leafCost += shapeCost(bo->s->type(), costTriSphereRatio);
+        bo = bo->next;
+    }
+
+    float parentSA = aabbSA(o->min, o->max);
+    float bestCost = 1e30f;
+    int bestAxis = -1;
+    float bestSplit = 0.f;
+    for (int axis = 0; axis < 3; axis++) {
+        if (o->max(axis) <= o->min(axis)) continue;
+        edges.clear();
+        bo = o->start;
+        while (bo != o->end->next) {
+            float cost = shapeCost(bo->s->type(), costTriSphereRatio);
+            edges.push_back({std::max(bo->min(axis), o->min(axis)), cost, true});
+            edges.push_back({std::min(bo->max(axis), o->max(axis)), cost, false});
+            bo = bo->next;
+        }
+        // Where a shape ends at the same place another starts, the end comes first, so neither counts on the wrong side.
+        std::sort(edges.begin(), edges.end(), [](const Edge &a, const Edge &b) {
+            return a.t < b.t || (a.t == b.t && !a.start && b.start);
+        });
+        float below = 0.f, above = leafCost;
+        for (const Edge &e: edges) {
+            if (!e.start) above -= e.cost;
+            if (e.t > o->min(axis) && e.t < o->max(axis)) {
+                Vec3 belowMax = o->max, aboveMin = o->min;
+                belowMax(axis) = e.t;
+                aboveMin(axis) = e.t;
+                float cost = cTraverse + (aabbSA(o->min, belowMax)*below + aabbSA(aboveMin, o->max)*above) / parentSA;
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestSplit = e.t;
+                }
+            }
+            if (e.start) below += e.cost;
+        }
+    }
+
+    if (bestAxis != -1 && bestCost < leafCost) {
+        *splitAxis = bestAxis;
+        *split = bestSplit;
+        return 0;
+    }
+    if (o->size <= maxNodesPerVox) return 1;
+    if (splitBitree(o, split, NULL, NULL, splitAxis, false, lastAxis, maxNodesPerVox) != 0) return 1;
+    // Halving is only worth it if both halves end up with fewer shapes, otherwise straddling shapes just get copied down the tree.
+    bool onlyBelow = false, onlyAbove = false;
+    bo = o->start;
+    while (bo != o->end->next) {
+        int side = whichSide(bo->min(*splitAxis), bo->max(*splitAxis), o->min(*splitAxis), *split, o->max(*splitAxis));
+        onlyBelow = onlyBelow || side == 0;
+        onlyAbove = onlyAbove || side == 1;
+        bo = bo->next;
+    }
+    return (onlyBelow && onlyAbove) ? 0 : 1;
+}
+
 // splitEqually: Heuristic find split that best divides the -number- of elements between the two children.
 // sets splitAxis to the axis split on, and returns the float value of where that occurs on that axis.
 int splitEqually(Container *o, float *split, Bound *b0, Bound *b1, int *splitAxis, bool bvh, int lastAxis, int) {
@@ -262,7 +575,7 @@ int splitEqually(Container *o, float *split, Bound *b0, Bound *b1, int *splitAxi
     float bestRatios[3] = {-1e30, -1e30, -1e30};
     Bound bestBounds[3][2];
 
-    for (int i = 0; i < 3; i++) {
+    auto axisSplits = [&](int i) {
         int splitIndex = 0;
         Bound *bsplit = o->start;
         while (bsplit != o->end->next) {
@@ -308,7 +621,19 @@ int splitEqually(Container *o, float *split, Bound *b0, Bound *b1, int *splitAxi
             splitIndex++;
             bsplit = bsplit->next;
         }
+    };
+
+    // Like splitSAH, Y and Z are evaluated by the pool while we do X.
+    JobGroup axes;
+    for (int i = 1; i < 3; i++) {
+        if (buildPool != NULL) {
+            buildPool->submit(&axes, [&, i]() { axisSplits(i); });
+        } else {
+            axisSplits(i);
+        }
     }
+    axisSplits(0);
+    if (buildPool != NULL) buildPool->wait(&axes);
 
     int bestAxis = 0;
     int bestSize = 1e9;
@@ -334,15 +659,19 @@ int splitEqually(Container *o, float *split, Bound *b0, Bound *b1, int *splitAxi
     return 0;
 }
 
-Container* generateOctreeHierarchy(Container *o, int splitLimit, int splitCount, int colorIndex, int maxNodesPerVox, int parentId) {
+Container* generateOctreeHierarchy(Container *o, int splitLimit, int splitCount, int maxNodesPerVox, int parentId) {
     if (splitCount >= splitLimit || o->size <= maxNodesPerVox || maxNodesPerVox < 1) return NULL;
     Container *out = new Container();
+    countBuildMemory(9*sizeof(Container), 9);
     out->min = o->min; // {1e30, 1e30, 1e30};
     out->max = o->max; // {-1e30, -1e30, -1e30};
+    // Takes the place of "o", so keeps its octant number (see flattenOctree).
+    out->id = o->id;
 
     Vec3 voxDim = (o->max - o->min) / 2.f;
 
     Bound b[8];
+    Container *containers[8];
     
     // x = l/r, y = u/d
     // z=0          z=1
@@ -363,54 +692,70 @@ Container* generateOctreeHierarchy(Container *o, int splitLimit, int splitCount,
                 c->max = b[i].max;
                 c->id = (parentId*10)+i+1;
                 b[i].s = c;
+                containers[i] = c;
             }
         }
     }
 
     Vec3 midPoint = o->min + voxDim;
 
-    Bound *bo = o->start;
-    bool octantsOccupied[8];
-    while (bo != o->end->next) {
-        bool added = false;
-        whichOctants((bool*)&octantsOccupied, bo->min, bo->max, midPoint);
-        // std::printf("octantMap: ");
-        for (int i = 0; i < 8; i++) {
-            // std::printf("%d ", octantsOccupied[i]);
-            if (octantsOccupied[i] == 0) continue;
-            // Make sure the voxel isn't fully contained within the object
-            // i.e. the voxel contains a face of the object.
-            if (!bo->s->envelops(b[i])) {
-                (dynamic_cast<Container*>(b[i].s))->append(*bo);
-                added = true;
+    partitionShapes(o, containers, 8, [&](Bound *from, Bound *to, Container **dst) {
+        Bound *bo = from;
+        bool octantsOccupied[8];
+        while (bo != to) {
+            bool added = false;
+            whichOctants((bool*)&octantsOccupied, bo->min, bo->max, midPoint);
+            // std::printf("octantMap: ");
+            for (int i = 0; i < 8; i++) {
+                // std::printf("%d ", octantsOccupied[i]);
+                if (octantsOccupied[i] == 0) continue;
+                // Make sure the voxel isn't fully contained within the object
+                // i.e. the voxel contains a face of the object.
+                if (!bo->s->envelops(b[i])) {
+                    dst[i]->append(*bo);
+                    added = true;
+                }
             }
+            // std::printf("\n");
+            if (!added) std::printf("skipped!\n");
+            bo = bo->next;
         }
-        // std::printf("\n");
-        if (!added) std::printf("skipped!\n");
-        bo = bo->next;
-    }
+    });
 
     for (int i = 0; i < 8; i++) {
-        Container *c = dynamic_cast<Container*>(b[i].s);
-        if (c->size == 0) {
-            delete b[i].s;
-            continue;
-        }
+        countBuildMemory(containers[i]->size*sizeof(Bound), containers[i]->size);
+    }
 
-        Container *splitAgain = generateOctreeHierarchy(c, splitLimit, splitCount+1, colorIndex, maxNodesPerVox);
-        colorIndex += (splitLimit - splitCount)*8;
+    auto buildOctant = [&](int i) {
+        Container *c = containers[i];
+        Container *splitAgain = generateOctreeHierarchy(c, splitLimit, splitCount+1, maxNodesPerVox);
         if (splitAgain != NULL) {
+            countBuildMemory(-int64_t(c->size*sizeof(Bound) + sizeof(Container)), 0);
             c->clear(false);
             delete c;
             c = splitAgain;
             b[i].s = c;
         }
-        // DEBUG SPHERES
-        // containerSphereCorners(c);
-        containerCube(c, distinctColors[colorIndex % 16]);
-        colorIndex++;
-      
-        out->append(b[i]);
+    };
+
+    JobGroup octants;
+    for (int i = 0; i < 8; i++) {
+        if (containers[i]->size == 0) {
+            countBuildMemory(-int64_t(sizeof(Container)), 0);
+            delete b[i].s;
+            b[i].s = NULL;
+            continue;
+        }
+        if (buildPool != NULL && containers[i]->size >= minParallelBuildSize) {
+            buildPool->submit(&octants, [&, i]() { buildOctant(i); });
+        } else {
+            buildOctant(i);
+        }
+    }
+    if (buildPool != NULL) buildPool->wait(&octants);
+
+    for (int i = 0; i < 8; i++) {
+        if (b[i].s != NULL) out->append(b[i]);
     }
 
     // Uncomment to render hierarchy in detail in console.
@@ -424,7 +769,7 @@ Container* generateOctreeHierarchy(Container *o, int splitLimit, int splitCount,
 }
 
 
-Container* generateHierarchy(Container *o, int accel, bool bvh, int splitLimit, int splitCount, int lastAxis, int colorIndex, int extra, float fextra) {
+Container* generateHierarchy(Container *o, int accel, bool bvh, int splitLimit, int splitCount, int lastAxis, int extra, float fextra, int bins) {
     if (splitCount >= splitLimit) return NULL;
     Container *out = new Container();
     out->min = o->min; // {1e30, 1e30, 1e30};
@@ -441,7 +786,9 @@ Container* generateHierarchy(Container *o, int accel, bool bvh, int splitLimit,
     } else if (accel == Accel::SAH) {
         stopSplitting = splitSAH(o, &splA, &(b[0]), &(b[1]), &bestAxis, bvh, lastAxis, fextra);
     } else if (accel == Accel::BiTree) {
-        stopSplitting = splitBitree(o, &splA, &(b[0]), &(b[1]), &bestAxis, bvh, lastAxis, extra);
+        stopSplitting = splitKdSAH(o, &splA, &bestAxis, lastAxis, extra, fextra);
+    } else if (accel == Accel::BinnedSAH) {
+        stopSplitting = splitBinnedSAH(o, &splA, &(b[0]), &(b[1]), &bestAxis, extra, fextra, bins);
     }
 
     if (stopSplitting == 1) {
@@ -451,6 +798,7 @@ Container* generateHierarchy(Container *o, int accel, bool bvh, int splitLimit,
     }
     
     Container *containers[2] = {new Container(), new Container()};
+    countBuildMemory(3*sizeof(Container), 3);
 
     if (accel == Accel::BiTree) {
         for (int i = 0; i < 2;  i++) {
@@ -471,79 +819,103 @@ Container* generateHierarchy(Container *o, int accel, bool bvh, int splitLimit,
         }
     }
 
-    Bound *bo = o->start;
-    while (bo != o->end->next) {
-        bool added = false;
-        int side = -1;
-        if (bvh) {
-            side = whichSideCentroid(bo->centroid(bestAxis), splA);
-        } else {
-            side = whichSide(bo->min(bestAxis), bo->max(bestAxis), o->min(bestAxis), splA, o->max(bestAxis));
-        }
-        if (side == 0 || side == 2) {
-            // For an octree, check if any of the faces (estimated) are actually in the node.
-            // A tri has no volume, hence one cannot be "inside" and not on a surface. Therefore we can assume a face is found within the node.
-            // A sphere is a different case, however.
-            bool fullyContained = (accel == Accel::BiTree) ? b->s->envelops(containers[0]->min, containers[0]->max) : false;
-            if (!fullyContained) {
-                containers[0]->append(*bo); // Make copy rather than appending existing pointer
-                added = true;
+    partitionShapes(o, containers, 2, [&](Bound *from, Bound *to, Container **dst) {
+        Bound *bo = from;
+        while (bo != to) {
+            bool added = false;
+            int side = -1;
+            if (bvh) {
+                side = whichSideCentroid(bo->centroid(bestAxis), splA);
+            } else {
+                side = whichSide(bo->min(bestAxis), bo->max(bestAxis), o->min(bestAxis), splA, o->max(bestAxis));
             }
-            /* if (bvh) {
-                bbEdges[0] = std::max(bbEdges[0], bo->max(bestAxis));
-            } */
-        }
-        if (side == 1 || side == 2) {
-            bool fullyContained = (accel == Accel::BiTree) ? b->s->envelops(containers[1]->min, containers[1]->max) : false;
-            if (!fullyContained) {
-                containers[1]->append(*bo); // Make copy rather than appending existing pointer
-                added = true;
+            if (side == 0 || side == 2) {
+                // For an octree, check if any of the faces (estimated) are actually in the node.
+                // A tri has no volume, hence one cannot be "inside" and not on a surface. Therefore we can assume a face is found within the node.
+                // A sphere is a different case, however.
+                bool fullyContained = (accel == Accel::BiTree) ? bo->s->envelops(containers[0]->min, containers[0]->max) : false;
+                if (!fullyContained) {
+                    dst[0]->append(*bo); // Make copy rather than appending existing pointer
+                    added = true;
+                }
+                /* if (bvh) {
+                    bbEdges[0] = std::max(bbEdges[0], bo->max(bestAxis));
+                } */
+            }
+            if (side == 1 || side == 2) {
+                bool fullyContained = (accel == Accel::BiTree) ? bo->s->envelops(containers[1]->min, containers[1]->max) : false;
+                if (!fullyContained) {
+                    dst[1]->append(*bo); // Make copy rather than appending existing pointer
+                    added = true;
+                }
+                /* if (bvh) {
+                    bbEdges[1] = std::min(bbEdges[1], bo->min(bestAxis));
+                } */
             }
-            /* if (bvh) {
-                bbEdges[1] = std::min(bbEdges[1], bo->min(bestAxis));
-            } */
+            if (!added) std::printf("skipped!\n");
+            bo = bo->next;
         }
-        if (!added) std::printf("skipped!\n");
-        bo = bo->next;
+    });
+
+    bool empty[2];
+    for (int i = 0; i < 2; i++) {
+        empty[i] = containers[i]->size == 0;
+        countBuildMemory(containers[i]->size*sizeof(Bound), containers[i]->size);
     }
    
-    for (int i = 0; i < 2;  i++) {
+    auto buildChild = [&](int i) {
         Container *c = containers[i];
         /*if (c->size == 1) {
             std::memcpy(sections[i], c->start, sizeof(Shape));
             delete c;
 
         } else */
-        if (c->size != 0) {
-            if (bvh) {
-                c->min = b[i].min;
-                c->max = b[i].max;
-            } else {
-                c->min = out->min;
-                c->max = out->max;
-                c->splitAxis = bestAxis;
+        if (bvh) {
+            c->min = b[i].min;
+            c->max = b[i].max;
+        } else {
+            c->min = out->min;
+            c->max = out->max;
+            c->splitAxis = bestAxis;
 
-                Vec3 *boundary = &(c->max);
-                if (i == 1) boundary = &(c->min);
+            Vec3 *boundary = &(c->max);
+            if (i == 1) boundary = &(c->min);
 
-                boundary->idx(bestAxis) = splA;
-            }
-            Container *splitAgain = generateHierarchy(c, accel, bvh, splitLimit, splitCount+1, bestAxis, colorIndex, extra, fextra);
-            colorIndex += (splitLimit - splitCount)*2;
-            if (splitAgain != NULL) {
-                delete c;
-                c = splitAgain;
-            }
-            // DEBUG SPHERES
-            // containerSphereCorners(c);
-            containerCube(c, distinctColors[colorIndex % 16]);
-            colorIndex++;
-            
-            b[i].min = c->min;
-            b[i].max = c->max;
-            b[i].s = c;
-            out->append(b[i]);
+            boundary->idx(bestAxis) = splA;
         }
+        Container *splitAgain = generateHierarchy(c, accel, bvh, splitLimit, splitCount+1, bestAxis, extra, fextra, bins);
+        if (splitAgain != NULL) {
+            // The copies of the shapes' bounds aren't needed anymore either, the new container has its own.
+            countBuildMemory(-int64_t(c->size*sizeof(Bound) + sizeof(Container)), 0);
+            c->clear(false);
+            delete c;
+            c = splitAgain;
+        }
+
+        b[i].min = c->min;
+        b[i].max = c->max;
+        b[i].s = c;
+    };
+
+    // The first child is handed to the pool (if it's worth it) while this thread builds the second.
+    JobGroup children;
+    for (int i = 0; i < 2;  i++) {
+        if (empty[i]) continue;
+        if (i == 0 && buildPool != NULL && containers[i]->size >= minParallelBuildSize) {
+            buildPool->submit(&children, [&]() { buildChild(0); });
+        } else {
+            buildChild(i);
+        }
+    }
+    if (buildPool != NULL) buildPool->wait(&children);
+
+    for (int i = 0; i < 2;  i++) {
+        if (empty[i]) {
+            countBuildMemory(-int64_t(sizeof(Container)), 0);
+            delete containers[i];
+            continue;
+        }
+        out->append(b[i]);
     }
 
     // Uncomment to render hierarchy in detail in console.
@@ -586,100 +958,11 @@ void printShapes(Container *c, int tabIndex) {
     }
 }
 
-void containerCube(Container *c, Vec3 color) {
-    /* Vec3 color = {0.f, 0.f, 0.f};
-    color.x = 0.5f + (float(std::rand() % 500) / 500.f);
-    color.y = 0.5f + (float(std::rand() % 500) / 500.f);
-    color.z = 0.5f + (float(std::rand() % 500) / 500.f); */
-    float width = 0.02f;
-    float pts[2][3] = {{c->min.x, c->min.y, c->min.z}, {c->max.x, c->max.y, c->max.z}};
-    Vec3 vtx[8];
-    int idx = 0;
-    for (int i = 0; i < 2;  i++) {
-        for (int j = 0; j < 2; j++) {
-            for (int k = 0; k < 2; k++) {
-                vtx[idx] = {pts[i][0], pts[j][1], pts[k][2]};
-                idx++;
-            }
-        }
-    }
-    // Worked out by hand
-    int edges[12][2] = {{0, 1}, {0, 2}, {2, 3}, {1, 3}, {4, 6}, {4, 5}, {7, 5}, {7, 6}, {0, 4}, {1, 5}, {2, 6}, {7, 3}};
-    for (int i = 0; i < 12; i++) {
-        Vec3 ab[2] = {vtx[edges[i][0]], vtx[edges[i][1]]};
-        Vec3 d = ab[1] - ab[0];
-        int notAxis = (d.x != 0) ? 0 : (d.y != 0) ? 1 : 2;
-        int axes[2];
-        int j_ = 0;
-        for (int j = 0; j < 3; j++) {
-            if (j == notAxis) continue;
-            axes[j_] = j;
-            j_++;
-        }
-
-        float a[3] = {ab[0].x, ab[0].y, ab[0].z};
-        float b[3] = {ab[1].x, ab[1].y, ab[1].z};
-        for (int j = 0; j < 2; j++) {
-            float corners[4][3] = {
-                {a[0], a[1], a[2]},
-                {a[0], a[1], a[2]},
-                {b[0], b[1], b[2]},
-                {b[0], b[1], b[2]}
-            };
-            corners[0][axes[j]] += width;
-            corners[1][axes[j]] -= width;
-            corners[2][axes[j]] -= width;
-            corners[3][axes[j]] += width;
-            Triangle *t0 = new Triangle();
-            t0->oA = Vec3{corners[0][0], corners[0][1], corners[0][2]};
-            t0->oB = Vec3{corners[1][0], corners[1][1], corners[1][2]};
-            t0->oC = Vec3{corners[2][0], corners[2][1], corners[2][2]};
-            t0->debug = true;
-            t0->material = new Material();
-            t0->mat()->color = color;
-            t0->applyTransform();
-            c->append(t0);
-            Triangle *t1 = new Triangle();
-            t1->oA = Vec3{corners[2][0], corners[2][1], corners[2][2]};
-            t1->oB = Vec3{corners[3][0], corners[3][1], corners[3][2]};
-            t1->oC = Vec3{corners[0][0], corners[0][1], corners[0][2]};
-            t1->debug = true;
-            t1->material = new Material();
-            t1->mat()->color = color;
-            t1->applyTransform();
-            c->append(t1);
-        }
-    }
-}
-
-void containerSphereCorners(Container *c, Vec3 color) {
-    /* Vec3 color = {0.f, 0.f, 0.f};
-    color.x = 0.5f + (float(std::rand() % 500) / 500.f);
-    color.y = 0.5f + (float(std::rand() % 500) / 500.f);
-    color.z = 0.5f + (float(std::rand() % 500) / 500.f); */
-    std::vector<Shape*> debugShapes;
-    for (int j = 0; j < 2; j++) {
-        Bound bo;
-        Sphere *s = new Sphere();
-        s->center = (j == 0) ? c->min : c->max;
-        s->radius = 0.3f;
-        s->thickness = 1.f;
-        s->material = new Material();
-        s->mat()->color = color;
-        s->mat()->opacity = 1.f;
-        s->mat()->reflectiveness = 0.f;
-        s->mat()->specular = 0.f;
-        s->mat()->shininess = 5.f;
-        bo.s = s;
-        c->append(bo);
-    }
-}
-
-void getVoxelIndex(Container *c, int subdivision, Vec3 p, Vec3 delta, int *x, int *y, int *z, float *t) {
-    Vec3 dims = c->max - c->min;
-    Vec3 vox = dims / subdivision;
+void getVoxelIndex(Vec3 min, Vec3 max, const int *res, const Ray &r, int *x, int *y, int *z, float *t) {
+    Vec3 dims = max - min;
+    Vec3 vox = {dims.x / res[0], dims.y / res[1], dims.z / res[2]};
     // std::printf("got vox(%f %f %f\n", vox.x, vox.y, vox.z);
-    Vec3 ap = (p - c->min);
+    Vec3 ap = (r.p0 - min);
     bool originWithinVoxel = true;
     for (int i = 0; i < 3; i++) {
         if (ap(i) < 0 || ap(i) > dims(i)) {
@@ -687,16 +970,17 @@ void getVoxelIndex(Container *c, int subdivision, Vec3 p, Vec3 delta, int *x, in
             break;
         }
     }
+    int *coord[3] = {x, y, z};
     if (originWithinVoxel) {
-        Vec3 apVox = {ap.x/vox.x, ap.y/vox.y, ap.z/vox.z};
-        *x = apVox.x;
-        *y = apVox.y;
-        *z = apVox.z;
+        for (int i = 0; i < 3; i++) {
+            *(coord[i]) = ap(i)/vox(i);
+            if (*(coord[i]) == res[i]) *(coord[i]) -= 1;
+        }
         *t = 0;
         return;
     }
     // If our origin "p" isn't in a voxel already (i.e. out the scene), find the point along the ray where it hits one.
-    *t = meetAABB(ap, delta, {0.f, 0.f, 0.f}, dims);
+    *t = meetAABB(r, min, max);
     if (*t < -9990.f) {
         *x = -1;
         *y = -1;
@@ -704,74 +988,56 @@ void getVoxelIndex(Container *c, int subdivision, Vec3 p, Vec3 delta, int *x, in
         *t = -1.f;
         return;
     }
-    ap = ap + (*t * delta);
-    Vec3 apVox;
-    for (int i = 0; i < 3; i++) {
-        apVox(i) = ap(i)/vox(i);
-    }
+    ap = ap + (*t * r.delta);
    
     /* Cubes are back-to-back, and so in grid-coordinates,
      * one might span the space 0-0.99999 and their neighor 1-1.99999.
      * If we look at the back (i.e. the maximum edge) of a cube on
      * the edge of our grid, the coordinate will land on a clean .0 value,
      * which is actually out of bounds.
-     * Therefore, we just cap the integer-ized coordinates at (subdivision-1). */
-    *x = apVox.x;
-    if (*x == subdivision) *x -=1;
-    *y = apVox.y;
-    if (*y == subdivision) *y -=1;
-    *z = apVox.z;
-    if (*z == subdivision) *z -=1;
+     * Therefore, we just cap the integer-ized coordinates at (res-1). */
+    for (int i = 0; i < 3; i++) {
+        *(coord[i]) = std::clamp(int(ap(i)/vox(i)), 0, res[i]-1);
+    }
 }
 
-// Split container into subcontainer "voxel" grid of dimensions subdivision^3.
-// "start"/"end" is a pointer to start of a subdivision^3 array.
-Container* splitVoxels(Container *o, int subdivision) {
-    Container *out = new Container();
-    out->min = {1e30, 1e30, 1e30};
-    out->max = {-1e30, -1e30, -1e30};
-    out->voxelSubdiv = subdivision;
-    out->min = o->min;
-    out->max = o->max;
-    Vec3 dims = o->max - o->min;
-    Vec3 vox = dims / subdivision;
-    std::printf("global dim(%f %f %f), vox(%f %f %f)\n", dims.x, dims.y, dims.z, vox.x, vox.y, vox.z);
-    size_t totalSize = subdivision*subdivision*subdivision;
-    out->size = totalSize;
-    Bound *grid = new Bound[totalSize];
-    std::memset(grid, 0, sizeof(Bound)*totalSize);
-    out->append(grid);
-    for (int z = 0; z < subdivision; z++) {
-        for (int y = 0; y < subdivision; y++) { 
-            for (int x = 0; x < subdivision; x++) { 
-                Bound *b = grid + x + subdivision * (y + subdivision * z);
-                Container *c = new Container();
-                b->s = c;
-                c->min = o->min + Vec3{vox.x * x, vox.y * y, vox.z * z};
-                c->max = c->min + vox;
-                c->bounds(b);
-                c->splitAxis = -1;
-                Bound *bo = o->start;
-                while (bo != o->end->next) {
-                    bool added = true;
-                    for (int d = 0; d < 3; d++) {
-                        if (!(
-                            ((bo->min(d) >= c->min(d)) || (bo->max(d) >= c->min(d))) &&
-                            ((bo->min(d) <= c->max(d)) || (bo->max(d) <= c->max(d)))
-                           )) {
-                            added = false;
-                            break;
-                        }
-                    }
-                    if (added) {
-                        c->append(*bo); // Make copy of bound rather than appending pointer
-                    }
-                    bo = bo->next;
-                }
-                containerCube(c, {1.f, 1.f, 1.f});
-            }
+bool VoxelWalk::begin(Vec3 min, Vec3 max, const int *gridRes, const Ray &r) {
+    for (int i = 0; i < 3; i++) res[i] = gridRes[i];
+    float tStart = 0.f;
+    // Find the first voxel our ray hits, and how far long the ray we've traveled to get there.
+    getVoxelIndex(min, max, res, r, &x, &y, &z, &tStart);
+    if (x < 0) return false;
+
+    Vec3 dims = max - min;
+    Vec3 vox = {dims.x / res[0], dims.y / res[1], dims.z / res[2]};
+    Vec3 entry = r.p0 + (tStart * r.delta);
+    // Get the min/max corners of our home voxel.
+    Vec3 cVoxMin = min + Vec3{float(x)*vox.x, float(y)*vox.y, float(z)*vox.z};
+    Vec3 cVoxMax = cVoxMin + vox;
+    for (int i = 0; i < 3; i++) {
+        step[i] = r.delta(i) == 0.f ? 0 : (r.sign[i] ? -1 : 1);
+        if (step[i] == 0) {
+            // Makes sure it's never the smallest, and so never gets incremented.
+            tMax(i) = 1e10f;
+        } else {
+            float boundary = r.sign[i] ? cVoxMin(i) : cVoxMax(i);
+            tMax(i) = tStart + (boundary - entry(i)) * r.invDelta(i);
         }
+        tDelta(i) = vox(i) * std::abs(r.invDelta(i));
     }
-    return out;
+    return true;
 }
 
+bool VoxelWalk::next() {
+    int axis = 0;
+    if (tMax.x < tMax.y) {
+        axis = tMax.x < tMax.z ? 0 : 2;
+    } else {
+        axis = tMax.y < tMax.z ? 1 : 2;
+    }
+    int *coord[3] = {&x, &y, &z};
+    *(coord[axis]) += step[axis];
+    if (*(coord[axis]) < 0 || *(coord[axis]) >= res[axis]) return false;
+    tMax(axis) += tDelta(axis);
+    return true;
+}
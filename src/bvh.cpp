@@ -0,0 +1,527 @@
+#include "bvh.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <unordered_map>
+#include "accel.hpp"
+#include "pool.hpp"
+
+namespace {
+    const uint32_t maxLeafSize = UINT16_MAX;
+
+    struct Flattener {
+        LinearBVH *bvh;
+        std::unordered_map<Shape*, uint32_t> primIds;
+        // Set if a node has more children than fit in a BVHNode.
+        bool tooWide;
+
+        // Shapes can appear in multiple leaves (e.g. when straddling a Bi-tree split), but are only stored once.
+        uint32_t primId(Shape *s) {
+            auto it = primIds.find(s);
+            if (it != primIds.end()) return it->second;
+            uint32_t id = bvh->prims.size();
+            bvh->prims.emplace_back(s);
+            primIds[s] = id;
+            return id;
+        }
+
+        void leaf(uint32_t idx, Bound **b, uint32_t count) {
+            Bound box = Bound::forGrowing();
+            for (uint32_t i = 0; i < count; i++) {
+                box.grow(b[i]);
+            }
+            BVHNode *n = &(bvh->nodes[idx]);
+            n->min = box.min;
+            n->max = box.max;
+            n->offset = bvh->primIndices.size();
+            n->primCount = count;
+            n->childCount = 0;
+            n->axis = UINT8_MAX;
+            for (uint32_t i = 0; i < count; i++) {
+                bvh->primIndices.emplace_back(primId(b[i]->s));
+            }
+        }
+
+        // Fills in nodes[idx] from "c". "depth" is the number of entries already on the traversal stack when this node is visited.
+        void node(Container *c, uint32_t idx, int depth) {
+            int axis = -1;
+            std::vector<Container*> children;
+            std::vector<Bound*> shapes;
+            if (c->size > 0) {
+                Bound *bo = c->start;
+                while (bo != c->end->next) {
+                    if (bo->s != NULL && !(bo->s->debug)) {
+                        Container *sub = dynamic_cast<Container*>(bo->s);
+                        if (sub != nullptr) children.emplace_back(sub);
+                        else shapes.emplace_back(bo);
+                    }
+                    bo = bo->next;
+                }
+            }
+
+            if (children.empty() && shapes.size() <= maxLeafSize) {
+                if (shapes.empty()) {
+                    BVHNode *n = &(bvh->nodes[idx]);
+                    n->min = c->min;
+                    n->max = c->max;
+                    n->offset = 0;
+                    n->primCount = 0;
+                    n->childCount = 0;
+                    n->axis = UINT8_MAX;
+                } else {
+                    leaf(idx, shapes.data(), shapes.size());
+                }
+                return;
+            }
+
+            // Order a pair of children along the axis they're most separated on, so traversal can pick the nearer by the sign of the ray direction.
+            if (children.size() == 2 && shapes.empty()) {
+                Vec3 a = children[0]->min + children[0]->max;
+                Vec3 b = children[1]->min + children[1]->max;
+                axis = 0;
+                for (int i = 1; i < 3; i++) {
+                    if (std::abs(b(i) - a(i)) > std::abs(b(axis) - a(axis))) axis = i;
+                }
+                if (a(axis) > b(axis)) std::swap(children[0], children[1]);
+            }
+
+            // Any shapes stored alongside sub-containers (or too many to fit in one leaf) are put in extra leaf children.
+            uint32_t leafCount = (shapes.size() + maxLeafSize - 1) / maxLeafSize;
+            uint32_t count = children.size() + leafCount;
+            if (count > UINT8_MAX) {
+                tooWide = true;
+                return;
+            }
+            uint32_t first = bvh->nodes.size();
+            bvh->nodes.resize(first + count);
+            BVHNode *n = &(bvh->nodes[idx]);
+            n->min = c->min;
+            n->max = c->max;
+            n->offset = first;
+            n->primCount = 0;
+            n->childCount = count;
+            n->axis = axis == -1 ? UINT8_MAX : axis;
+            bvh->stackDepth = std::max(bvh->stackDepth, depth + int(count));
+
+            for (size_t i = 0; i < children.size(); i++) {
+                node(children[i], first + i, depth + count - 1);
+            }
+            for (uint32_t i = 0; i < leafCount; i++) {
+                uint32_t start = i * maxLeafSize;
+                uint32_t size = std::min(maxLeafSize, uint32_t(shapes.size()) - start);
+                leaf(first + children.size() + i, shapes.data() + start, size);
+            }
+        }
+    };
+}
+
+LinearBVH *flattenHierarchy(Container *root) {
+    if (root == NULL) return NULL;
+    LinearBVH *bvh = new LinearBVH();
+    bvh->stackDepth = 1;
+    bvh->nodes.resize(1);
+    Flattener f = {bvh, {}, false};
+    f.node(root, 0, 0);
+    if (f.tooWide || bvh->stackDepth > BVH_STACK_SIZE) {
+        std::printf("Hierarchy can't be flattened (node too wide, or needs a stack of %d)\n", bvh->stackDepth);
+        delete bvh;
+        return NULL;
+    }
+    bvh->nodes.shrink_to_fit();
+    bvh->primIndices.shrink_to_fit();
+    bvh->prims.shrink_to_fit();
+    return bvh;
+}
+
+namespace {
+    // Subtrees with fewer shapes than this are built on the current thread.
+    const uint32_t minParallelBuildSize = 4096;
+
+    // PrimRef: What the in-place builder sorts, a shape's bounds, cost and index in LinearBVH::prims.
+    struct PrimRef {
+        Vec3 min, max, centroid;
+        float cost;
+        uint32_t prim;
+    };
+
+    struct InPlaceBuilder {
+        LinearBVH *bvh;
+        PrimRef *refs;
+        ThreadPool *pool;
+        int maxDepth, maxLeafSize, nBins;
+        // Next free node. Children are always allocated in pairs.
+        std::atomic<uint32_t> nodeCount;
+        std::atomic<int> stackDepth;
+
+        void leaf(BVHNode *n, uint32_t begin, uint32_t end) {
+            n->offset = begin;
+            n->primCount = end - begin;
+            n->childCount = 0;
+            n->axis = UINT8_MAX;
+        }
+
+        int bin(const PrimRef &r, int axis, float cmin, float scale) {
+            return std::min(nBins-1, int((r.centroid(axis) - cmin) * scale));
+        }
+
+        // Builds nodes[idx] from refs[begin, end). "entries" is the number of entries already on the traversal stack when it's visited.
+        void node(uint32_t idx, uint32_t begin, uint32_t end, int depth, int entries) {
+            BVHNode *n = &(bvh->nodes[idx]);
+            Bound box = Bound::forGrowing();
+            Bound centroids = Bound::forGrowing();
+            float leafCost = 0.f;
+            for (uint32_t i = begin; i < end; i++) {
+                for (int j = 0; j < 3; j++) {
+                    box.min(j) = std::min(box.min(j), refs[i].min(j));
+                    box.max(j) = std::max(box.max(j), refs[i].max(j));
+                    centroids.min(j) = std::min(centroids.min(j), refs[i].centroid(j));
+                    centroids.max(j) = std::max(centroids.max(j), refs[i].centroid(j));
+                }
+                leafCost += refs[i].cost;
+            }
+            n->min = box.min;
+            n->max = box.max;
+            uint32_t count = end - begin;
+            // A leaf can't hold more than UINT16_MAX shapes, so past that we have to keep splitting.
+            bool mustSplit = count > UINT16_MAX;
+            if (count <= 1 || (depth >= maxDepth && !mustSplit)) {
+                leaf(n, begin, end);
+                return;
+            }
+
+            struct Bin {
+                Bound bound;
+                int count;
+                float cost;
+            };
+            Bin bins[BVH_MAX_BINS];
+            Bound rightBounds[BVH_MAX_BINS];
+            float rightCosts[BVH_MAX_BINS];
+            float parentSA = aabbSA(box.min, box.max);
+            float bestCost = 1e30f;
+            int bestAxis = -1, bestBin = 0;
+            for (int axis = 0; axis < 3; axis++) {
+                float extent = centroids.max(axis) - centroids.min(axis);
+                if (extent <= 0.f) continue;
+                float scale = float(nBins) / extent;
+                for (int i = 0; i < nBins; i++) {
+                    bins[i] = {Bound::forGrowing(), 0, 0.f};
+                }
+                for (uint32_t i = begin; i < end; i++) {
+                    Bin *b = &(bins[bin(refs[i], axis, centroids.min(axis), scale)]);
+                    for (int j = 0; j < 3; j++) {
+                        b->bound.min(j) = std::min(b->bound.min(j), refs[i].min(j));
+                        b->bound.max(j) = std::max(b->bound.max(j), refs[i].max(j));
+                    }
+                    b->count++;
+                    b->cost += refs[i].cost;
+                }
+                Bound right = Bound::forGrowing();
+                float rightCost = 0.f;
+                for (int i = nBins-1; i > 0; i--) {
+                    right.grow(&(bins[i].bound));
+                    rightCost += bins[i].cost;
+                    rightBounds[i] = right;
+                    rightCosts[i] = rightCost;
+                }
+                Bound left = Bound::forGrowing();
+                float leftCost = 0.f;
+                uint32_t leftCount = 0;
+                for (int i = 0; i < nBins-1; i++) {
+                    left.grow(&(bins[i].bound));
+                    leftCost += bins[i].cost;
+                    leftCount += bins[i].count;
+                    if (leftCount == 0 || leftCount == count) continue;
+                    float cost = 1.f + (aabbSA(left.min, left.max)*leftCost + aabbSA(rightBounds[i+1].min, rightBounds[i+1].max)*rightCosts[i+1]) / parentSA;
+                    if (cost < bestCost) {
+                        bestCost = cost;
+                        bestAxis = axis;
+                        bestBin = i;
+                    }
+                }
+            }
+
+            if (!mustSplit && (bestAxis == -1 || (int(count) <= maxLeafSize && bestCost >= leafCost))) {
+                leaf(n, begin, end);
+                return;
+            }
+
+            uint32_t mid;
+            if (bestAxis == -1) {
+                // Every centroid's in the same place, so any split is as good as another.
+                mid = begin + count/2;
+                n->axis = UINT8_MAX;
+            } else {
+                float cmin = centroids.min(bestAxis);
+                float scale = float(nBins) / (centroids.max(bestAxis) - cmin);
+                PrimRef *m = std::partition(refs + begin, refs + end, [&](const PrimRef &r) {
+                    return bin(r, bestAxis, cmin, scale) <= bestBin;
+                });
+                mid = m - refs;
+                // Left holds the lower bins, so children are already in the order traversal expects.
+                n->axis = bestAxis;
+            }
+
+            uint32_t children = nodeCount.fetch_add(2);
+            n->offset = children;
+            n->primCount = 0;
+            n->childCount = 2;
+            int deepest = stackDepth;
+            while (entries + 2 > deepest && !stackDepth.compare_exchange_weak(deepest, entries + 2));
+
+            JobGroup left;
+            if (pool != NULL && mid - begin >= minParallelBuildSize) {
+                pool->submit(&left, [=, this]() { node(children, begin, mid, depth+1, entries+1); });
+            } else {
+                node(children, begin, mid, depth+1, entries+1);
+            }
+            node(children+1, mid, end, depth+1, entries+1);
+            if (pool != NULL) pool->wait(&left);
+        }
+    };
+}
+
+LinearBVH *buildLinearBVH(Container *flat, int maxDepth, int maxLeafSize, float costTriSphereRatio, int nBins, ThreadPool *pool) {
+    if (flat == NULL) return NULL;
+    LinearBVH *bvh = new LinearBVH();
+    std::vector<PrimRef> refs;
+    refs.reserve(flat->size);
+    bvh->prims.reserve(flat->size);
+    if (flat->size > 0) {
+        Bound *bo = flat->start;
+        while (bo != flat->end->next) {
+            if (bo->s != NULL && !(bo->s->debug)) {
+                refs.push_back({bo->min, bo->max, bo->centroid, shapeCost(bo->s->type(), costTriSphereRatio), uint32_t(bvh->prims.size())});
+                bvh->prims.emplace_back(bo->s);
+            }
+            bo = bo->next;
+        }
+    }
+    // A binary tree over n leaves has at most 2n-1 nodes.
+    bvh->nodes.resize(std::max(size_t(1), 2*refs.size()));
+    countBuildMemory(sizeof(LinearBVH) + refs.capacity()*sizeof(PrimRef) + bvh->prims.capacity()*sizeof(Shape*) + bvh->nodes.capacity()*sizeof(BVHNode), 4);
+
+    InPlaceBuilder b;
+    b.bvh = bvh;
+    b.refs = refs.data();
+    b.pool = pool;
+    b.maxDepth = maxDepth;
+    b.maxLeafSize = std::max(1, maxLeafSize);
+    b.nBins = std::clamp(nBins, 2, BVH_MAX_BINS);
+    b.nodeCount = 1;
+    b.stackDepth = 1;
+    if (refs.empty()) {
+        bvh->nodes[0].min = flat->min;
+        bvh->nodes[0].max = flat->max;
+        b.leaf(&(bvh->nodes[0]), 0, 0);
+    } else {
+        b.node(0, 0, refs.size(), 0, 0);
+    }
+    bvh->nodes.resize(b.nodeCount);
+    bvh->stackDepth = b.stackDepth;
+
+    // Leaves index straight into the now sorted references.
+    bvh->primIndices.resize(refs.size());
+    countBuildMemory(bvh->primIndices.capacity()*sizeof(uint32_t), 1);
+    for (size_t i = 0; i < refs.size(); i++) {
+        bvh->primIndices[i] = refs[i].prim;
+    }
+    countBuildMemory(-int64_t(refs.capacity()*sizeof(PrimRef)), 0);
+
+    if (bvh->stackDepth > BVH_STACK_SIZE) {
+        std::printf("Hierarchy can't be traversed (needs a stack of %d)\n", bvh->stackDepth);
+        delete bvh;
+        return NULL;
+    }
+    return bvh;
+}
+
+void refitBVH(LinearBVH *bvh, const std::vector<bool> &dirty) {
+    if (bvh == NULL) return;
+    // Children are always stored after their parents, so going backwards, every child's box is up to date by the time its parent's is.
+    std::vector<bool> changed(bvh->nodes.size(), false);
+    for (size_t idx = bvh->nodes.size(); idx-- > 0;) {
+        BVHNode *n = &(bvh->nodes[idx]);
+        Bound box = Bound::forGrowing();
+        if (n->leaf()) {
+            bool moved = false;
+            for (int i = 0; i < n->primCount; i++) {
+                if (dirty[bvh->primIndices[n->offset + i]]) moved = true;
+            }
+            if (!moved) continue;
+            for (int i = 0; i < n->primCount; i++) {
+                Bound b;
+                bvh->prims[bvh->primIndices[n->offset + i]]->bounds(&b);
+                box.grow(&b);
+            }
+        } else {
+            bool moved = false;
+            for (int i = 0; i < n->childCount; i++) {
+                if (changed[n->offset + i]) moved = true;
+            }
+            if (!moved) continue;
+            for (int i = 0; i < n->childCount; i++) {
+                const BVHNode *c = &(bvh->nodes[n->offset + i]);
+                Bound b(c->min, c->max);
+                box.grow(&b);
+            }
+        }
+        n->min = box.min;
+        n->max = box.max;
+        changed[idx] = true;
+    }
+}
+
+float bvhCost(const LinearBVH *bvh, float costTriSphereRatio, float *rootSA) {
+    if (bvh == NULL || bvh->nodes.empty()) return 0.f;
+    float area = (rootSA != NULL && *rootSA > 0.f) ? *rootSA : aabbSA(bvh->nodes[0].min, bvh->nodes[0].max);
+    if (rootSA != NULL) *rootSA = area;
+    if (area <= 0.f) return 0.f;
+    float cost = 0.f;
+    for (const BVHNode &n: bvh->nodes) {
+        // Empty leaves (which may have an inverted box) are never entered.
+        if (n.leaf() && n.primCount == 0) continue;
+        float visit = 1.f;
+        if (n.leaf()) {
+            visit = 0.f;
+            for (int i = 0; i < n.primCount; i++) {
+                visit += shapeCost(bvh->prims[bvh->primIndices[n.offset + i]]->type(), costTriSphereRatio);
+            }
+        }
+        cost += visit * aabbSA(n.min, n.max) / area;
+    }
+    return cost;
+}
+
+const char *bvhLayouts[3] = {"As built", "Depth-first", "Treelets"};
+
+void layoutBVH(LinearBVH *bvh, int layout) {
+    if (bvh == NULL || bvh->nodes.empty() || layout == BVHLayout::AsBuilt) return;
+    const auto &old = bvh->nodes;
+    // Blocks of siblings are started on a new cache line if they'd otherwise straddle two, after an empty leaf that's never visited.
+    // The array starts on a line, so which they are follows from the index. At most every block is padded.
+    size_t padding = 0;
+    for (const BVHNode &n: old) {
+        if (n.childCount > 1) padding++;
+    }
+    decltype(bvh->nodes) nodes;
+    nodes.reserve(old.size() + padding);
+    BVHNode empty = {{1e30f, 1e30f, 1e30f}, 0, {-1e30f, -1e30f, -1e30f}, 0, 0, 255};
+    nodes.emplace_back(old[0]);
+    // New indices of the nodes whose children haven't been placed yet, in the order they're to be placed.
+    // Each still has the offset of its children in the old array.
+    std::vector<uint32_t> stack = {0};
+    std::vector<uint32_t> level, next;
+    int levels = layout == BVHLayout::Treelets ? BVH_LAYOUT_TREELET_LEVELS : 1;
+    while (!stack.empty()) {
+        level.assign(1, stack.back());
+        stack.pop_back();
+        // Place the children of every node in the treelet, a level at a time.
+        for (int l = 0; l < levels && !level.empty(); l++) {
+            next.clear();
+            for (uint32_t idx: level) {
+                if (nodes[idx].leaf()) continue;
+                uint32_t first = nodes[idx].offset;
+                int count = nodes[idx].childCount;
+                size_t start = (nodes.size() * sizeof(BVHNode)) % BVH_CACHE_LINE;
+                if (count > 1 && start != 0 && start + count*sizeof(BVHNode) > BVH_CACHE_LINE) nodes.emplace_back(empty);
+                nodes[idx].offset = nodes.size();
+                for (int i = 0; i < count; i++) {
+                    next.emplace_back(nodes.size());
+                    nodes.emplace_back(old[first + i]);
+                }
+            }
+            level.swap(next);
+        }
+        // What's left are the roots of the treelets below, which are laid out depth-first (so the first is popped next).
+        for (size_t i = level.size(); i-- > 0;) {
+            if (!nodes[level[i]].leaf()) stack.emplace_back(level[i]);
+        }
+    }
+
+    std::vector<uint32_t> primIndices;
+    std::vector<Shape*> prims;
+    primIndices.reserve(bvh->primIndices.size());
+    prims.reserve(bvh->primIndices.size());
+    for (BVHNode &n: nodes) {
+        if (!n.leaf()) continue;
+        uint32_t first = n.offset;
+        n.offset = prims.size();
+        for (int i = 0; i < n.primCount; i++) {
+            primIndices.emplace_back(prims.size());
+            prims.emplace_back(bvh->prims[bvh->primIndices[first + i]]);
+        }
+    }
+    bvh->nodes.swap(nodes);
+    bvh->primIndices.swap(primIndices);
+    bvh->prims.swap(prims);
+}
+
+namespace {
+    // Records the cache lines covering "size" bytes at "p".
+    void touch(std::vector<uintptr_t> *lines, const void *p, size_t size) {
+        uintptr_t start = uintptr_t(p) / BVH_CACHE_LINE;
+        uintptr_t end = (uintptr_t(p) + size - 1) / BVH_CACHE_LINE;
+        for (uintptr_t l = start; l <= end; l++) lines->emplace_back(l);
+    }
+}
+
+BVHTraceStats measureBVH(const LinearBVH *bvh, const std::vector<Ray> &rays) {
+    BVHTraceStats stats = {0, 0, 0, 0};
+    if (bvh == NULL || bvh->nodes.empty() || rays.empty()) return stats;
+    std::vector<uintptr_t> lines;
+    BVHStackEntry stack[BVH_STACK_SIZE];
+    for (const Ray &r: rays) {
+        lines.clear();
+        int top = 0;
+        float t, closest = r.tMax;
+        Ray cur = r;
+        touch(&lines, &(bvh->nodes[0]), sizeof(BVHNode));
+        stats.nodes++;
+        if (meetsNode(&(bvh->nodes[0]), cur, &t)) stack[top++] = {0, t};
+        while (top > 0) {
+            BVHStackEntry e = stack[--top];
+            if (e.t > closest) continue;
+            const BVHNode *n = &(bvh->nodes[e.node]);
+            if (n->leaf()) {
+                for (int i = 0; i < n->primCount; i++) {
+                    const uint32_t *idx = &(bvh->primIndices[n->offset + i]);
+                    Shape *const *s = &(bvh->prims[*idx]);
+                    touch(&lines, idx, sizeof(uint32_t));
+                    touch(&lines, s, sizeof(Shape*));
+                    // Only the start of the shape is counted, as its size depends on its type.
+                    touch(&lines, *s, 1);
+                    stats.prims++;
+                    t = (*s)->intersect(cur);
+                    if (t < cur.tMin || t > closest) continue;
+                    closest = t;
+                    cur.tMax = t;
+                }
+                continue;
+            }
+            // Both children's boxes are tested, so both are read.
+            touch(&lines, &(bvh->nodes[n->offset]), n->childCount*sizeof(BVHNode));
+            stats.nodes += n->childCount;
+            bool reverse = n->axis < 3 && r.sign[n->axis];
+            int base = top;
+            for (int i = 0; i < n->childCount; i++) {
+                uint32_t child = n->offset + (reverse ? n->childCount-1-i : i);
+                if (!meetsNode(&(bvh->nodes[child]), cur, &t) || t > closest) continue;
+                int j = top++;
+                while (j > base && stack[j-1].t <= t) {
+                    stack[j] = stack[j-1];
+                    j--;
+                }
+                stack[j] = {child, t};
+            }
+        }
+        std::sort(lines.begin(), lines.end());
+        stats.lines += std::unique(lines.begin(), lines.end()) - lines.begin();
+    }
+    stats.nodes /= rays.size();
+    stats.prims /= rays.size();
+    stats.lines /= rays.size();
+    stats.bytes = stats.lines * BVH_CACHE_LINE;
+    return stats;
+}
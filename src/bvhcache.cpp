@@ -0,0 +1,172 @@
+#include "bvhcache.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+    // CacheHeader: Start of a cache file, followed by the nodes, primIndices and prims (as Shape::ids) of the LinearBVH, in that order.
+    // It's 32 bytes, so the nodes after it are aligned as they are in memory.
+    struct CacheHeader {
+        char magic[4];
+        uint32_t version;
+        uint64_t key;
+        uint32_t nodeCount, indexCount, primCount;
+        int32_t stackDepth;
+    };
+
+    static_assert(sizeof(CacheHeader) % alignof(BVHNode) == 0);
+
+    const char cacheMagic[4] = {'R', 'T', 'B', 'V'};
+
+    // Whether every node and index in a cache file points within it, and children always come after their parent (as every builder stores them),
+    // so it can't contain a cycle.
+    bool validCache(const CacheHeader *h, const BVHNode *nodes, const uint32_t *primIndices) {
+        if (h->stackDepth > BVH_STACK_SIZE) return false;
+        for (uint32_t i = 0; i < h->nodeCount; i++) {
+            const BVHNode *n = &(nodes[i]);
+            if (n->leaf() && uint64_t(n->offset) + n->primCount > h->indexCount) return false;
+            if (!n->leaf() && (n->offset <= i || uint64_t(n->offset) + n->childCount > h->nodeCount)) return false;
+        }
+        for (uint32_t i = 0; i < h->indexCount; i++) {
+            if (primIndices[i] >= h->primCount) return false;
+        }
+        return true;
+    }
+
+    size_t cacheSize(const CacheHeader *h) {
+        return sizeof(CacheHeader) + size_t(h->nodeCount)*sizeof(BVHNode) + size_t(h->indexCount)*sizeof(uint32_t) + size_t(h->primCount)*sizeof(uint32_t);
+    }
+}
+
+uint64_t hashBytes(const void *data, size_t size, uint64_t h) {
+    const uint8_t *b = (const uint8_t*)data;
+    for (size_t i = 0; i < size; i++) {
+        h ^= b[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+uint64_t hashGeometry(Container *flat) {
+    uint64_t h = hashValue(flat->size, hashBytes(NULL, 0));
+    if (flat->size == 0) return h;
+    Bound *bo = flat->start;
+    while (bo != flat->end->next) {
+        if (bo->s != NULL) {
+            h = hashValue(bo->s->type(), h);
+            h = hashValue(bo->s->debug, h);
+            h = hashValue(bo->min, h);
+            h = hashValue(bo->max, h);
+            h = hashValue(bo->centroid, h);
+            // Spatial splits clip triangles, so depend on more than their bounds.
+            Triangle *t = dynamic_cast<Triangle*>(bo->s);
+            if (t != nullptr) {
+                h = hashValue(t->a, h);
+                h = hashValue(t->b, h);
+                h = hashValue(t->c, h);
+                h = hashValue(t->plane, h);
+            }
+        }
+        bo = bo->next;
+    }
+    return h;
+}
+
+bool saveBVHCache(const std::string &path, uint64_t key, const LinearBVH *bvh) {
+    std::error_code err;
+    std::filesystem::path p(path);
+    if (p.has_parent_path()) std::filesystem::create_directories(p.parent_path(), err);
+    if (err) {
+        std::printf("Couldn't create cache directory %s: %s\n", p.parent_path().c_str(), err.message().c_str());
+        return false;
+    }
+    CacheHeader h;
+    std::memcpy(h.magic, cacheMagic, sizeof(h.magic));
+    h.version = BVH_CACHE_VERSION;
+    h.key = key;
+    h.nodeCount = bvh->nodes.size();
+    h.indexCount = bvh->primIndices.size();
+    h.primCount = bvh->prims.size();
+    h.stackDepth = bvh->stackDepth;
+    std::vector<uint32_t> ids(h.primCount);
+    for (uint32_t i = 0; i < h.primCount; i++) {
+        ids[i] = bvh->prims[i]->id;
+    }
+
+    std::string tmp = path + ".tmp";
+    FILE *f = std::fopen(tmp.c_str(), "wb");
+    if (f == NULL) {
+        std::printf("Couldn't write cache file %s\n", tmp.c_str());
+        return false;
+    }
+    bool ok = std::fwrite(&h, sizeof(h), 1, f) == 1;
+    ok = ok && std::fwrite(bvh->nodes.data(), sizeof(BVHNode), h.nodeCount, f) == h.nodeCount;
+    ok = ok && std::fwrite(bvh->primIndices.data(), sizeof(uint32_t), h.indexCount, f) == h.indexCount;
+    ok = ok && std::fwrite(ids.data(), sizeof(uint32_t), h.primCount, f) == h.primCount;
+    ok = (std::fclose(f) == 0) && ok;
+    if (ok) {
+        std::filesystem::rename(tmp, path, err);
+        ok = !err;
+    }
+    if (!ok) {
+        std::printf("Couldn't write cache file %s\n", path.c_str());
+        std::filesystem::remove(tmp, err);
+    }
+    return ok;
+}
+
+LinearBVH *loadBVHCache(const std::string &path, uint64_t key, Container *flat) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(CacheHeader)) {
+        close(fd);
+        return NULL;
+    }
+    size_t size = st.st_size;
+    void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return NULL;
+
+    const CacheHeader *h = (const CacheHeader*)data;
+    LinearBVH *bvh = NULL;
+    if (std::memcmp(h->magic, cacheMagic, sizeof(h->magic)) == 0 && h->version == BVH_CACHE_VERSION && h->key == key && cacheSize(h) == size) {
+        // Shapes by their id, which is their index in flat.
+        std::vector<Shape*> shapes(flat->size, NULL);
+        if (flat->size > 0) {
+            Bound *bo = flat->start;
+            while (bo != flat->end->next) {
+                if (bo->s != NULL && bo->s->id >= 0 && bo->s->id < flat->size) shapes[bo->s->id] = bo->s;
+                bo = bo->next;
+            }
+        }
+        const BVHNode *nodes = (const BVHNode*)(h+1);
+        const uint32_t *primIndices = (const uint32_t*)(nodes + h->nodeCount);
+        const uint32_t *ids = primIndices + h->indexCount;
+        if (!validCache(h, nodes, primIndices)) {
+            munmap(data, size);
+            return NULL;
+        }
+        bvh = new LinearBVH();
+        bvh->nodes.assign(nodes, nodes + h->nodeCount);
+        bvh->primIndices.assign(primIndices, primIndices + h->indexCount);
+        bvh->prims.resize(h->primCount);
+        bvh->stackDepth = h->stackDepth;
+        for (uint32_t i = 0; i < h->primCount; i++) {
+            bvh->prims[i] = ids[i] < shapes.size() ? shapes[ids[i]] : NULL;
+            // The key should rule this out, but a file that doesn't match the scene mustn't be traversed.
+            if (bvh->prims[i] == NULL) {
+                delete bvh;
+                bvh = NULL;
+                break;
+            }
+        }
+    }
+    munmap(data, size);
+    return bvh;
+}
@@ -0,0 +1,127 @@
+#include "costs.hpp"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <vector>
+#include "bvh.hpp"
+#include "instance.hpp"
+#include "mat.hpp"
+#include "test.hpp"
+
+namespace {
+    const char *shapeTypeNames[ShapeType::Count] = {"Sphere", "Triangle", "Box", "CSG", "Cylinder", "Cone", "Instance"};
+
+    // n Instances of a mesh of meshSize small triangles scattered across a unit cube, each moved and rotated somewhere random.
+    std::vector<Shape*> instanceList(Mesh *mesh, int n, int meshSize, std::mt19937 *gen) {
+        std::uniform_real_distribution<float> unit(-0.5f, 0.5f);
+        std::uniform_real_distribution<float> coord(-10.f, 10.f);
+        std::uniform_real_distribution<float> angle(0.f, 2.f*M_PI);
+        for (int i = 0; i < meshSize; i++) {
+            Triangle *t = new Triangle();
+            Vec3 p = {unit(*gen), unit(*gen), unit(*gen)};
+            Vec3 *v[3] = {&(t->oA), &(t->oB), &(t->oC)};
+            for (int j = 0; j < 3; j++) {
+                *v[j] = p + 0.1f*Vec3{unit(*gen), unit(*gen), unit(*gen)};
+            }
+            mesh->shapes.append(t);
+        }
+        mesh->build();
+        std::vector<Shape*> instances;
+        for (int i = 0; i < n; i++) {
+            Mat4 placement = translateMat({coord(*gen), coord(*gen), coord(*gen)}) * rotateY(angle(*gen)) * transformScale(2.f);
+            instances.emplace_back(new Instance(mesh, placement));
+        }
+        return instances;
+    }
+}
+
+void calibrateShapeCosts(float *costs, int n, int repeats, int meshSize) {
+    std::mt19937 gen(0);
+    std::vector<BVHNode> nodes(n);
+    std::uniform_int_distribution<> coord(-9998, 9999);
+    for (BVHNode &node: nodes) {
+        for (int j = 0; j < 3; j++) {
+            float a = float(coord(gen)) / 1000.f, b = float(coord(gen)) / 1000.f;
+            node.min(j) = std::min(a, b);
+            node.max(j) = std::max(a, b);
+        }
+    }
+    double nodeTime = DBL_MAX;
+    int missed = 0;
+    for (int i = 0; i < repeats; i++) {
+        int raySeed = i, hits = 0;
+        nodeTime = std::min(nodeTime, traverseAll(nodes, &hits, &raySeed));
+        missed += n - hits;
+    }
+    // Every ray ends inside its node, so a miss means the box test isn't what traversal does.
+    if (missed != 0) std::printf("Shape cost calibration: %d of %d rays missed their node\n", missed, n*repeats);
+
+    Mesh mesh;
+    for (int type = 0; type < ShapeType::Count; type++) {
+        int seed = type;
+        std::vector<Shape*> shapes = type == ShapeType::Instance ? instanceList(&mesh, n, meshSize, &gen) : shapeList(type, n, &seed);
+        double time = DBL_MAX;
+        for (int i = 0; i < repeats; i++) {
+            int raySeed = i;
+            time = std::min(time, traverseAll(shapes, &raySeed));
+        }
+        costs[type] = nodeTime > 0.0 ? float(time / nodeTime) : 1.f;
+        for (Shape *sh: shapes) {
+            sh->clear();
+            delete sh;
+        }
+    }
+}
+
+std::string describeShapeCosts(const float *costs) {
+    std::ostringstream out;
+    out.precision(3);
+    for (int type = 0; type < ShapeType::Count; type++) {
+        if (type != 0) out << ", ";
+        out << shapeTypeNames[type] << " " << costs[type];
+    }
+    return out.str();
+}
+
+bool loadShapeCosts(const std::string &path, float *costs) {
+    std::ifstream f(path);
+    if (!f.is_open()) return false;
+    std::string magic;
+    int version = 0;
+    f >> magic >> version;
+    if (magic != "rtcosts" || version != SHAPE_COSTS_VERSION) return false;
+    float read[ShapeType::Count];
+    for (int type = 0; type < ShapeType::Count; type++) {
+        f >> read[type];
+        // Skip the type's name.
+        f.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        if (f.fail() || !std::isfinite(read[type]) || read[type] <= 0.f) return false;
+    }
+    std::copy(read, read + ShapeType::Count, costs);
+    return true;
+}
+
+bool saveShapeCosts(const std::string &path, const float *costs) {
+    std::error_code err;
+    std::filesystem::path p(path);
+    if (p.has_parent_path()) std::filesystem::create_directories(p.parent_path(), err);
+    std::ofstream f(path);
+    if (err || !f.is_open()) {
+        std::printf("Couldn't write shape costs to %s\n", path.c_str());
+        return false;
+    }
+    // Enough digits to read back exactly the same floats, as the BVH cache keys hash them.
+    f.precision(std::numeric_limits<float>::max_digits10);
+    f << "rtcosts " << SHAPE_COSTS_VERSION << "\n";
+    for (int type = 0; type < ShapeType::Count; type++) {
+        f << costs[type] << " # " << shapeTypeNames[type] << "\n";
+    }
+    return true;
+}
@@ -6,6 +6,7 @@
 #include <fstream>
 #include <sstream>
 #include <cmath>
+#include <algorithm>
 
 #include "accel.hpp"
 #include "glad/glad.h"
@@ -17,6 +18,9 @@
 #include "imgui_impl_opengl3.h"
 #include "imgui_internal.h"
 #include "aa.hpp"
+#include "bvh.hpp"
+#include "costs.hpp"
+#include "instance.hpp"
 
 #define MOVE_SPEED 1.f
 
@@ -116,6 +120,7 @@ GLWindow::GLWindow(int width, int height, float scale, const char *windowTitle)
     state.fbDim = {width, height, width, height};
     state.scale = scale;
     state.reloadMap = false;
+    state.instanceIncludes = true;
     state.currentlyRendering = false;
     state.currentlyOptimizing = false;
     state.currentlyLoading = false;
@@ -307,6 +312,21 @@ void GLWindow::loadUI() {
     state.accelIndex = 1; // SAH
     state.accelParam = 2;
     state.accelFloatParam = 1.5f; // For now, SAH tri/sphere cost ratio
+    state.accelBins = 16;
+    state.accelWidth = 4;
+    state.accelSplitAlpha = 1e-5f;
+    state.accelTreeletLevels = 0;
+    state.accelSearchRadius = 16;
+    state.accelLayout = BVHLayout::DepthFirst;
+    state.accelLayoutStats = false;
+    state.useMeasuredCosts = true;
+    state.remeasureCosts = false;
+    state.shapeCosts = NULL;
+    state.refitRebuildRatio = 1.5f;
+    state.lastOptimizeAllocations = 0;
+    state.lastOptimizePeakBytes = 0;
+    state.lastOptimizeCost = 0.f;
+    state.splitSAHCost = 0.f;
     state.useBVH = true;
     state.renderOptimizedHierarchy = false;
 
@@ -426,6 +446,14 @@ std::string GLWindow::acceleratorInfo() {
         out << "(" << state.lastOptimizeTime << "s) ";
     }
     out << "at max depth " << state.accelDepth << ".";
+    if (!state.currentlyOptimizing) {
+        out << " Peak " << (state.lastOptimizePeakBytes / 1024) << "KiB in " << state.lastOptimizeAllocations << " allocations.";
+        if (state.lastOptimizeCost != 0.f) {
+            out << " SAH cost " << state.lastOptimizeCost;
+            if (state.accelIndex != Accel::SAH && state.splitSAHCost != 0.f) out << " (" << state.splitSAHCost << " with splitSAH)";
+            out << ".";
+        }
+    }
     return out.str();
 }
 
@@ -443,6 +471,7 @@ std::string GLWindow::mapLoadInfo() {
     out << state.mapStats->lights << "l/";
     out << state.mapStats->planes << "p/";
     out << state.mapStats->aabs << "b/";
+    out << state.mapStats->instances << "i (of " << state.mapStats->instancedShapes << " shapes)/";
     out << state.mapStats->tex << "tex/";
     out << state.mapStats->norm << "ntex/";
     out << state.mapStats->allocs << "allocs.";
@@ -563,6 +592,7 @@ void GLWindow::addUI() {
         ImGui::SameLine();
         enable();
         ImGui::InputText(".map path", &(state.mapPath));
+        ImGui::Checkbox("Instance included files", &(state.instanceIncludes));
 
         disable();
         if (reloadMap) {
@@ -621,12 +651,64 @@ void GLWindow::addUI() {
             if (state.renderOptimizedHierarchy) {
                 renderTree(state.optimizedMap);
             }
-            vl(ImGui::Combo("Acceleration method", &(state.accelIndex), accelerators, IM_ARRAYSIZE(accelerators)));
+            if (ImGui::BeginCombo("Acceleration method", accelerators[state.accelIndex])) {
+                for (int i = 0; i < IM_ARRAYSIZE(acceleratorOrder); i++) {
+                    int idx = acceleratorOrder[i];
+                    if (vl(ImGui::Selectable(accelerators[idx], idx == state.accelIndex))) state.accelIndex = idx;
+                }
+                ImGui::EndCombo();
+            }
+            // Measured costs replace the ratio altogether (see shapeCost), so it's only shown when they're off.
+            auto costRatioSlider = [&]() {
+                if (!state.useMeasuredCosts) vl(ImGui::SliderFloat("SAH Triangle/Sphere cost ratio", &(state.accelFloatParam), 0.1f, 100.f));
+            };
             if (state.accelIndex == Accel::BiTree || state.accelIndex == Accel::FalseOctree) {
                 vl(ImGui::SliderInt("Max leaves per node", &(state.accelParam), 1, 100));
+                if (state.accelIndex == Accel::BiTree) costRatioSlider();
             } else if (state.accelIndex == Accel::SAH) {
-                vl(ImGui::SliderFloat("SAH Triangle/Sphere cost ratio", &(state.accelFloatParam), 0.1f, 100.f));
+                costRatioSlider();
+            } else if (state.accelIndex == Accel::WideBVH) {
+                costRatioSlider();
+                vl(ImGui::RadioButton("4 children per node (SSE)", &(state.accelWidth), 4));
+                ImGui::SameLine();
+                vl(ImGui::RadioButton("8 children per node (AVX)", &(state.accelWidth), 8));
+            } else if (state.accelIndex == Accel::Voxel) {
+                ImGui::Text("Max hierarchy depth caps the cells along each axis.");
+                vl(ImGui::SliderFloat("Grid cells per shape", &(state.accelFloatParam), 0.1f, 64.f));
+            } else if (state.accelIndex == Accel::TwoLevelGrid) {
+                vl(ImGui::SliderInt("Max shapes per cell before sub-grid", &(state.accelParam), 1, 100));
+                vl(ImGui::SliderFloat("Sub-grid cells per shape", &(state.accelFloatParam), 0.1f, 16.f));
+            } else if (state.accelIndex == Accel::BinnedSAH || state.accelIndex == Accel::InPlaceSAH) {
+                vl(ImGui::SliderInt("Max leaves per node", &(state.accelParam), 1, 100));
+                costRatioSlider();
+                vl(ImGui::SliderInt("SAH bins", &(state.accelBins), 2, 64));
+            } else if (state.accelIndex == Accel::SpatialSplitBVH) {
+                vl(ImGui::SliderInt("Max leaves per node", &(state.accelParam), 1, 100));
+                costRatioSlider();
+                vl(ImGui::SliderInt("SAH bins", &(state.accelBins), 2, 64));
+                ImGui::Text("Spatial splits are tried where children overlap by more than this much of the scene's surface area.");
+                vl(ImGui::SliderFloat("Overlap threshold (alpha)", &(state.accelSplitAlpha), 1e-7f, 1.f, "%.7f", ImGuiSliderFlags_Logarithmic));
+            } else if (state.accelIndex == Accel::MortonBVH) {
+                vl(ImGui::SliderInt("Max leaves per node", &(state.accelParam), 1, 100));
+                costRatioSlider();
+                ImGui::Text("The top levels of the tree can be restructured with the SAH, at some cost to build time.");
+                vl(ImGui::SliderInt("Treelet-optimized levels", &(state.accelTreeletLevels), 0, 16));
+            } else if (state.accelIndex == Accel::PLOC) {
+                vl(ImGui::SliderInt("Max leaves per node", &(state.accelParam), 1, 100));
+                costRatioSlider();
+                vl(ImGui::SliderInt("Nearest neighbour search radius", &(state.accelSearchRadius), 1, 64));
+            }
+            if (state.accelIndex != Accel::Voxel && state.accelIndex != Accel::TwoLevelGrid && state.accelIndex != Accel::BiTree && state.accelIndex != Accel::FalseOctree && state.accelIndex != Accel::WideBVH) {
+                vl(ImGui::Combo("Node layout", &(state.accelLayout), bvhLayouts, IM_ARRAYSIZE(bvhLayouts)));
+                vl(ImGui::Checkbox("Print memory touched per ray", &(state.accelLayoutStats)));
             }
+            vl(ImGui::Checkbox("Use measured shape costs", &(state.useMeasuredCosts)));
+            if (state.useMeasuredCosts && state.shapeCosts != NULL) {
+                ImGui::Text("Relative to a node: %s", describeShapeCosts(state.shapeCosts).c_str());
+                ImGui::SameLine();
+                if (vl(ImGui::Button("Measure again"))) state.remeasureCosts = true;
+            }
+            ImGui::SliderFloat("Rebuild once moving shapes grows SAH cost by", &(state.refitRebuildRatio), 1.f, 10.f);
             if (state.lastOptimizeTime != 0.f) {
                 ImGui::Text(acceleratorInfo().c_str());
             }
@@ -907,11 +989,6 @@ void GLWindow::renderTree(Container *c, int tabIndex) {
     ImVec4 containerColor(1.f, 1.f, 1.f, 1.f);
     Bound *end = c->end->next;
     int size = c->size;
-    if (c->voxelSubdiv != 0) {
-        size = c->voxelSubdiv * c->voxelSubdiv * c->voxelSubdiv;
-        end = c->start + (c->voxelSubdiv*c->voxelSubdiv*c->voxelSubdiv) + 1;
-    }
-
 
     if (tabIndex == 0) {
         ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(1.f, 1.f, 1.f, 1.f));
@@ -923,20 +1000,9 @@ void GLWindow::renderTree(Container *c, int tabIndex) {
         ImGui::PopStyleColor();
     } else {
         auto prefix = std::string(tabIndex*2, ' ');
-        Bound *bo = c->start;
-        while (bo != end) {
-            Shape *current = bo->s;
-            Triangle *t = dynamic_cast<Triangle*>(current);
-            if (t != nullptr && current->debug) {
-                containerColor = ImVec4(current->mat()->color.x, current->mat()->color.y, current->mat()->color.z, 1.f);
-                break;
-            }
-            if (c->voxelSubdiv != 0) {
-                bo++;
-            } else {
-                bo = bo->next;
-            }
-        }
+        // Same color as the node's box in the debug overlay.
+        Vec3 color = debugColor(tabIndex);
+        containerColor = ImVec4(color.x, color.y, color.z, 1.f);
         char splitAxis = 'x';
         if (c->splitAxis == 1) splitAxis = 'y';
         else if (c->splitAxis == 2) splitAxis = 'z';
@@ -959,11 +1025,7 @@ void GLWindow::renderTree(Container *c, int tabIndex) {
         } else if (!(current->debug)) {
             children++;
         }
-        if (c->voxelSubdiv != 0) {
-            bo++;
-        } else {
-            bo = bo->next;
-        }
+        bo = bo->next;
     }
     auto prefix2 = std::string((tabIndex+1)*2, ' ');
     if (children != 0) {
@@ -1014,6 +1076,15 @@ void GLWindow::showMaterialEditor(Material *m) {
     vl(ImGui::Combo("Reflection Map", &(m->refId), state.refs->names, state.refs->texes.size()));
 }
 
+// Marks "sh" for re-transforming, and the shape selected in the dropdown (which sh is part of if it's in a CSG) for the map to refit around.
+void GLWindow::markMoved(Shape *sh) {
+    sh->transformDirty = true;
+    Shape *selected = getShapePointer();
+    if (selected != NULL && std::find(state.movedShapes.begin(), state.movedShapes.end(), selected) == state.movedShapes.end()) {
+        state.movedShapes.emplace_back(selected);
+    }
+}
+
 void GLWindow::showShapeEditor(Shape *shape, bool hideTransforms) {
     if (state.currentlyLoading || state.currentlyOptimizing) return;
     Shape *sh = shape;
@@ -1037,24 +1108,25 @@ void GLWindow::showShapeEditor(Shape *shape, bool hideTransforms) {
     CSG *c = dynamic_cast<CSG*>(sh);
     Cylinder *cl = dynamic_cast<Cylinder*>(sh);
     Cone *co = dynamic_cast<Cone*>(sh);
+    Instance *in = dynamic_cast<Instance*>(sh);
 
     if (s != nullptr) {
         if (ImGui::InputFloat3("Position", (float*)&(s->oCenter)) ||
             vl(ImGui::SliderFloat("Radius", &(s->oRadius), 0, 20.f))) {
-            sh->transformDirty = true;
+            markMoved(sh);
         }
         vl(ImGui::SliderFloat("\"Thickness\"", &(s->thickness), 0, 1.f));
     } else if (t != nullptr) {
         if (ImGui::InputFloat3("Pos A", (float*)&(t->oA)) ||
             ImGui::InputFloat3("Pos B", (float*)&(t->oB)) ||
             ImGui::InputFloat3("Pos C", (float*)&(t->oC))) {
-            sh->transformDirty = true;
+            markMoved(sh);
         }
     } else if (b != nullptr) {
         if (ImGui::InputFloat3("Min Corner", (float*)&(b->oMin)) ||
             ImGui::InputFloat3("Max Corner", (float*)&(b->oMax)) ||
             vl(ImGui::SliderInt("Face for UV scaling (x, y, z)", &(b->faceForUV), 0, 2))) {
-            sh->transformDirty = true;
+            markMoved(sh);
         }
     } else if (c != nullptr) {
         vl(ImGui::Combo("CSG Operation", (int*)&(c->relation), CSG::RelationNames, CSG::RelationCount));
@@ -1071,7 +1143,7 @@ void GLWindow::showShapeEditor(Shape *shape, bool hideTransforms) {
             vl(ImGui::SliderFloat("Radius", &(cl->oRadius), 0, 20.f)) ||
             vl(ImGui::SliderFloat("Length", &(cl->oLength), 0, 20.f)) ||
             vl(ImGui::SliderInt("Axis", &(cl->axis), 0, 2))) {
-            sh->transformDirty = true;
+            markMoved(sh);
         }
         vl(ImGui::SliderFloat("\"Thickness\"", &(cl->thickness), 0, 1.f));
     } else if (co != nullptr) {
@@ -1079,9 +1151,11 @@ void GLWindow::showShapeEditor(Shape *shape, bool hideTransforms) {
             vl(ImGui::SliderFloat("Radius", &(co->oRadius), 0, 20.f)) ||
             vl(ImGui::SliderFloat("Length", &(co->oLength), 0, 20.f)) ||
             vl(ImGui::SliderInt("Axis", &(co->axis), 0, 2))) {
-            sh->transformDirty = true;
+            markMoved(sh);
         }
         vl(ImGui::SliderFloat("\"Thickness\"", &(co->thickness), 0, 1.f));
+    } else if (in != nullptr) {
+        ImGui::Text("%s (%d shapes, shared by every instance)", in->mesh->path.c_str(), in->mesh->shapes.size);
     }
 
     if (t != nullptr || b != nullptr) {
@@ -1095,10 +1169,13 @@ void GLWindow::showShapeEditor(Shape *shape, bool hideTransforms) {
         if (vl(ImGui::InputFloat3("Translate", (float*)&(sh->trans().translate))) ||
             vl(ImGui::SliderFloat3("Rotate", (float*)&(sh->trans().rotate), 0.f, 2.f*M_PI)) ||
             vl(ImGui::SliderFloat("Scale", &(sh->trans().scale), 0.f, 100.f))) {
-            sh->transformDirty = true;
+            markMoved(sh);
         }
     }
 
+    // An instance's shapes keep their own materials.
+    if (in != nullptr) return;
+
     // material params
     ImGui::Text("material");
     showMaterialEditor(sh->mat());
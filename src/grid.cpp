@@ -0,0 +1,240 @@
+#include "grid.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <memory>
+#include "accel.hpp"
+#include "pool.hpp"
+
+namespace {
+    struct PrimBox {
+        Vec3 min, max;
+    };
+
+    // Every shape in "o" (but debug objects), and its bounds.
+    void collectPrims(Container *o, std::vector<PrimBox> *boxes, std::vector<Shape*> *prims) {
+        if (o->size == 0) return;
+        Bound *bo = o->start;
+        while (bo != o->end->next) {
+            if (bo->s != NULL && !(bo->s->debug)) {
+                boxes->push_back({bo->min, bo->max});
+                prims->emplace_back(bo->s);
+            }
+            bo = bo->next;
+        }
+    }
+
+    // Cells (inclusive) along each axis of "g" that "b" overlaps.
+    void cellRange(const Grid &g, const PrimBox &b, int *lo, int *hi) {
+        Vec3 dims = g.max - g.min;
+        for (int i = 0; i < 3; i++) {
+            // A grid with no depth along an axis only has the one cell.
+            if (dims(i) <= 0.f) {
+                lo[i] = 0;
+                hi[i] = 0;
+                continue;
+            }
+            float scale = g.res[i] / dims(i);
+            lo[i] = std::clamp(int(std::floor((b.min(i) - g.min(i)) * scale)), 0, g.res[i]-1);
+            hi[i] = std::clamp(int(std::floor((b.max(i) - g.min(i)) * scale)), 0, g.res[i]-1);
+        }
+    }
+
+    // Shapes each job of a parallel grid build handles.
+    const uint32_t gridChunkSize = 4096;
+
+    // Calls fn(cell) for every cell of "g" that "b" overlaps.
+    template <typename F>
+    void forCells(const Grid &g, const PrimBox &b, F fn) {
+        int lo[3], hi[3];
+        cellRange(g, b, lo, hi);
+        for (int z = lo[2]; z <= hi[2]; z++) {
+            for (int y = lo[1]; y <= hi[1]; y++) {
+                for (int x = lo[0]; x <= hi[0]; x++) {
+                    fn(x + g.res[0] * (y + g.res[1] * z));
+                }
+            }
+        }
+    }
+
+    // Lists the shapes "prims" (indices into "boxes") in each cell of "g", in two passes:
+    // the first counts how many go in each cell, so the second can write them straight into place in "indices".
+    // Offsets in "cells" are relative to the start of "indices".
+    void fillGrid(const Grid &g, const std::vector<PrimBox> &boxes, const uint32_t *prims, uint32_t n, std::vector<GridCell> *cells, std::vector<uint32_t> *indices) {
+        cells->assign(g.cellCount(), {0, 0, -1});
+        for (uint32_t p = 0; p < n; p++) {
+            forCells(g, boxes[prims[p]], [&](uint32_t c) { (*cells)[c].count++; });
+        }
+        uint32_t total = 0;
+        for (GridCell &c: *cells) {
+            c.offset = total;
+            total += c.count;
+            c.count = 0;
+        }
+        indices->resize(total);
+        for (uint32_t p = 0; p < n; p++) {
+            forCells(g, boxes[prims[p]], [&](uint32_t c) {
+                GridCell *cell = &((*cells)[c]);
+                (*indices)[cell->offset + cell->count++] = prims[p];
+            });
+        }
+    }
+
+    // A sub-grid built on its own, before being copied into the TwoLevelGrid.
+    struct SubGridBuild {
+        uint32_t topCell;
+        Grid g;
+        std::vector<GridCell> cells;
+        std::vector<uint32_t> indices;
+    };
+}
+
+void gridResolution(Vec3 extent, float longest, int maxRes, int *res) {
+    float maxExtent = std::fmax(extent.x, std::fmax(extent.y, extent.z));
+    // Capped before the other axes are worked out from it, so they stay in proportion.
+    longest = std::fmin(longest, float(maxRes));
+    for (int i = 0; i < 3; i++) {
+        float cells = maxExtent > 0.f ? longest * (extent(i) / maxExtent) : 1.f;
+        res[i] = std::clamp(int(std::round(cells)), 1, maxRes);
+    }
+}
+
+UniformGrid *buildUniformGrid(Container *o, int maxRes, float density, ThreadPool *pool) {
+    if (o == NULL) return NULL;
+    UniformGrid *grid = new UniformGrid();
+    std::vector<PrimBox> boxes;
+    collectPrims(o, &boxes, &(grid->prims));
+    uint32_t n = boxes.size();
+    Grid *g = &(grid->g);
+    g->min = o->min;
+    g->max = o->max;
+    g->firstCell = 0;
+    // "Cleary J., Wyvill G.: Analysis of an algorithm for fast ray tracing using uniform space subdivision":
+    // the cost of a ray is lowest with the number of cells proportional to the number of shapes.
+    gridResolution(o->max - o->min, std::cbrt(std::fmax(density, 0.f) * n), std::max(1, maxRes), g->res);
+    uint32_t cells = g->cellCount();
+    countBuildMemory(sizeof(UniformGrid) + grid->prims.capacity()*sizeof(Shape*), 2);
+
+    // Pass 1: How many shapes overlap each cell.
+    std::unique_ptr<std::atomic<uint32_t>[]> counts(new std::atomic<uint32_t>[cells]);
+    for (uint32_t i = 0; i < cells; i++) counts[i].store(0, std::memory_order_relaxed);
+    parallelChunks(pool, n, gridChunkSize, [&](uint32_t, uint32_t begin, uint32_t end) {
+        for (uint32_t p = begin; p < end; p++) {
+            forCells(*g, boxes[p], [&](uint32_t c) { counts[c].fetch_add(1, std::memory_order_relaxed); });
+        }
+    });
+    grid->cellStart.resize(cells + 1);
+    uint32_t total = 0;
+    for (uint32_t i = 0; i < cells; i++) {
+        grid->cellStart[i] = total;
+        total += counts[i].load(std::memory_order_relaxed);
+        // Reused as each cell's write position in pass 2.
+        counts[i].store(grid->cellStart[i], std::memory_order_relaxed);
+    }
+    grid->cellStart[cells] = total;
+
+    // Pass 2: Write each shape into every cell it overlaps.
+    grid->primIndices.resize(total);
+    parallelChunks(pool, n, gridChunkSize, [&](uint32_t, uint32_t begin, uint32_t end) {
+        for (uint32_t p = begin; p < end; p++) {
+            forCells(*g, boxes[p], [&](uint32_t c) { grid->primIndices[counts[c].fetch_add(1, std::memory_order_relaxed)] = p; });
+        }
+    });
+    // Shapes were written in whatever order the jobs ran, which would make ties between equally close hits differ between builds.
+    parallelChunks(pool, cells, gridChunkSize, [&](uint32_t, uint32_t begin, uint32_t end) {
+        for (uint32_t c = begin; c < end; c++) {
+            std::sort(grid->primIndices.begin() + grid->cellStart[c], grid->primIndices.begin() + grid->cellStart[c+1]);
+        }
+    });
+    countBuildMemory(grid->cellStart.capacity()*sizeof(uint32_t) + grid->primIndices.capacity()*sizeof(uint32_t), 2);
+    return grid;
+}
+
+TwoLevelGrid *buildTwoLevelGrid(Container *o, int topRes, int maxCellPrims, float density, ThreadPool *pool) {
+    if (o == NULL) return NULL;
+    TwoLevelGrid *grid = new TwoLevelGrid();
+    std::vector<PrimBox> boxes;
+    collectPrims(o, &boxes, &(grid->prims));
+    std::vector<uint32_t> all(boxes.size());
+    for (uint32_t i = 0; i < all.size(); i++) all[i] = i;
+    countBuildMemory(sizeof(TwoLevelGrid) + grid->prims.capacity()*sizeof(Shape*), 2);
+
+    Grid top;
+    top.min = o->min;
+    top.max = o->max;
+    top.firstCell = 0;
+    gridResolution(o->max - o->min, std::max(1, topRes), std::max(1, topRes), top.res);
+    std::vector<uint32_t> topIndices;
+    fillGrid(top, boxes, all.data(), all.size(), &(grid->cells), &topIndices);
+    grid->grids.emplace_back(top);
+    countBuildMemory(grid->cells.capacity()*sizeof(GridCell), 1);
+
+    // Cells too full to be worth testing every shape in get a grid of their own, of around density*count cells.
+    std::vector<SubGridBuild> subs;
+    Vec3 topVox = {(top.max.x - top.min.x) / top.res[0], (top.max.y - top.min.y) / top.res[1], (top.max.z - top.min.z) / top.res[2]};
+    for (int z = 0; z < top.res[2]; z++) {
+        for (int y = 0; y < top.res[1]; y++) {
+            for (int x = 0; x < top.res[0]; x++) {
+                uint32_t idx = x + top.res[0] * (y + top.res[1] * z);
+                uint32_t count = grid->cells[idx].count;
+                if (count <= uint32_t(std::max(0, maxCellPrims))) continue;
+                SubGridBuild s;
+                s.topCell = idx;
+                s.g.min = top.min + Vec3{topVox.x * x, topVox.y * y, topVox.z * z};
+                s.g.max = s.g.min + topVox;
+                gridResolution(topVox, std::cbrt(std::fmax(density, 0.f) * count), GRID_MAX_SUB_RES, s.g.res);
+                subs.emplace_back(std::move(s));
+            }
+        }
+    }
+    JobGroup subBuilds;
+    for (SubGridBuild &s: subs) {
+        const GridCell *c = &(grid->cells[s.topCell]);
+        auto build = [&, c]() {
+            fillGrid(s.g, boxes, topIndices.data() + c->offset, c->count, &(s.cells), &(s.indices));
+        };
+        if (pool != NULL) pool->submit(&subBuilds, build);
+        else build();
+    }
+    if (pool != NULL) pool->wait(&subBuilds);
+
+    // Everything's copied into one set of arrays: the top cells' own shapes first, then each sub-grid's.
+    size_t cellTotal = grid->cells.size(), indexTotal = 0;
+    for (const SubGridBuild &s: subs) {
+        cellTotal += s.cells.size();
+        indexTotal += s.indices.size();
+    }
+    std::vector<bool> dense(grid->cells.size(), false);
+    for (const SubGridBuild &s: subs) dense[s.topCell] = true;
+    for (size_t i = 0; i < grid->cells.size(); i++) {
+        if (!dense[i]) indexTotal += grid->cells[i].count;
+    }
+    size_t topCells = grid->cells.size();
+    grid->cells.reserve(cellTotal);
+    grid->primIndices.reserve(indexTotal);
+    grid->grids.reserve(1 + subs.size());
+    for (size_t i = 0; i < dense.size(); i++) {
+        GridCell *c = &(grid->cells[i]);
+        if (dense[i]) continue;
+        uint32_t offset = grid->primIndices.size();
+        grid->primIndices.insert(grid->primIndices.end(), topIndices.begin() + c->offset, topIndices.begin() + c->offset + c->count);
+        c->offset = offset;
+    }
+    for (SubGridBuild &s: subs) {
+        GridCell *c = &(grid->cells[s.topCell]);
+        c->sub = grid->grids.size();
+        c->offset = 0;
+        c->count = 0;
+        s.g.firstCell = grid->cells.size();
+        grid->grids.emplace_back(s.g);
+        uint32_t base = grid->primIndices.size();
+        for (GridCell sc: s.cells) {
+            sc.offset += base;
+            grid->cells.emplace_back(sc);
+        }
+        grid->primIndices.insert(grid->primIndices.end(), s.indices.begin(), s.indices.end());
+    }
+    countBuildMemory((grid->cells.capacity() - topCells)*sizeof(GridCell) + grid->primIndices.capacity()*sizeof(uint32_t) + grid->grids.capacity()*sizeof(Grid), 2);
+    return grid;
+}
@@ -0,0 +1,143 @@
+#include "instance.hpp"
+
+#include <algorithm>
+
+namespace {
+    Mat3 linearPart(const Mat4 &m) {
+        return Mat3{{
+            m(0, 0), m(0, 1), m(0, 2),
+            m(1, 0), m(1, 1), m(1, 2),
+            m(2, 0), m(2, 1), m(2, 2)
+        }};
+    }
+
+    Mat3 transpose(const Mat3 &m) {
+        return Mat3{{
+            m(0, 0), m(1, 0), m(2, 0),
+            m(0, 1), m(1, 1), m(2, 1),
+            m(0, 2), m(1, 2), m(2, 2)
+        }};
+    }
+}
+
+void Mesh::build(int maxLeafSize, float costTriSphereRatio, int nBins, ThreadPool *pool) {
+    delete bvh;
+    bvh = NULL;
+    shapes.min = {1e30f, 1e30f, 1e30f};
+    shapes.max = {-1e30f, -1e30f, -1e30f};
+    if (shapes.size == 0) return;
+    Bound *bo = shapes.start;
+    while (bo != shapes.end->next) {
+        Shape *s = bo->s;
+        s->applyTransform();
+        s->bounds(bo);
+        bo->s = s;
+        shapes.grow(bo);
+        bo = bo->next;
+    }
+    bvh = buildLinearBVH(&shapes, BVH_STACK_SIZE, maxLeafSize, costTriSphereRatio, nBins, pool);
+}
+
+// Like WorldMap::bvhRay, but without the mailbox or anything else needed for rendering, for when an instance is tested as a plain shape.
+float Mesh::intersect(const Ray &r, Shape **hit, Vec3 *normal, Vec2 *uv) {
+    if (bvh == NULL) return -1.f;
+    uint32_t stack[BVH_STACK_SIZE];
+    int top = 0;
+    float t, closest = -1.f;
+    Ray cur = r;
+    if (meetsNode(&(bvh->nodes[0]), cur, &t)) stack[top++] = 0;
+    while (top > 0) {
+        const BVHNode *n = &(bvh->nodes[stack[--top]]);
+        if (!meetsNode(n, cur, &t)) continue;
+        if (n->leaf()) {
+            const uint32_t *idx = bvh->primIndices.data() + n->offset;
+            for (int i = 0; i < n->primCount; i++) {
+                // Mesh shapes can't be edited, so their transforms were applied once in build().
+                Shape *s = bvh->prims[idx[i]];
+                Vec3 sn;
+                Vec2 suv;
+                t = s->intersect(cur, &sn, &suv);
+                if (t < cur.tMin || t > cur.tMax) continue;
+                closest = t;
+                // Anything further away can be skipped from now on.
+                cur.tMax = t;
+                if (hit != NULL) *hit = s;
+                if (normal != NULL) *normal = sn;
+                if (uv != NULL) *uv = suv;
+            }
+            continue;
+        }
+        for (int i = 0; i < n->childCount; i++) {
+            stack[top++] = n->offset + i;
+        }
+    }
+    return closest;
+}
+
+Mesh::~Mesh() {
+    delete bvh;
+    shapes.clear();
+    for (Triangle *p: planes) delete p;
+}
+
+Instance::Instance(Mesh *m, Mat4 placement): Shape(), mesh(m), placement(placement) {
+    transformDirty = true;
+    applyTransform();
+}
+
+void Instance::applyTransform() {
+    if (!transformDirty) return;
+    // The editor's transform is applied after the placement, as it would be to the shapes if they'd been placed directly.
+    toWorld = transform.needed() ? transform.build() * placement : placement;
+    toObject = affineInverse(toWorld);
+    normalToWorld = transpose(linearPart(toObject));
+    transformDirty = false;
+}
+
+void Instance::bakeTransform() {
+    placement = toWorld;
+    transform.reset();
+}
+
+void Instance::bounds(Bound *bo) {
+    bo->min = {0, 0, 0};
+    bo->max = {0, 0, 0};
+    bo->centroid = {0, 0, 0};
+    if (mesh->bvh == NULL) return;
+    // The box around the corners of the mesh's box, once placed.
+    const BVHNode *root = &(mesh->bvh->nodes[0]);
+    for (int i = 0; i < 8; i++) {
+        Vec3 corner = {(i & 1) ? root->max.x : root->min.x, (i & 2) ? root->max.y : root->min.y, (i & 4) ? root->max.z : root->min.z};
+        Vec3 p = pointToWorld(corner);
+        for (int j = 0; j < 3; j++) {
+            bo->min(j) = i == 0 ? p(j) : std::min(bo->min(j), p(j));
+            bo->max(j) = i == 0 ? p(j) : std::max(bo->max(j), p(j));
+        }
+    }
+    bo->centroid = 0.5f * (bo->min + bo->max);
+}
+
+Ray Instance::toObjectSpace(const Ray &r) {
+    return Ray(r.p0 * toObject, linearPart(toObject) * r.delta, r.tMin, r.tMax);
+}
+
+Vec3 Instance::directionToWorld(Vec3 d) {
+    return linearPart(toWorld) * d;
+}
+
+float Instance::intersect(const Ray &r, Vec3 *normal, Vec2 *uv, float* /*t1*/, Vec3* /*normal1*/, Vec2* /*uv1*/) {
+    applyTransform();
+    float t = mesh->intersect(toObjectSpace(r), NULL, normal, uv);
+    if (t >= 0.f && normal != NULL) *normal = normalToWorldSpace(*normal);
+    return t;
+}
+
+bool Instance::intersects(const Ray &r) {
+    return intersect(r) >= 0.f;
+}
+
+// The shape hit is needed to refract through it, so that's done by the renderer (see WorldMap::castRay).
+void Instance::refract(float /*ri*/, Vec3 p0, Vec3 delta, Vec3 *p1, Vec3 *delta1) {
+    *p1 = p0;
+    *delta1 = delta;
+}
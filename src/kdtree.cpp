@@ -0,0 +1,121 @@
+#include "kdtree.hpp"
+
+#include <cstdio>
+#include <unordered_map>
+
+namespace {
+    struct KdFlattener {
+        KdTree *tree;
+        std::unordered_map<Shape*, uint32_t> primIds;
+        int depth;
+        // Set if a node doesn't look like it came from a Bi-tree (more than two children, or shapes alongside them).
+        bool notKd;
+
+        // Shapes straddling a split appear in both children, but are only stored once.
+        uint32_t primId(Shape *s) {
+            auto it = primIds.find(s);
+            if (it != primIds.end()) return it->second;
+            uint32_t id = tree->prims.size();
+            tree->prims.emplace_back(s);
+            primIds[s] = id;
+            return id;
+        }
+
+        void leaf(uint32_t idx, const std::vector<Shape*> &shapes) {
+            KdNode *n = &(tree->nodes[idx]);
+            n->offset = tree->primIndices.size();
+            n->primCount = shapes.size();
+            n->axis = 3;
+            n->split = 0.f;
+            for (Shape *s: shapes) {
+                tree->primIndices.emplace_back(primId(s));
+            }
+        }
+
+        // Fills in nodes[idx] from "c". Children are found by where their cells sit within c's.
+        void node(Container *c, uint32_t idx, int d) {
+            depth = std::max(depth, d);
+            std::vector<Container*> children;
+            std::vector<Shape*> shapes;
+            if (c->size > 0) {
+                Bound *bo = c->start;
+                while (bo != c->end->next) {
+                    if (bo->s != NULL && !(bo->s->debug)) {
+                        Container *sub = dynamic_cast<Container*>(bo->s);
+                        if (sub != nullptr) children.emplace_back(sub);
+                        else shapes.emplace_back(bo->s);
+                    }
+                    bo = bo->next;
+                }
+            }
+            if (children.empty()) {
+                leaf(idx, shapes);
+                return;
+            }
+            if (children.size() > 2 || !shapes.empty()) {
+                notKd = true;
+                return;
+            }
+
+            // below/above: the children either side of the split, NULL if that side was empty (and so left out).
+            Container *below = NULL, *above = NULL;
+            int axis = -1;
+            float split = 0.f;
+            for (int i = 0; i < 3 && axis == -1; i++) {
+                for (Container *a: children) {
+                    if (a->max(i) < c->max(i)) {
+                        below = a;
+                        split = a->max(i);
+                    } else if (a->min(i) > c->min(i)) {
+                        above = a;
+                        split = a->min(i);
+                    } else {
+                        continue;
+                    }
+                    axis = i;
+                }
+                if (axis != -1 && children.size() == 2 && (below == NULL || above == NULL)) {
+                    notKd = true;
+                    return;
+                }
+            }
+            if (axis == -1) {
+                // A lone child covering the whole cell adds nothing.
+                if (children.size() == 1) node(children[0], idx, d);
+                else notKd = true;
+                return;
+            }
+
+            uint32_t first = tree->nodes.size();
+            tree->nodes.resize(first + 2);
+            KdNode *n = &(tree->nodes[idx]);
+            n->split = split;
+            n->axis = axis;
+            n->offset = first;
+            n->primCount = 0;
+            if (below != NULL) node(below, first, d+1);
+            else leaf(first, {});
+            if (above != NULL) node(above, first+1, d+1);
+            else leaf(first+1, {});
+        }
+    };
+}
+
+KdTree *flattenKdTree(Container *root) {
+    if (root == NULL) return NULL;
+    KdTree *tree = new KdTree();
+    tree->min = root->min;
+    tree->max = root->max;
+    tree->nodes.resize(1);
+    KdFlattener f = {tree, {}, 0, false};
+    f.node(root, 0, 1);
+    if (f.notKd || f.depth > KD_STACK_SIZE) {
+        std::printf("Hierarchy can't be flattened to a kd-tree (not split like a Bi-tree, or %d deep)\n", f.depth);
+        delete tree;
+        return NULL;
+    }
+    tree->nodes.shrink_to_fit();
+    tree->primIndices.shrink_to_fit();
+    tree->prims.shrink_to_fit();
+    return tree;
+}
@@ -0,0 +1,542 @@
+#include "lbvh.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstdio>
+#include <functional>
+#include "accel.hpp"
+#include "pool.hpp"
+
+namespace {
+    // Shapes each job of the parallel passes handles, and subtrees with fewer shapes than this are built on the current thread.
+    const uint32_t lbvhChunkSize = 4096;
+    // The radix sort takes 11 bits of the (30-bit) codes at a time.
+    const int radixBits = 11;
+    const uint32_t radixSize = 1 << radixBits;
+
+    // Spreads the lower 10 bits of v out to every third bit.
+    uint32_t expandBits(uint32_t v) {
+        v = (v * 0x00010001u) & 0xFF0000FFu;
+        v = (v * 0x00000101u) & 0x0F00F00Fu;
+        v = (v * 0x00000011u) & 0xC30C30C3u;
+        v = (v * 0x00000005u) & 0x49249249u;
+        return v;
+    }
+
+    // x takes the highest of each three bits, then y, then z.
+    uint32_t mortonCode(Vec3 p) {
+        uint32_t c[3];
+        for (int i = 0; i < 3; i++) {
+            c[i] = expandBits(uint32_t(std::clamp(p(i) * 1024.f, 0.f, 1023.f)));
+        }
+        return (c[0] << 2) | (c[1] << 1) | c[2];
+    }
+
+    // Sorts "keys" (and "values" alongside them) with a least-significant-digit radix sort, radixBits at a time.
+    // Each pass counts the digits in every chunk in parallel, finds where each chunk's share of each digit starts, then scatters the chunks in parallel.
+    // As it's stable, each pass keeps the order of the last within equal digits.
+    void radixSort(std::vector<uint32_t> *keys, std::vector<uint32_t> *values, ThreadPool *pool) {
+        uint32_t n = keys->size();
+        std::vector<uint32_t> keysOut(n), valuesOut(n);
+        uint32_t chunks = std::max(uint32_t(1), (n + lbvhChunkSize - 1) / lbvhChunkSize);
+        std::vector<uint32_t> counts(chunks * radixSize);
+        for (int shift = 0; shift < 30; shift += radixBits) {
+            std::fill(counts.begin(), counts.end(), 0);
+            parallelChunks(pool, n, lbvhChunkSize, [&](uint32_t c, uint32_t begin, uint32_t end) {
+                uint32_t *count = counts.data() + c * radixSize;
+                for (uint32_t i = begin; i < end; i++) {
+                    count[((*keys)[i] >> shift) & (radixSize-1)]++;
+                }
+            });
+            // Turn the counts into offsets: digit by digit, then chunk by chunk within each digit.
+            uint32_t offset = 0;
+            for (uint32_t d = 0; d < radixSize; d++) {
+                for (uint32_t c = 0; c < chunks; c++) {
+                    uint32_t count = counts[c * radixSize + d];
+                    counts[c * radixSize + d] = offset;
+                    offset += count;
+                }
+            }
+            parallelChunks(pool, n, lbvhChunkSize, [&](uint32_t c, uint32_t begin, uint32_t end) {
+                uint32_t *next = counts.data() + c * radixSize;
+                for (uint32_t i = begin; i < end; i++) {
+                    uint32_t dst = next[((*keys)[i] >> shift) & (radixSize-1)]++;
+                    keysOut[dst] = (*keys)[i];
+                    valuesOut[dst] = (*values)[i];
+                }
+            });
+            keys->swap(keysOut);
+            values->swap(valuesOut);
+        }
+    }
+
+    // LNode: A node of the tree before it's laid out into a LinearBVH. Leaves (left == -1) hold the sorted shapes [begin, begin+count).
+    struct LNode {
+        Bound box;
+        int64_t left, right;
+        uint32_t begin, count;
+        // SAH cost of the subtree, relative to the surface area of the node it's in, so it's just summed.
+        float cost;
+        bool leaf() const { return left == -1; };
+    };
+
+    struct LBVHBuilder {
+        LinearBVH *bvh;
+        const std::vector<uint32_t> *codes;
+        const std::vector<Bound> *bounds;
+        const std::vector<float> *costs;
+        ThreadPool *pool;
+        int maxDepth, maxLeafSize;
+        std::vector<LNode> nodes;
+        std::atomic<uint32_t> nodeCount;
+
+        // Index of the first shape in [begin, end) whose code differs from "begin"'s in the highest bit they differ in at all, or the middle if none do.
+        uint32_t split(uint32_t begin, uint32_t end) {
+            uint32_t first = (*codes)[begin], last = (*codes)[end-1];
+            if (first == last) return begin + (end - begin) / 2;
+            uint32_t bit = 1u << (31 - std::countl_zero(first ^ last));
+            // Codes are sorted, so those in the range with the bit set all come after those without.
+            return std::partition_point(codes->begin() + begin, codes->begin() + end, [bit](uint32_t c) { return !(c & bit); }) - codes->begin();
+        }
+
+        void node(uint32_t idx, uint32_t begin, uint32_t end, int depth) {
+            LNode *n = &(nodes[idx]);
+            n->begin = begin;
+            n->count = end - begin;
+            // A leaf can't hold more than UINT16_MAX shapes, so past that we have to keep splitting.
+            if (n->count <= uint32_t(maxLeafSize) || (depth >= maxDepth && n->count <= UINT16_MAX)) {
+                n->left = -1;
+                n->right = -1;
+                n->box = Bound::forGrowing();
+                float shapes = 0.f;
+                for (uint32_t i = begin; i < end; i++) {
+                    n->box.grow(const_cast<Bound*>(&((*bounds)[i])));
+                    shapes += (*costs)[i];
+                }
+                n->cost = shapes * aabbSA(n->box.min, n->box.max);
+                return;
+            }
+            uint32_t mid = split(begin, end);
+            uint32_t children = nodeCount.fetch_add(2);
+            n->left = children;
+            n->right = children + 1;
+            JobGroup left;
+            if (pool != NULL && mid - begin >= lbvhChunkSize) {
+                pool->submit(&left, [=, this]() { node(children, begin, mid, depth+1); });
+            } else {
+                node(children, begin, mid, depth+1);
+            }
+            node(children+1, mid, end, depth+1);
+            if (pool != NULL) pool->wait(&left);
+            // Children are done, so bounds and costs can be filled in on the way back up.
+            n = &(nodes[idx]);
+            n->box = nodes[children].box;
+            n->box.grow(&(nodes[children+1].box));
+            n->cost = aabbSA(n->box.min, n->box.max) + nodes[children].cost + nodes[children+1].cost;
+        }
+
+        // Replaces the treelet of LBVH_TREELET_SIZE (or fewer) nodes below "root" with the tree over them with the lowest SAH cost.
+        void restructure(uint32_t root) {
+            if (nodes[root].leaf()) return;
+            // Grow the treelet by opening up whichever of its leaves has the largest surface area, as they have the most to gain.
+            uint32_t leaves[LBVH_TREELET_SIZE];
+            uint32_t interior[LBVH_TREELET_SIZE];
+            int nLeaves = 2, nInterior = 0;
+            leaves[0] = nodes[root].left;
+            leaves[1] = nodes[root].right;
+            while (nLeaves < LBVH_TREELET_SIZE) {
+                int best = -1;
+                float bestSA = -1.f;
+                for (int i = 0; i < nLeaves; i++) {
+                    const LNode *l = &(nodes[leaves[i]]);
+                    if (l->leaf()) continue;
+                    float sa = aabbSA(l->box.min, l->box.max);
+                    if (sa > bestSA) {
+                        bestSA = sa;
+                        best = i;
+                    }
+                }
+                if (best == -1) break;
+                uint32_t open = leaves[best];
+                interior[nInterior++] = open;
+                leaves[best] = nodes[open].left;
+                leaves[nLeaves++] = nodes[open].right;
+            }
+            if (nLeaves < 3) return;
+
+            // cost[s]/area[s]/splitOf[s]: for each subset s of the leaves, the cheapest tree over them, the surface area of their box, and how it splits them.
+            const int subsets = 1 << LBVH_TREELET_SIZE;
+            float cost[subsets], area[subsets];
+            int splitOf[subsets];
+            int full = (1 << nLeaves) - 1;
+            for (int s = 1; s <= full; s++) {
+                Bound box = Bound::forGrowing();
+                for (int i = 0; i < nLeaves; i++) {
+                    if (s & (1 << i)) box.grow(&(nodes[leaves[i]].box));
+                }
+                area[s] = aabbSA(box.min, box.max);
+                if (std::popcount(uint32_t(s)) == 1) {
+                    cost[s] = nodes[leaves[std::countr_zero(uint32_t(s))]].cost;
+                    continue;
+                }
+                // Every way of splitting s in two, each only once (by keeping its lowest leaf on the left).
+                float best = 1e30f;
+                int lowest = s & -s;
+                for (int p = (s - 1) & s; p > 0; p = (p - 1) & s) {
+                    if (!(p & lowest)) continue;
+                    float c = cost[p] + cost[s ^ p];
+                    if (c < best) {
+                        best = c;
+                        splitOf[s] = p;
+                    }
+                }
+                cost[s] = area[s] + best;
+            }
+            if (cost[full] >= nodes[root].cost) return;
+
+            // Rebuild it from the root down, reusing the treelet's interior nodes.
+            int nextInterior = 0;
+            std::function<uint32_t(int)> rebuild = [&](int s) -> uint32_t {
+                if (std::popcount(uint32_t(s)) == 1) return leaves[std::countr_zero(uint32_t(s))];
+                uint32_t idx = s == full ? root : interior[nextInterior++];
+                uint32_t l = rebuild(splitOf[s]);
+                uint32_t r = rebuild(s ^ splitOf[s]);
+                LNode *n = &(nodes[idx]);
+                n->left = l;
+                n->right = r;
+                n->box = nodes[l].box;
+                n->box.grow(&(nodes[r].box));
+                n->cost = cost[s];
+                return idx;
+            };
+            rebuild(full);
+        }
+
+        // Restructures the treelets rooted in the top "levels" levels of the tree, deepest first,
+        // so those further up are made from subtrees that have already been improved.
+        void optimizeTreelets(int levels) {
+            std::vector<uint32_t> order = {0};
+            size_t levelStart = 0;
+            for (int l = 1; l < levels; l++) {
+                size_t levelEnd = order.size();
+                for (size_t i = levelStart; i < levelEnd; i++) {
+                    const LNode *n = &(nodes[order[i]]);
+                    if (n->leaf()) continue;
+                    order.emplace_back(n->left);
+                    order.emplace_back(n->right);
+                }
+                levelStart = levelEnd;
+            }
+            for (size_t i = order.size(); i-- > 0;) {
+                restructure(order[i]);
+            }
+        }
+
+        // Lays out the tree at nodes[root] from bvh->nodes[0] depth-first, with children always in the pair after everything before them.
+        // PLOC trees can be arbitrarily deep, so this keeps its own stack rather than recursing.
+        void emit(uint32_t root) {
+            // "entries" is the number of entries already on the traversal stack when the node's visited.
+            struct Pending { uint32_t t, idx; int entries; };
+            std::vector<Pending> stack = {{root, 0, 0}};
+            uint32_t next = 1;
+            while (!stack.empty()) {
+                Pending p = stack.back();
+                stack.pop_back();
+                const LNode *l = &(nodes[p.t]);
+                BVHNode *n = &(bvh->nodes[p.idx]);
+                n->min = l->box.min;
+                n->max = l->box.max;
+                if (l->leaf()) {
+                    n->offset = l->begin;
+                    n->primCount = l->count;
+                    n->childCount = 0;
+                    n->axis = UINT8_MAX;
+                    continue;
+                }
+                // Children are stored low to high on the axis their centres are furthest apart on, as traversal expects.
+                uint32_t a = l->left, b = l->right;
+                const Bound *ba = &(nodes[a].box), *bb = &(nodes[b].box);
+                int axis = 0;
+                float gap = -1.f;
+                for (int i = 0; i < 3; i++) {
+                    float g = std::fabs((bb->min(i) + bb->max(i)) - (ba->min(i) + ba->max(i)));
+                    if (g > gap) {
+                        gap = g;
+                        axis = i;
+                    }
+                }
+                if (ba->min(axis) + ba->max(axis) > bb->min(axis) + bb->max(axis)) std::swap(a, b);
+                uint32_t children = next;
+                next += 2;
+                n->offset = children;
+                n->primCount = 0;
+                n->childCount = 2;
+                n->axis = axis;
+                bvh->stackDepth = std::max(bvh->stackDepth, p.entries + 2);
+                // "a" is popped (and its whole subtree laid out) first.
+                stack.push_back({b, children+1, p.entries+1});
+                stack.push_back({a, children, p.entries+1});
+            }
+        }
+
+        // Surface area of the box around clusters (nodes) a and b, which is how close PLOC considers them.
+        float distance(uint32_t a, uint32_t b) {
+            Bound box = nodes[a].box;
+            box.grow(&(nodes[b].box));
+            return aabbSA(box.min, box.max);
+        }
+
+        // Builds the tree bottom-up from the first n nodes (leaves of one shape each, in Morton order), returning the root.
+        // Every cluster finds its nearest neighbour among the "radius" clusters either side of it, then each pair that are each other's nearest are merged,
+        // keeping the place of the first, and the gaps are closed up. This repeats until there's one left.
+        uint32_t cluster(uint32_t n, int radius) {
+            std::vector<uint32_t> clusters(n), merged(n), nearest(n);
+            std::vector<uint32_t> kept((n + lbvhChunkSize - 1) / lbvhChunkSize);
+            for (uint32_t i = 0; i < n; i++) clusters[i] = i;
+            while (n > 1) {
+                parallelChunks(pool, n, lbvhChunkSize, [&](uint32_t, uint32_t begin, uint32_t end) {
+                    for (uint32_t i = begin; i < end; i++) {
+                        uint32_t lo = i > uint32_t(radius) ? i - radius : 0;
+                        uint32_t hi = std::min(n, i + radius + 1);
+                        float best = 1e30f;
+                        // Searching in order and only taking strictly closer neighbours breaks ties by the lower (then higher) index of each pair,
+                        // so the closest pair overall is always each other's nearest, and at least one merge happens each round.
+                        for (uint32_t j = lo; j < hi; j++) {
+                            if (j == i) continue;
+                            float d = distance(clusters[i], clusters[j]);
+                            if (d < best) {
+                                best = d;
+                                nearest[i] = j;
+                            }
+                        }
+                    }
+                });
+                uint32_t chunks = parallelChunks(pool, n, lbvhChunkSize, [&](uint32_t c, uint32_t begin, uint32_t end) {
+                    uint32_t count = 0;
+                    for (uint32_t i = begin; i < end; i++) {
+                        uint32_t j = nearest[i];
+                        if (nearest[j] != i) {
+                            merged[i] = clusters[i];
+                        } else if (i < j) {
+                            uint32_t idx = nodeCount.fetch_add(1);
+                            LNode *m = &(nodes[idx]);
+                            m->left = clusters[i];
+                            m->right = clusters[j];
+                            m->box = nodes[clusters[i]].box;
+                            m->box.grow(&(nodes[clusters[j]].box));
+                            m->begin = 0;
+                            m->count = nodes[clusters[i]].count + nodes[clusters[j]].count;
+                            m->cost = aabbSA(m->box.min, m->box.max) + nodes[clusters[i]].cost + nodes[clusters[j]].cost;
+                            merged[i] = idx;
+                        } else {
+                            merged[i] = UINT32_MAX;
+                            continue;
+                        }
+                        count++;
+                    }
+                    kept[c] = count;
+                });
+                uint32_t offset = 0;
+                for (uint32_t c = 0; c < chunks; c++) {
+                    uint32_t count = kept[c];
+                    kept[c] = offset;
+                    offset += count;
+                }
+                parallelChunks(pool, n, lbvhChunkSize, [&](uint32_t c, uint32_t begin, uint32_t end) {
+                    uint32_t dst = kept[c];
+                    for (uint32_t i = begin; i < end; i++) {
+                        if (merged[i] != UINT32_MAX) clusters[dst++] = merged[i];
+                    }
+                });
+                n = offset;
+            }
+            return clusters[0];
+        }
+
+        // Lays out the shapes under each node of the tree at nodes[root] contiguously in "order" (as indices into the sorted shapes), making a node a leaf
+        // if that has a lower SAH cost than its subtree and it has maxLeafSize shapes or less (or it's maxDepth deep). Returns the number of leaves left.
+        // Nodes are finished children first, with an explicit stack as PLOC trees can be arbitrarily deep.
+        uint32_t collapse(uint32_t root, std::vector<uint32_t> *order) {
+            // "start" is where the node's shapes begin in "order", set once its children have been pushed.
+            struct Pending { uint32_t t; int depth; uint32_t start; bool expanded; };
+            // Cost of intersecting all the shapes of a finished subtree, and the leaves left in it.
+            struct Finished { float shapes; uint32_t leaves; };
+            std::vector<Pending> stack = {{root, 0, 0, false}};
+            std::vector<Finished> finished;
+            while (!stack.empty()) {
+                Pending p = stack.back();
+                LNode *n = &(nodes[p.t]);
+                if (n->leaf()) {
+                    stack.pop_back();
+                    finished.push_back({(*costs)[n->begin], 1});
+                    order->emplace_back(n->begin);
+                    n->begin = order->size() - 1;
+                    continue;
+                }
+                if (!p.expanded) {
+                    stack.back().expanded = true;
+                    stack.back().start = order->size();
+                    // The left is popped (and finished) first, so its shapes come first.
+                    stack.push_back({uint32_t(n->right), p.depth+1, 0, false});
+                    stack.push_back({uint32_t(n->left), p.depth+1, 0, false});
+                    continue;
+                }
+                stack.pop_back();
+                Finished right = finished.back();
+                finished.pop_back();
+                Finished left = finished.back();
+                finished.pop_back();
+                float shapes = left.shapes + right.shapes;
+                float sa = aabbSA(n->box.min, n->box.max);
+                n->cost = sa + nodes[n->left].cost + nodes[n->right].cost;
+                if ((n->count <= uint32_t(maxLeafSize) && shapes * sa <= n->cost) || (p.depth >= maxDepth && n->count <= UINT16_MAX)) {
+                    n->left = -1;
+                    n->right = -1;
+                    n->begin = p.start;
+                    n->cost = shapes * sa;
+                    finished.push_back({shapes, 1});
+                } else {
+                    finished.push_back({shapes, left.leaves + right.leaves});
+                }
+            }
+            return finished.back().leaves;
+        }
+    };
+
+    // Shapes to build over, sorted by the Morton code of their centroid, with their bounds and cost of intersection in the same order.
+    struct SortedShapes {
+        std::vector<uint32_t> codes;
+        // Index of each in LinearBVH::prims.
+        std::vector<uint32_t> order;
+        std::vector<Bound> bounds;
+        std::vector<float> costs;
+    };
+
+    // Fills bvh->prims with the shapes in "flat" (leaving out debug objects), and "s" with them sorted. Returns the number of shapes.
+    uint32_t sortShapes(Container *flat, LinearBVH *bvh, float costTriSphereRatio, ThreadPool *pool, SortedShapes *s) {
+        std::vector<Bound> bounds;
+        bounds.reserve(flat->size);
+        bvh->prims.reserve(flat->size);
+        Bound centroids = Bound::forGrowing();
+        if (flat->size > 0) {
+            Bound *bo = flat->start;
+            while (bo != flat->end->next) {
+                if (bo->s != NULL && !(bo->s->debug)) {
+                    bounds.emplace_back(*bo);
+                    bvh->prims.emplace_back(bo->s);
+                    Bound c(bo->centroid, bo->centroid);
+                    centroids.grow(&c);
+                }
+                bo = bo->next;
+            }
+        }
+        uint32_t n = bounds.size();
+        if (n == 0) return 0;
+
+        // Codes are relative to the box around the centroids, so they use all 10 bits on each axis.
+        s->codes.resize(n);
+        s->order.resize(n);
+        Vec3 extent = centroids.max - centroids.min;
+        Vec3 scale = {extent.x > 0.f ? 1.f / extent.x : 0.f, extent.y > 0.f ? 1.f / extent.y : 0.f, extent.z > 0.f ? 1.f / extent.z : 0.f};
+        parallelChunks(pool, n, lbvhChunkSize, [&](uint32_t, uint32_t begin, uint32_t end) {
+            for (uint32_t i = begin; i < end; i++) {
+                Vec3 p = bounds[i].centroid - centroids.min;
+                s->codes[i] = mortonCode({p.x * scale.x, p.y * scale.y, p.z * scale.z});
+                s->order[i] = i;
+            }
+        });
+        radixSort(&(s->codes), &(s->order), pool);
+
+        s->bounds.resize(n);
+        s->costs.resize(n);
+        parallelChunks(pool, n, lbvhChunkSize, [&](uint32_t, uint32_t begin, uint32_t end) {
+            for (uint32_t i = begin; i < end; i++) {
+                s->bounds[i] = bounds[s->order[i]];
+                s->costs[i] = shapeCost(bvh->prims[s->order[i]]->type(), costTriSphereRatio);
+            }
+        });
+        return n;
+    }
+
+    void initBuilder(LBVHBuilder *b, LinearBVH *bvh, const SortedShapes *s, int maxDepth, int maxLeafSize, ThreadPool *pool) {
+        b->bvh = bvh;
+        b->codes = &(s->codes);
+        b->bounds = &(s->bounds);
+        b->costs = &(s->costs);
+        b->pool = pool;
+        b->maxDepth = maxDepth;
+        b->maxLeafSize = std::max(1, maxLeafSize);
+        // A binary tree over n leaves has at most 2n-1 nodes.
+        b->nodes.resize(2*s->codes.size());
+    }
+
+    // Lays the tree rooted at b->nodes[root] out into b->bvh, which will have "nodeCount" nodes. Leaves index "primOrder".
+    // Returns NULL (deleting the BVH) if it's too deep to be traversed.
+    LinearBVH *emitBVH(LBVHBuilder *b, uint32_t root, uint32_t nodeCount, const std::vector<uint32_t> &primOrder) {
+        LinearBVH *bvh = b->bvh;
+        bvh->nodes.resize(nodeCount);
+        bvh->primIndices = primOrder;
+        countBuildMemory(sizeof(LinearBVH) + bvh->nodes.capacity()*sizeof(BVHNode) + bvh->primIndices.capacity()*sizeof(uint32_t) + bvh->prims.capacity()*sizeof(Shape*), 4);
+        b->emit(root);
+
+        if (bvh->stackDepth > BVH_STACK_SIZE) {
+            std::printf("Hierarchy can't be traversed (needs a stack of %d)\n", bvh->stackDepth);
+            delete bvh;
+            return NULL;
+        }
+        return bvh;
+    }
+
+    LinearBVH *emptyBVH(Container *flat, LinearBVH *bvh) {
+        bvh->nodes.resize(1);
+        bvh->nodes[0] = {flat->min, 0, flat->max, 0, 0, UINT8_MAX};
+        return bvh;
+    }
+}
+
+LinearBVH *buildLBVH(Container *flat, int maxDepth, int maxLeafSize, float costTriSphereRatio, int treeletLevels, ThreadPool *pool) {
+    if (flat == NULL) return NULL;
+    LinearBVH *bvh = new LinearBVH();
+    bvh->stackDepth = 1;
+    SortedShapes s;
+    uint32_t n = sortShapes(flat, bvh, costTriSphereRatio, pool, &s);
+    if (n == 0) return emptyBVH(flat, bvh);
+
+    LBVHBuilder b;
+    initBuilder(&b, bvh, &s, maxDepth, maxLeafSize, pool);
+    b.nodeCount = 1;
+    b.node(0, 0, n, 0);
+    if (treeletLevels > 0) b.optimizeTreelets(treeletLevels);
+    return emitBVH(&b, 0, b.nodeCount, s.order);
+}
+
+LinearBVH *buildPLOC(Container *flat, int maxDepth, int maxLeafSize, float costTriSphereRatio, int radius, ThreadPool *pool) {
+    if (flat == NULL) return NULL;
+    LinearBVH *bvh = new LinearBVH();
+    bvh->stackDepth = 1;
+    SortedShapes s;
+    uint32_t n = sortShapes(flat, bvh, costTriSphereRatio, pool, &s);
+    if (n == 0) return emptyBVH(flat, bvh);
+
+    LBVHBuilder b;
+    initBuilder(&b, bvh, &s, maxDepth, maxLeafSize, pool);
+    for (uint32_t i = 0; i < n; i++) {
+        LNode *l = &(b.nodes[i]);
+        l->box = s.bounds[i];
+        l->left = -1;
+        l->right = -1;
+        l->begin = i;
+        l->count = 1;
+        l->cost = s.costs[i] * aabbSA(l->box.min, l->box.max);
+    }
+    b.nodeCount = n;
+    uint32_t root = b.cluster(n, std::max(1, radius));
+
+    std::vector<uint32_t> sorted;
+    sorted.reserve(n);
+    uint32_t leaves = b.collapse(root, &sorted);
+    std::vector<uint32_t> primOrder(n);
+    for (uint32_t i = 0; i < n; i++) primOrder[i] = s.order[sorted[i]];
+    return emitBVH(&b, root, 2*leaves - 1, primOrder);
+}
@@ -6,6 +6,20 @@
 #include "ray.hpp"
 #include "mat.hpp"
 #include "accel.hpp"
+#include "tile.hpp"
+#include "pool.hpp"
+#include "bvh.hpp"
+#include "widebvh.hpp"
+#include "sbvh.hpp"
+#include "lbvh.hpp"
+#include "bvhcache.hpp"
+#include "costs.hpp"
+#include "kdtree.hpp"
+#include "octree.hpp"
+#include "grid.hpp"
+#include "instance.hpp"
+#include <algorithm>
+#include <bit>
 #include <cmath>
 #include <fstream>
 #include <string>
@@ -14,6 +28,7 @@
 #include <sstream>
 #include <filesystem>
 #include <thread>
+#include <unordered_set>
 
 const char *modes[3] = {"Raycasting", "Raycasting w/ Reflections", "Lighting w/ Phong Specular"};
 
@@ -45,36 +60,31 @@ double WorldMap::castRays(Image *img, RenderConfig *rc, double (*getTime)(void),
     }
     // TGA::write(aaOffsetImage, "/tmp/test.tga", "test");
 
+    if (rc->showDebugObjects && obj == optimizedObj && debugOverlayStale) buildDebugOverlay();
 
-    // Image is split into horizontal strips for each thread (Previously vertical, because i forgot about contiguous memory access)
-    // int sectionWidth = cam->w / nthreads;
-    int sectionHeight = cam->h / nthreads;
-    std::thread *threadPtrs = new std::thread[nthreads];
+
+    // Image is split into small tiles, which threads take from their own queue, and steal from others' when theirs runs dry.
+    // (Previously one horizontal strip per thread, which left threads idle while the one with the expensive part of the image finished.)
+    TileScheduler tiles(cam->w, cam->h, nthreads, RENDER_TILE_SIZE);
+    // Workers live as long as the map, so only pay for starting threads when the count is changed.
+    if (pool->size() != nthreads) pool->resize(nthreads);
     rc->threadStates = new int[nthreads];
     rc->nthreads = nthreads;
-    lastRenderTime = getTime();
-    // std::printf("Thread line height: [1..n-1]:%d, [n]:%d\n", int(sectionHeight), int(sectionHeight) + (cam->h % nthreads));
     for (int i = 0; i < nthreads; i++) {
-        // int w = sectionWidth;
-        int h = sectionHeight;
-        // int w0 = i*w;
-        int h0 = i*h;
-        if (i == nthreads-1) {
-            // w += (cam->w % nthreads);
-            h += (cam->h % nthreads);
-        }
-        // int w1 = w0 + w;
-        int h1 = h0 + h;
-        // threadptrs[i] = std::thread(&WorldMap::castSubRays, this, img, rc, w0, w1, 0, cam->h);
-        threadPtrs[i] = std::thread(&WorldMap::castSubRays, this, img, rc, 0, cam->w, h0, h1, &(rc->threadStates[i]), offsets, nOffsets);
+        rc->threadStates[i] = 1;
     }
+    lastRenderTime = getTime();
+    JobGroup render;
     for (int i = 0; i < nthreads; i++) {
-        threadPtrs[i].join();
+        pool->submit(&render, [=, this, &tiles]() {
+            castTiles(img, rc, &tiles, i, &(rc->threadStates[i]), offsets, nOffsets);
+        });
     }
+    pool->wait(&render);
     lastRenderTime = getTime() - lastRenderTime;
     currentlyRendering = false;
-    delete[] threadPtrs;
     delete[] rc->threadStates;
+    delete[] offsets;
     rc->threadStates = NULL;
     // free(res);
     return lastRenderTime;
@@ -112,7 +122,7 @@ double WorldMap::castRays(Image *img, RenderConfig *rc, double (*getTime)(void),
 
 void WorldMap::castReflectionRay(Vec3 p0, Vec3 delta, RenderConfig *rc, RayResult *res, int callCount) {
     RayResult bounce = RayResult();
-    castRay(&bounce, obj, p0, delta, rc, callCount);
+    castRay(&bounce, obj, Ray(p0, delta), rc, callCount);
     Vec3 color = {0.f, 0.f, 0.f};
     if (bounce.collisions > 0) {
         color = bounce.color;
@@ -123,24 +133,11 @@ void WorldMap::castReflectionRay(Vec3 p0, Vec3 delta, RenderConfig *rc, RayResul
 void WorldMap::castShadowRays(Vec3 viewDelta, Vec3 p0, RenderConfig *rc, RayResult *res) {
     Vec3 lightColor = Vec3{1.f, 1.f, 1.f} * rc->baseBrightness;
     Vec3 specularColor = Vec3{0.f, 0.f, 0.f};
-    RenderConfig simpleConfig;
-    simpleConfig.collisionsOnly = true;
-    simpleConfig.triangles = rc->triangles;
-    simpleConfig.mtTriangleCollision = rc->mtTriangleCollision;
-    simpleConfig.normalMapping = rc->normalMapping;
-    simpleConfig.reflectanceMapping = rc->reflectanceMapping;
-    simpleConfig.spheres = rc->spheres;
-    simpleConfig.maxBounce = rc->maxBounce;
-    simpleConfig.showDebugObjects = rc->showDebugObjects;
-    RayResult r = RayResult();
     for (PointLight light: pointLights) {
         Vec3 distance = light.center - p0;
         float tLight = mag(distance);
         Vec3 normDistance = distance / tLight;
-        r.resetObj();
-        ray(&r, obj, p0, normDistance, &simpleConfig);
-        bool hit = r.hit() && !(r.obj->debug) && r.t <= tLight;
-        if (hit) {
+        if (occluded(Ray(p0, normDistance, 0.f, tLight))) {
             continue;
         }
         float scaledDistance = tLight / rc->distanceDivisor;
@@ -234,119 +231,61 @@ void WorldMap::castShadowRays(Vec3 viewDelta, Vec3 p0, RenderConfig *rc, RayResu
     res->refractColor = r.color;
 } */
 
-// FIXME?:
-// An object can span multiple voxels, so to avoid intersecting twice,
-// tag an object with the ID of the ray on intersection.
-// Then before intersecting an object, check if the object has been intersected by this rayID.
-// HOWEVER, unless we used a map per-ray to store intersections or something, this wouldn't work with multiple threads.
-// FIXME: Support transforms
-void WorldMap::voxelRay(RayResult *res, Container *c, Vec3 p0, Vec3 delta, RenderConfig *rc) {
-    delta = norm(delta);
-    int x = 0, y = 0, z = 0;
-    int subdivision = optimizeLevel;
-    Vec3 dims = c->max - c->min;
-    Vec3 vox = dims / subdivision;
-    float t = 0;
-    // Find the first voxel our ray hits, store it in (x, y, z), and how far long the ray we've traveled to get there in "t".
-    getVoxelIndex(c, subdivision, p0, delta, &x, &y, &z, &t);
-   
-    if (x < 0) return;
-
-    // Set our start point to where we hit the first voxel,
-    // and reset our "t" (ray distance) back to zero.
-    p0 = p0 + (t * delta);
-    t = 0.f;
-    
-    // Get the min/max corners of our home voxel.
-    Vec3 cVoxMin = c->min + Vec3{float(x)*vox.x, float(y)*vox.y, float(z)*vox.z};
-    Vec3 cVoxMax = cVoxMin + vox;
-
-    // stepX/Y/Z, indicating the direction on each axis.
-    int step[3] = {
-        delta.x > 0.f ? 1 : (delta.x == 0.f ? 0 : -1),
-        delta.y > 0.f ? 1 : (delta.y == 0.f ? 0 : -1),
-        delta.z > 0.f ? 1 : (delta.z == 0.f ? 0 : -1)
-    };
-
-    // tMaxX/Y/Z: How far we need to travel to hit our home voxel's x/y/z boundaries.
-    Vec3 tMax = {0,0,0};
-    for (int i = 0; i < 3; i++) {
-        if (step[i] == 0) {
-            // Makes sure it's never the smallest, and so never gets incremented.
-            tMax(i) = 1e10f;
-        } else {
-            float boundary = step[i] == 1 ? cVoxMax(i) : cVoxMin(i);
-            tMax(i) = (boundary - p0(i)) / delta(i);
+namespace {
+    // Mailbox: For each shape (by Shape::id), the last ray on this thread to test it.
+    // An object can span multiple voxels (or both sides of a Bi-tree/octree split), so without this it'd be intersected once per cell the ray passes through.
+    // Each thread has its own, so there's no need for locking.
+    struct Mailbox {
+        std::vector<uint32_t> stamps;
+        uint32_t ray = 0;
+        // Set while the current ray is being mailboxed.
+        bool active = false;
+        // Starts a new ray over a map of n shapes.
+        void next(size_t n) {
+            active = true;
+            if (stamps.size() != n) {
+                stamps.assign(n, 0);
+                ray = 0;
+            }
+            // Once the ID wraps around, old stamps could match again.
+            if (++ray == 0) {
+                std::fill(stamps.begin(), stamps.end(), 0);
+                ray = 1;
+            }
         }
-    }
-
-    // tDeltaX/Y/Z: How far to travel until we've gone a distance equal to the depth/height/width of a voxel.
-    Vec3 tDelta = {0,0,0};
-    for (int i = 0; i < 3; i++) {
-        tDelta(i) = vox(i) / std::abs(delta(i));
-    }
+        // Returns true if "s" has already been tested by the current ray, otherwise marks it as tested.
+        bool visited(Shape *s) {
+            if (!active || s->id < 0) return false;
+            if (stamps[s->id] == ray) return true;
+            stamps[s->id] = ray;
+            return false;
+        }
+    };
+    thread_local Mailbox mailbox;
+}
 
+// FIXME: Support transforms
+void WorldMap::voxelRay(RayResult *res, UniformGrid *grid, const Ray &r) {
+    VoxelWalk walk;
+    if (!walk.begin(grid->g.min, grid->g.max, grid->g.res, r)) return;
 
-    // Get the bound containing the voxel at (x, y, z).
-    Bound *o = c->start + x + subdivision * (y + subdivision * z);
     // Loop until:
-    // we find an empty voxel,
-    // we've hit a solid object* (see transparency caveat below)
+    // we've hit a solid object* (see transparency caveat below) within the current voxel,
     // we go out of the grid bounds.
-    while (o != NULL) {
-        // Check if the bound contains a non-empty container.
-        Container *c = dynamic_cast<Container*>(o->s);
-        bool empty = !(c != nullptr && c->size > 0);
-        if (!empty) {
-            traversalRay(res, c, p0, delta, rc);
-            // the caller, castRay, only casts additional transparency rays if we hit anything behind (i.e. res->collisions > 1), therefore we can only quit if we've hit something solid, or more than 1 object.
-            if (res->hit() && (res->obj->mat()->opacity == 1.f || res->collisions > 1)) {
-                o = NULL;
-                break;
-            }
-        }
-
-        // traverse to the next voxel.
-        if (tMax.x < tMax.y) {
-            if (tMax.x < tMax.z) {
-                x += step[0];
-                if (x < 0 || x >= subdivision) {
-                    o = NULL;
-                    break;
-                }
-                tMax.x += tDelta.x;
-            } else {
-                z += step[2];
-                if (z < 0 || z >= subdivision) {
-                    o = NULL;
-                    break;
-                }
-                tMax.z += tDelta.z;
-            }
-        } else {
-            if (tMax.y < tMax.z) {
-                y += step[1];
-                if (y < 0 || y >= subdivision) {
-                    o = NULL;
-                    break;
-                }
-                tMax.y += tDelta.y;
-            } else {
-                z += step[2];
-                if (z < 0 || z >= subdivision) {
-                    o = NULL;
-                    break;
-                }
-                tMax.z += tDelta.z;
+    do {
+        uint32_t start = grid->cellStart[walk.index()], end = grid->cellStart[walk.index()+1];
+        if (start != end) {
+            for (uint32_t i = start; i < end; i++) {
+                hitShape(res, grid->prims[grid->primIndices[i]], r);
             }
+            // the caller, castRay, only casts additional transparency rays if we hit anything behind (i.e. res->collisions > 1), therefore we can only quit if we've hit something solid, or more than 1 object.
+            // An object can span multiple voxels, so a hit further than this voxel might still be beaten by something in the next.
+            if (res->hit() && res->t <= walk.exit() && (res->obj->mat()->opacity == 1.f || res->collisions > 1)) break;
         }
-
-        // Get the bound containing the voxel at (x, y, z).
-        o = c->start + x + subdivision * (y + subdivision * z);
-    }
+    } while (walk.next());
 }
 
-void WorldMap::traversalRay(RayResult *res, Container *c, Vec3 p0, Vec3 delta, RenderConfig *rc) {
+void WorldMap::traversalRay(RayResult *res, Container *c, const Ray &r, RenderConfig *rc) {
     if (c->size == 0) return;
     Bound *bo = c->start;
     // When using --bi-trees/kd-trees--, the two sub-nodes always span the area of the parent.
@@ -388,58 +327,623 @@ void WorldMap::traversalRay(RayResult *res, Container *c, Vec3 p0, Vec3 delta, R
             } else {
                 // FIXME: Maybe change this in the future?
                 // We don't need to apply a transform, as this is a container.
-                collision = c->intersects(p0, delta);
-                if (!collision) {
+                float t = meetAABB(r, c->min, c->max);
+                if (t < -9990.f) {
                     siblingContainerCollision = false;
                 }
+                // Skip containers we only enter after the closest hit so far.
+                collision = t >= -9990.f && t <= res->t;
                 // collision = true;
             }
             // If collision, cast ray to objects within the container
             if (collision) {
-                ray(res, c, p0, delta, rc);
+                traversalRay(res, c, r, rc);
             }
         } else {
-            // FIXME: Somehow store the if the transformation has been done already,
-            // so we don't repeat per ray?
-            current->applyTransform();
-            Vec3 normal = {0, 0, 0};
-            Vec2 uv;
-            Vec2 *uvPtr = (current->mat() != NULL && current->mat()->hasTexture()) ? &uv : NULL;
-            float t = current->intersect(p0, delta, &normal, uvPtr);
-            if (t >= 0) {
-                res->collisions++;
-                // res->potentialCollisions++;
-                if (t < res->t) {
-                    res->obj = current;
-                    res->t = t;
-                    res->p0 = p0 + (res->t * delta);
-                    res->norm = normal;
-                    if (uvPtr != NULL) res->uv = *uvPtr;
-                }
+            hitShape(res, current, r);
+        }
+        bo = bo->next;
+    }
+}
+
+void WorldMap::hitShape(RayResult *res, Shape *current, const Ray &r) {
+    if (mailbox.visited(current)) return;
+    // FIXME: Somehow store the if the transformation has been done already,
+    // so we don't repeat per ray?
+    current->applyTransform();
+    if (current->type() == ShapeType::Instance) {
+        instanceRay(res, static_cast<Instance*>(current), r);
+        return;
+    }
+    Vec3 normal = {0, 0, 0};
+    Vec2 uv;
+    Vec2 *uvPtr = (current->mat() != NULL && current->mat()->hasTexture()) ? &uv : NULL;
+    float t = current->intersect(r, &normal, uvPtr);
+    if (t >= 0) {
+        res->collisions++;
+        // res->potentialCollisions++;
+        if (t < res->t) {
+            res->obj = current;
+            res->t = t;
+            res->p0 = r.p0 + (res->t * r.delta);
+            res->norm = normal;
+            if (uvPtr != NULL) res->uv = *uvPtr;
+            res->instance = NULL;
+        }
+    }
+}
+
+// Traces r through the mesh of an instance in its own space, where the hit's found just as it would be in the map.
+// As the ray's direction isn't normalized when moved, t is the same in both spaces, so only the hit point and normal need moving back.
+void WorldMap::instanceRay(RayResult *res, Instance *inst, const Ray &r) {
+    float t = res->t;
+    bvhRay(res, inst->mesh->bvh, inst->toObjectSpace(r));
+    if (res->t < t) {
+        res->p0 = r.p0 + (res->t * r.delta);
+        res->norm = inst->normalToWorldSpace(res->norm);
+        res->instance = inst;
+    }
+}
+
+// Equivalent of traversalRay for the flattened hierarchy, using an explicit stack of node indices rather than recursion.
+// Children are visited nearest first, and any the ray enters beyond the closest hit so far are skipped.
+void WorldMap::bvhRay(RayResult *res, LinearBVH *bvh, const Ray &r) {
+    BVHStackEntry stack[BVH_STACK_SIZE];
+    int top = 0;
+    float t;
+    if (meetsNode(&(bvh->nodes[0]), r, &t)) stack[top++] = {0, t};
+    while (top > 0) {
+        BVHStackEntry e = stack[--top];
+        // Something closer has been hit since this was pushed.
+        if (e.t > res->t) continue;
+        const BVHNode *n = &(bvh->nodes[e.node]);
+        if (n->leaf()) {
+            const uint32_t *idx = bvh->primIndices.data() + n->offset;
+            for (int i = 0; i < n->primCount; i++) {
+                hitShape(res, bvh->prims[idx[i]], r);
+            }
+            continue;
+        }
+        // Children are inserted so the nearest ends up on top.
+        // Where entry distances tie (e.g. we start inside both), the child on the near side of the split axis goes first.
+        bool reverse = n->axis < 3 && r.sign[n->axis];
+        int base = top;
+        for (int i = 0; i < n->childCount; i++) {
+            uint32_t child = n->offset + (reverse ? n->childCount-1-i : i);
+            if (!meetsNode(&(bvh->nodes[child]), r, &t) || t > res->t) continue;
+            int j = top++;
+            while (j > base && stack[j-1].t <= t) {
+                stack[j] = stack[j-1];
+                j--;
             }
+            stack[j] = {child, t};
+        }
+    }
+}
+
+void WorldMap::ray(RayResult *res, Container *c, const Ray &r, RenderConfig *rc) {
+    startMailbox();
+    // Unbounded shapes (i.e. planes) are tested once, first, so that any hit bounds the search of the hierarchy.
+    traversalRay(res, &unoptimizable, r, rc);
+    if (c == optimizedObj && obj == optimizedObj && (linearBVH != NULL || wideBVH4 != NULL || wideBVH8 != NULL || kdTree != NULL || octree != NULL || uniformGrid != NULL || twoLevelGrid != NULL)) {
+        // Debug objects aren't included in the flattened hierarchies, so are tested separately when they're being shown.
+        if (rc->showDebugObjects) {
+            for (Shape *s: debugShapes) hitShape(res, s, r);
+        }
+        if (kdTree != NULL) kdRay(res, kdTree, r);
+        else if (octree != NULL) octreeRay(res, octree, r);
+        else if (uniformGrid != NULL) voxelRay(res, uniformGrid, r);
+        else if (twoLevelGrid != NULL) gridRay(res, twoLevelGrid, r);
+        else if (wideBVH8 != NULL) wideBvhRay(res, wideBVH8, r);
+        else if (wideBVH4 != NULL) wideBvhRay(res, wideBVH4, r);
+        else bvhRay(res, linearBVH, r);
+    } else {
+        traversalRay(res, c, r, rc);
+    }
+}
+
+// Only the accelerators that can reference a shape from more than one cell/leaf need the mailbox.
+void WorldMap::startMailbox() {
+    if (obj == optimizedObj && (accelIndex == Accel::Voxel || accelIndex == Accel::TwoLevelGrid || accelIndex == Accel::BiTree || accelIndex == Accel::FalseOctree || accelIndex == Accel::SpatialSplitBVH)) {
+        mailbox.next(flatObj->size);
+    } else {
+        mailbox.active = false;
+    }
+}
+
+// Any-hit equivalent of ray(), for shadow rays: returns true as soon as anything (but a debug object) is hit within r.tMax.
+// Unlike ray(), it doesn't need to find the closest hit, or its normal/UV.
+bool WorldMap::occluded(const Ray &r) {
+    startMailbox();
+    if (traversalOccluded(&unoptimizable, r)) return true;
+    if (obj == optimizedObj && kdTree != NULL) {
+        return kdOccluded(kdTree, r);
+    } else if (obj == optimizedObj && octree != NULL) {
+        return octreeOccluded(octree, r);
+    } else if (obj == optimizedObj && uniformGrid != NULL) {
+        return voxelOccluded(uniformGrid, r);
+    } else if (obj == optimizedObj && twoLevelGrid != NULL) {
+        return gridOccluded(twoLevelGrid, r);
+    } else if (obj == optimizedObj && wideBVH8 != NULL) {
+        return wideBvhOccluded(wideBVH8, r);
+    } else if (obj == optimizedObj && wideBVH4 != NULL) {
+        return wideBvhOccluded(wideBVH4, r);
+    } else if (obj == optimizedObj && linearBVH != NULL) {
+        return bvhOccluded(linearBVH, r);
+    }
+    return traversalOccluded(obj, r);
+}
+
+bool WorldMap::shapeOccludes(Shape *current, const Ray &r) {
+    if (current->debug || mailbox.visited(current)) return false;
+    current->applyTransform();
+    if (current->type() == ShapeType::Instance) {
+        Instance *inst = static_cast<Instance*>(current);
+        return bvhOccluded(inst->mesh->bvh, inst->toObjectSpace(r));
+    }
+    float t = current->intersect(r);
+    return t >= 0 && t <= r.tMax;
+}
+
+bool WorldMap::traversalOccluded(Container *c, const Ray &r) {
+    if (c->size == 0) return false;
+    Bound *bo = c->start;
+    while (bo != c->end->next) {
+        Container *sub = dynamic_cast<Container*>(bo->s);
+        if (sub != nullptr) {
+            // Containers we only enter after passing the light are missed, since the test only counts the ray up to r.tMax.
+            float t = meetAABB(r, sub->min, sub->max);
+            if (t > -9990.f && traversalOccluded(sub, r)) return true;
+        } else if (shapeOccludes(bo->s, r)) {
+            return true;
         }
         bo = bo->next;
     }
-    if (c != &unoptimizable) traversalRay(res, &unoptimizable, p0, delta, rc);
+    return false;
+}
+
+bool WorldMap::voxelOccluded(UniformGrid *grid, const Ray &r) {
+    VoxelWalk walk;
+    if (!walk.begin(grid->g.min, grid->g.max, grid->g.res, r)) return false;
+    do {
+        for (uint32_t i = grid->cellStart[walk.index()]; i < grid->cellStart[walk.index()+1]; i++) {
+            if (shapeOccludes(grid->prims[grid->primIndices[i]], r)) return true;
+        }
+        // The next voxel starts beyond the light.
+        if (walk.exit() > r.tMax) return false;
+    } while (walk.next());
+    return false;
+}
+
+// Front-to-back kd-tree traversal, as in PBRT's KdTreeAggregate::Intersect.
+// The ray is clipped to the root cell, then at each interior node, split into the part before and after the splitting plane.
+// The near child is visited first, with the far one (and the rest of the ray) pushed to visit later.
+// Since cells don't overlap, once a hit is found before the start of the next cell on the stack, we're done.
+void WorldMap::kdRay(RayResult *res, KdTree *tree, const Ray &r) {
+    float tMin, tMax;
+    if (!tree->clip(r, &tMin, &tMax)) return;
+    KdStackEntry stack[KD_STACK_SIZE];
+    int top = 0;
+    uint32_t idx = 0;
+    while (true) {
+        if (res->t < tMin) break;
+        const KdNode *n = &(tree->nodes[idx]);
+        if (!n->leaf()) {
+            int axis = n->axis;
+            float tSplit = (n->split - r.p0(axis)) * r.invDelta(axis);
+            // Children are stored below then above the split.
+            bool belowFirst = r.p0(axis) < n->split || (r.p0(axis) == n->split && r.delta(axis) <= 0.f);
+            uint32_t first = n->offset + (belowFirst ? 0 : 1);
+            uint32_t second = n->offset + (belowFirst ? 1 : 0);
+            // NaN (from a ray lying in the plane) only goes to the near side.
+            if (!(tSplit > 0.f) || tSplit > tMax) {
+                idx = first;
+            } else if (tSplit < tMin) {
+                idx = second;
+            } else {
+                stack[top++] = {second, tSplit, tMax};
+                idx = first;
+                tMax = tSplit;
+            }
+            continue;
+        }
+        const uint32_t *prims = tree->primIndices.data() + n->offset;
+        for (uint32_t i = 0; i < n->primCount; i++) {
+            hitShape(res, tree->prims[prims[i]], r);
+        }
+        if (top == 0) break;
+        KdStackEntry e = stack[--top];
+        idx = e.node;
+        tMin = e.tMin;
+        tMax = e.tMax;
+    }
+}
+
+bool WorldMap::kdOccluded(KdTree *tree, const Ray &r) {
+    float tMin, tMax;
+    if (!tree->clip(r, &tMin, &tMax)) return false;
+    KdStackEntry stack[KD_STACK_SIZE];
+    int top = 0;
+    uint32_t idx = 0;
+    while (true) {
+        const KdNode *n = &(tree->nodes[idx]);
+        if (!n->leaf()) {
+            int axis = n->axis;
+            float tSplit = (n->split - r.p0(axis)) * r.invDelta(axis);
+            bool belowFirst = r.p0(axis) < n->split || (r.p0(axis) == n->split && r.delta(axis) <= 0.f);
+            uint32_t first = n->offset + (belowFirst ? 0 : 1);
+            uint32_t second = n->offset + (belowFirst ? 1 : 0);
+            if (!(tSplit > 0.f) || tSplit > tMax) {
+                idx = first;
+            } else if (tSplit < tMin) {
+                idx = second;
+            } else {
+                stack[top++] = {second, tSplit, tMax};
+                idx = first;
+                tMax = tSplit;
+            }
+            continue;
+        }
+        const uint32_t *prims = tree->primIndices.data() + n->offset;
+        for (uint32_t i = 0; i < n->primCount; i++) {
+            if (shapeOccludes(tree->prims[prims[i]], r)) return true;
+        }
+        if (top == 0) break;
+        KdStackEntry e = stack[--top];
+        idx = e.node;
+        tMin = e.tMin;
+        tMax = e.tMax;
+    }
+    return false;
+}
+
+// Parametric octree traversal (see walkOctree), visiting only the octants the ray passes through, nearest first.
+// Like the kd-tree, cells don't overlap, so once there's a hit before the next leaf starts, we're done.
+void WorldMap::octreeRay(RayResult *res, Octree *tree, const Ray &r) {
+    walkOctree(tree, r, [&](const OctNode *n, float tEnter, float tExit) {
+        if (res->t < tEnter) return true;
+        const uint32_t *prims = tree->primIndices.data() + n->offset;
+        for (uint32_t i = 0; i < n->primCount; i++) {
+            hitShape(res, tree->prims[prims[i]], r);
+        }
+        // A hit beyond this leaf might not be the closest, as something in the next one could be in front of it.
+        return res->t <= tExit;
+    });
+}
+
+bool WorldMap::octreeOccluded(Octree *tree, const Ray &r) {
+    bool hit = false;
+    walkOctree(tree, r, [&](const OctNode *n, float tEnter, float) {
+        // The next leaf starts beyond the light.
+        if (tEnter > r.tMax) return true;
+        const uint32_t *prims = tree->primIndices.data() + n->offset;
+        for (uint32_t i = 0; i < n->primCount; i++) {
+            if (shapeOccludes(tree->prims[prims[i]], r)) {
+                hit = true;
+                return true;
+            }
+        }
+        return false;
+    });
+    return hit;
+}
+
+void WorldMap::clearDebugOverlay() {
+    debugOverlay.clear();
+    delete debugOverlayBVH;
+    debugOverlayBVH = NULL;
+    debugShapes.clear();
+    debugOverlayStale = true;
 }
 
-void WorldMap::ray(RayResult *res, Container *c, Vec3 p0, Vec3 delta, RenderConfig *rc) {
-    if (accelIndex == Accel::Voxel && obj == optimizedObj) {
-        voxelRay(res, c, p0, delta, rc);
+// Makes a wireframe of the boxes (or cells) of the hierarchy being traversed, from its own nodes, colored by depth.
+void WorldMap::buildDebugOverlay() {
+    clearDebugOverlay();
+    debugOverlayStale = false;
+    if (optimizedObj == NULL || flatObj == NULL) return;
+    debugOverlay.min = Bound::forGrowing().min;
+    debugOverlay.max = Bound::forGrowing().max;
+    const float width = 0.02f;
+    // Each of the 12 edges runs along one axis, from one of the 4 corners of the box's face at its min on that axis.
+    auto box = [&](Vec3 min, Vec3 max, int depth) {
+        Vec3 corners[2] = {min, max};
+        Vec3 pad = {width/2.f, width/2.f, width/2.f};
+        for (int axis = 0; axis < 3; axis++) {
+            int a1 = (axis+1) % 3, a2 = (axis+2) % 3;
+            for (int i = 0; i < 4; i++) {
+                Vec3 p = min;
+                p(a1) = corners[i & 1](a1);
+                p(a2) = corners[i >> 1](a2);
+                AAB *edge = new AAB();
+                edge->oMin = p - pad;
+                edge->oMax = p + pad;
+                edge->oMax(axis) = max(axis) + pad(axis);
+                edge->material = &(debugOverlayColors[depth % 16]);
+                edge->applyTransform();
+                Bound *bo = new Bound();
+                edge->bounds(bo);
+                bo->s = edge;
+                debugOverlay.grow(bo);
+                debugOverlay.append(bo);
+            }
+        }
+    };
+
+    if (kdTree != NULL) {
+        struct Cell { uint32_t node; Vec3 min, max; int depth; };
+        std::vector<Cell> stack = {{0, kdTree->min, kdTree->max, 0}};
+        while (!stack.empty()) {
+            Cell c = stack.back();
+            stack.pop_back();
+            box(c.min, c.max, c.depth);
+            const KdNode *n = &(kdTree->nodes[c.node]);
+            if (n->leaf()) continue;
+            Vec3 belowMax = c.max, aboveMin = c.min;
+            belowMax(n->axis) = n->split;
+            aboveMin(n->axis) = n->split;
+            stack.push_back({n->offset, c.min, belowMax, c.depth+1});
+            stack.push_back({n->offset+1, aboveMin, c.max, c.depth+1});
+        }
+    } else if (octree != NULL) {
+        struct Cell { uint32_t node; Vec3 min, size; int depth; };
+        std::vector<Cell> stack = {{0, octree->min, octree->max - octree->min, 0}};
+        while (!stack.empty()) {
+            Cell c = stack.back();
+            stack.pop_back();
+            box(c.min, c.min + c.size, c.depth);
+            const OctNode *n = &(octree->nodes[c.node]);
+            Vec3 half = c.size / 2.f;
+            for (int o = 0; o < 8; o++) {
+                int64_t child = n->child(o);
+                if (child == -1) continue;
+                Vec3 min = c.min + Vec3{(o & 1) ? half.x : 0.f, (o & 2) ? half.y : 0.f, (o & 4) ? half.z : 0.f};
+                stack.push_back({uint32_t(child), min, half, c.depth+1});
+            }
+        }
+    } else if (uniformGrid != NULL || twoLevelGrid != NULL) {
+        // Only cells with something in them, or the empty ones would hide everything else.
+        auto grid = [&](const Grid *g, int depth, auto nonEmpty) {
+            Vec3 dims = g->max - g->min;
+            Vec3 vox = {dims.x / g->res[0], dims.y / g->res[1], dims.z / g->res[2]};
+            for (int z = 0; z < g->res[2]; z++) {
+                for (int y = 0; y < g->res[1]; y++) {
+                    for (int x = 0; x < g->res[0]; x++) {
+                        uint32_t idx = x + g->res[0] * (y + g->res[1] * z);
+                        if (!nonEmpty(idx)) continue;
+                        Vec3 min = g->min + Vec3{vox.x * x, vox.y * y, vox.z * z};
+                        box(min, min + vox, depth);
+                    }
+                }
+            }
+        };
+        if (uniformGrid != NULL) {
+            grid(&(uniformGrid->g), 0, [&](uint32_t i) { return uniformGrid->cellStart[i] != uniformGrid->cellStart[i+1]; });
+        } else {
+            for (size_t i = 0; i < twoLevelGrid->grids.size(); i++) {
+                const Grid *g = &(twoLevelGrid->grids[i]);
+                grid(g, i == 0 ? 0 : 1, [&](uint32_t c) {
+                    const GridCell *cell = &(twoLevelGrid->cells[g->firstCell + c]);
+                    return cell->count != 0 || cell->sub != -1;
+                });
+            }
+        }
+    } else if (wideBVH4 != NULL || wideBVH8 != NULL) {
+        auto wide = [&](auto *bvh) {
+            std::vector<std::pair<uint32_t, int>> stack = {{0, 0}};
+            while (!stack.empty()) {
+                auto [idx, depth] = stack.back();
+                stack.pop_back();
+                const auto *n = &(bvh->nodes[idx]);
+                for (int j = 0; j < n->childCount; j++) {
+                    box(Vec3{n->bounds[0][0][j], n->bounds[0][1][j], n->bounds[0][2][j]}, Vec3{n->bounds[1][0][j], n->bounds[1][1][j], n->bounds[1][2][j]}, depth+1);
+                    if (n->primCount[j] == 0) stack.push_back({n->child[j], depth+1});
+                }
+            }
+        };
+        if (wideBVH8 != NULL) wide(wideBVH8);
+        else wide(wideBVH4);
+    } else if (linearBVH != NULL) {
+        std::vector<std::pair<uint32_t, int>> stack = {{0, 0}};
+        while (!stack.empty()) {
+            auto [idx, depth] = stack.back();
+            stack.pop_back();
+            const BVHNode *n = &(linearBVH->nodes[idx]);
+            box(n->min, n->max, depth);
+            for (int i = 0; i < n->childCount; i++) {
+                stack.push_back({n->offset + i, depth+1});
+            }
+        }
     } else {
-        traversalRay(res, c, p0, delta, rc);
+        // Nothing was flattened, so the Container tree itself is traversed.
+        std::vector<std::pair<Container*, int>> stack = {{optimizedObj, 0}};
+        while (!stack.empty()) {
+            auto [c, depth] = stack.back();
+            stack.pop_back();
+            box(c->min, c->max, depth);
+            if (c->size == 0) continue;
+            Bound *bo = c->start;
+            while (bo != c->end->next) {
+                Container *sub = dynamic_cast<Container*>(bo->s);
+                if (sub != nullptr) stack.push_back({sub, depth+1});
+                bo = bo->next;
+            }
+        }
+    }
+    debugOverlayBVH = buildLinearBVH(&debugOverlay, 64, 4, 1.5f, 16, pool);
+
+    if (flatObj->size > 0) {
+        Bound *bo = flatObj->start;
+        while (bo != flatObj->end->next) {
+            if (bo->s->debug) debugShapes.emplace_back(bo->s);
+            bo = bo->next;
+        }
+    }
+    std::printf("Debug overlay: %d edges\n", debugOverlay.size);
+}
+
+// Draws the overlay on top of whatever the primary ray hit, in the color of the nearest edge in front of it (if any).
+void WorldMap::overlayRay(RayResult *res, const Ray &r) {
+    if (debugOverlayBVH == NULL) return;
+    RayResult edge = RayResult();
+    edge.t = res->t;
+    bvhRay(&edge, debugOverlayBVH, r);
+    if (!edge.hit()) return;
+    res->color = edge.obj->mat()->color;
+    res->collisions++;
+}
+
+// Walks the top grid as voxelRay does, and for any cell with a sub-grid, walks that too before moving on.
+// Both levels stop as soon as there's a hit within the current cell, as nothing in a later one can be closer.
+void WorldMap::gridRay(RayResult *res, TwoLevelGrid *grid, const Ray &r) {
+    const Grid *top = &(grid->grids[0]);
+    VoxelWalk walk;
+    if (!walk.begin(top->min, top->max, top->res, r)) return;
+    do {
+        const GridCell *cell = &(grid->cells[top->firstCell + walk.index()]);
+        if (cell->sub != -1) {
+            const Grid *sub = &(grid->grids[cell->sub]);
+            VoxelWalk inner;
+            if (inner.begin(sub->min, sub->max, sub->res, r)) {
+                do {
+                    const GridCell *subCell = &(grid->cells[sub->firstCell + inner.index()]);
+                    for (uint32_t i = 0; i < subCell->count; i++) {
+                        hitShape(res, grid->prims[grid->primIndices[subCell->offset + i]], r);
+                    }
+                    if (res->t <= inner.exit()) return;
+                } while (inner.next());
+            }
+        } else {
+            for (uint32_t i = 0; i < cell->count; i++) {
+                hitShape(res, grid->prims[grid->primIndices[cell->offset + i]], r);
+            }
+        }
+        if (res->t <= walk.exit()) return;
+    } while (walk.next());
+}
+
+bool WorldMap::gridOccluded(TwoLevelGrid *grid, const Ray &r) {
+    const Grid *top = &(grid->grids[0]);
+    VoxelWalk walk;
+    if (!walk.begin(top->min, top->max, top->res, r)) return false;
+    do {
+        const GridCell *cell = &(grid->cells[top->firstCell + walk.index()]);
+        if (cell->sub != -1) {
+            const Grid *sub = &(grid->grids[cell->sub]);
+            VoxelWalk inner;
+            if (inner.begin(sub->min, sub->max, sub->res, r)) {
+                do {
+                    const GridCell *subCell = &(grid->cells[sub->firstCell + inner.index()]);
+                    for (uint32_t i = 0; i < subCell->count; i++) {
+                        if (shapeOccludes(grid->prims[grid->primIndices[subCell->offset + i]], r)) return true;
+                    }
+                    if (inner.exit() > r.tMax) return false;
+                } while (inner.next());
+            }
+        } else {
+            for (uint32_t i = 0; i < cell->count; i++) {
+                if (shapeOccludes(grid->prims[grid->primIndices[cell->offset + i]], r)) return true;
+            }
+        }
+        // The next voxel starts beyond the light.
+        if (walk.exit() > r.tMax) return false;
+    } while (walk.next());
+    return false;
+}
+
+// Equivalent of bvhRay for a collapsed hierarchy. Every child of a node is tested at once, then those hit are pushed furthest first,
+// so the nearest is visited next. Leaf children are pushed too, so their shapes are only tested once nothing nearer's been hit.
+template <int W>
+void WorldMap::wideBvhRay(RayResult *res, WideBVH<W> *bvh, const Ray &r) {
+    WideStackEntry stack[BVH_STACK_SIZE];
+    int top = 0;
+    float t[W];
+    stack[top++] = {0, 0, r.tMin};
+    while (top > 0) {
+        WideStackEntry e = stack[--top];
+        // Something closer has been hit since this was pushed.
+        if (e.t > res->t) continue;
+        if (e.primCount != 0) {
+            const uint32_t *idx = bvh->primIndices.data() + e.child;
+            for (uint32_t i = 0; i < e.primCount; i++) {
+                hitShape(res, bvh->prims[idx[i]], r);
+            }
+            continue;
+        }
+        const WideBVHNode<W> *n = &(bvh->nodes[e.child]);
+        int hits = meetsChildren(n, r, t);
+        int base = top;
+        while (hits != 0) {
+            int i = std::countr_zero(unsigned(hits));
+            hits &= hits - 1;
+            if (t[i] > res->t) continue;
+            int j = top++;
+            while (j > base && stack[j-1].t <= t[i]) {
+                stack[j] = stack[j-1];
+                j--;
+            }
+            stack[j] = {n->child[i], n->primCount[i], t[i]};
+        }
+    }
+}
+
+template <int W>
+bool WorldMap::wideBvhOccluded(WideBVH<W> *bvh, const Ray &r) {
+    WideStackEntry stack[BVH_STACK_SIZE];
+    int top = 0;
+    float t[W];
+    stack[top++] = {0, 0, r.tMin};
+    while (top > 0) {
+        WideStackEntry e = stack[--top];
+        if (e.primCount != 0) {
+            const uint32_t *idx = bvh->primIndices.data() + e.child;
+            for (uint32_t i = 0; i < e.primCount; i++) {
+                if (shapeOccludes(bvh->prims[idx[i]], r)) return true;
+            }
+            continue;
+        }
+        const WideBVHNode<W> *n = &(bvh->nodes[e.child]);
+        int hits = meetsChildren(n, r, t);
+        while (hits != 0) {
+            int i = std::countr_zero(unsigned(hits));
+            hits &= hits - 1;
+            stack[top++] = {n->child[i], n->primCount[i], t[i]};
+        }
+    }
+    return false;
+}
+
+bool WorldMap::bvhOccluded(LinearBVH *bvh, const Ray &r) {
+    uint32_t stack[BVH_STACK_SIZE];
+    int top = 0;
+    float t;
+    if (meetsNode(&(bvh->nodes[0]), r, &t)) stack[top++] = 0;
+    while (top > 0) {
+        const BVHNode *n = &(bvh->nodes[stack[--top]]);
+        if (n->leaf()) {
+            const uint32_t *idx = bvh->primIndices.data() + n->offset;
+            for (int i = 0; i < n->primCount; i++) {
+                if (shapeOccludes(bvh->prims[idx[i]], r)) return true;
+            }
+            continue;
+        }
+        // Any hit will do, so order doesn't matter. Nodes beyond the light are missed by meetsNode.
+        for (int i = 0; i < n->childCount; i++) {
+            uint32_t child = n->offset + i;
+            if (meetsNode(&(bvh->nodes[child]), r, &t)) stack[top++] = child;
+        }
     }
+    return false;
 }
 
 // Passed res MUST be initialized with the rayResult constructor, or wiped with resetObj()!
-void WorldMap::castRay(RayResult *res, Container *c, Vec3 p0, Vec3 delta, RenderConfig *rc, int callCount) {
+void WorldMap::castRay(RayResult *res, Container *c, const Ray &r, RenderConfig *rc, int callCount) {
     if (callCount > rc->maxBounce) {
         // std::printf("Terminating!\n");
         return;
     }
 
     // Collision Detection
-    ray(res, c, p0, delta, rc);
+    ray(res, c, r, rc);
     
     if (!res->hit()) return;
 
@@ -513,12 +1017,12 @@ void WorldMap::castRay(RayResult *res, Container *c, Vec3 p0, Vec3 delta, Render
         }
         // Angle of reflection: \vec{d} - 2(\vec{d} \cdot \vec{n})\vec{n}
         // FIXME: Put this reflection in a shared function!
-        Vec3 reflection = delta - 2.f*dot(delta, res->norm) * res->norm;
+        Vec3 reflection = r.delta - 2.f*dot(r.delta, res->norm) * res->norm;
         castReflectionRay(p0PlusABit, reflection, rc, res, callCount+1);
     }
 
     if (rc->lighting && !(res->obj->mat()->noLighting)) {//  && res->obj->reflectiveness != 0) {
-        castShadowRays(-1.f*delta, p0PlusABit, rc, res);
+        castShadowRays(-1.f*r.delta, p0PlusABit, rc, res);
     } else {
         res->lightColor = {1.f, 1.f, 1.f};
     }
@@ -529,11 +1033,19 @@ void WorldMap::castRay(RayResult *res, Container *c, Vec3 p0, Vec3 delta, Render
         // if (res->collisions >= 1 && res->potentialCollisions > 1) {
         if (res->collisions >= 1) {
             Vec3 p1, delta1;
-            res->obj->refract(rc->refractiveIndex, res->p0, delta, &p1, &delta1);
+            if (res->instance != NULL) {
+                // The shape's in the instance's space, so the ray's refracted there.
+                Ray local = res->instance->toObjectSpace(Ray(res->p0, r.delta));
+                res->obj->refract(rc->refractiveIndex, local.p0, local.delta, &p1, &delta1);
+                p1 = res->instance->pointToWorld(p1);
+                delta1 = res->instance->directionToWorld(delta1);
+            } else {
+                res->obj->refract(rc->refractiveIndex, res->p0, r.delta, &p1, &delta1);
+            }
             p1 = p1 + (EPSILON * delta1);
-            RayResult r = RayResult();
-            castRay(&r, obj, p1, delta1, rc, callCount+1);
-            res->refractColor = r.color;
+            RayResult behind = RayResult();
+            castRay(&behind, obj, Ray(p1, delta1), rc, callCount+1);
+            res->refractColor = behind.color;
         } else {
             res->refractColor = {0.f, 0.f, 0.f};
         }
@@ -555,13 +1067,21 @@ void WorldMap::castRay(RayResult *res, Container *c, Vec3 p0, Vec3 delta, Render
     res->color.z = std::fmin(res->color.z, 1.f);
 }
 
+// Render thread body: keep taking tiles (our own first, then stolen ones) until none are left, or we're cancelled.
+void WorldMap::castTiles(Image *img, RenderConfig *rc, TileScheduler *tiles, int thread, int *state, Vec2 *offsets, int nOffsets) {
+    Tile t;
+    while (*state != -1 && tiles->next(thread, &t)) {
+        castSubRays(img, rc, t.w0, t.w1, t.h0, t.h1, state, offsets, nOffsets);
+    }
+    *state = 0;
+}
+
 void WorldMap::castSubRays(Image *img, RenderConfig *rc, int w0, int w1, int h0, int h1, int *state, Vec2 *offsets, int nOffsets) {
     RayResult res = RayResult();
     Vec3 startCol = w0 * cam->viewportCol;
     Vec3 startRow = h0 * cam->viewportRow;
     Vec3 baseRowVec = cam->viewportCorner + startRow + startCol;
 
-    *state = 1;
     Vec3 accumulatedColor = {0,0,0};
     for (int y = h0; y < h1; y++) {
         // cam->viewportCorner is a vector from the origin, therefore all calculated pixel positions are.
@@ -571,7 +1091,9 @@ void WorldMap::castSubRays(Image *img, RenderConfig *rc, int w0, int w1, int h0,
             for (int i = 0; i < nOffsets; i++) {
                 Vec3 offsetDelta = delta + (offsets[i].x*cam->viewportCol) + (offsets[i].y*cam->viewportRow);
                 res.resetObj();
-                castRay(&res, obj, cam->position, offsetDelta, rc);
+                Ray primary(cam->position, offsetDelta);
+                castRay(&res, obj, primary, rc);
+                if (rc->showDebugObjects && obj == optimizedObj) overlayRay(&res, primary);
                 if (res.collisions > 0) collision = true;
                 accumulatedColor = accumulatedColor + res.color;
             }
@@ -587,7 +1109,6 @@ void WorldMap::castSubRays(Image *img, RenderConfig *rc, int w0, int w1, int h0,
         baseRowVec = baseRowVec + cam->viewportRow;
         if (*state == -1) break;
     }
-    *state = 0;
 }
 
 namespace {
@@ -664,15 +1185,45 @@ WorldMap::WorldMap(char const* path) {
     accelIndex = Accel::None;
     accelParam = -1;
     accelFloatParam = 1.5f;
+    accelBins = 16;
+    accelWidth = 4;
+    accelSplitAlpha = 1e-5f;
+    accelTreeletLevels = 0;
+    accelSearchRadius = 16;
+    accelCachePath = "";
+    accelLayout = BVHLayout::DepthFirst;
+    accelLayoutStats = false;
+    useMeasuredCosts = true;
+    shapeCostsMeasured = false;
+    remeasureCosts = false;
+    instanceIncludes = true;
     currentlyRendering = false;
     currentlyOptimizing = false;
     currentlyLoading = false;
     lastRenderTime = 0.f;
     lastOptimizeTime = 0.f;
+    lastBuildStats = {0, 0};
     lastLoadTime = 0.f;
     obj = &unoptimizedObj;
     flatObj = NULL;
     optimizedObj = NULL;
+    linearBVH = NULL;
+    wideBVH4 = NULL;
+    wideBVH8 = NULL;
+    kdTree = NULL;
+    octree = NULL;
+    uniformGrid = NULL;
+    twoLevelGrid = NULL;
+    debugOverlayBVH = NULL;
+    debugOverlayStale = true;
+    builtCost = 0.f;
+    builtRootSA = 0.f;
+    splitSAHCost = 0.f;
+    splitSAHBuildTime = 0.0;
+    refitRebuildRatio = 1.5f;
+    for (int i = 0; i < 16; i++) {
+        debugOverlayColors[i].color = debugColor(i);
+    }
     camPresetNames = NULL;
     aaOffsetImage = NULL;
     aaOffsetImageDirty = false;
@@ -682,9 +1233,27 @@ WorldMap::WorldMap(char const* path) {
     objectCount = 0;
     materials = MaterialStore();
     dec.setStores(&tex, &norms, &refs, &materials);
+    pool = new ThreadPool();
     loadFile(path, NULL);
 }
 
+namespace {
+    // Whether the accelerator makes a Container tree (which is then flattened, if it's a BVH), rather than building its structure straight from flatObj.
+    bool buildsContainerTree(int accel) {
+        return accel != Accel::Voxel && accel != Accel::InPlaceSAH && accel != Accel::SpatialSplitBVH && accel != Accel::MortonBVH &&
+            accel != Accel::PLOC && accel != Accel::TwoLevelGrid;
+    }
+
+    // Stands in for the Container tree when there isn't one, as an empty box around the map.
+    Container *emptyContainer(const Container *map) {
+        Container *c = new Container();
+        c->min = map->min;
+        c->max = map->max;
+        countBuildMemory(sizeof(Container), 1);
+        return c;
+    }
+}
+
 void WorldMap::optimizeMap(double (*getTime)(void), int level, int accelIdx) {
     currentlyOptimizing = true;
     optimizeLevel = level;
@@ -695,25 +1264,292 @@ void WorldMap::optimizeMap(double (*getTime)(void), int level, int accelIdx) {
         delete optimizedObj;
         optimizedObj = NULL;
     }
+    delete linearBVH;
+    linearBVH = NULL;
+    delete wideBVH4;
+    wideBVH4 = NULL;
+    delete wideBVH8;
+    wideBVH8 = NULL;
+    delete kdTree;
+    kdTree = NULL;
+    delete octree;
+    octree = NULL;
+    delete uniformGrid;
+    uniformGrid = NULL;
+    delete twoLevelGrid;
+    twoLevelGrid = NULL;
+    clearDebugOverlay();
     if (flatObj == NULL) {
         flatObj = new Container();
         unoptimizedObj.flattenTo(flatObj);
+        int id = 0;
+        Bound *bo = flatObj->start;
+        while (bo != NULL && bo != flatObj->end->next) {
+            bo->s->id = id++;
+            bo = bo->next;
+        }
         genObjectList(flatObj);
     }
+    setBuildPool(pool);
+    if (useMeasuredCosts && (!shapeCostsMeasured || remeasureCosts)) measureShapeCosts(remeasureCosts);
+    remeasureCosts = false;
+    setShapeCosts(useMeasuredCosts ? shapeCosts : NULL);
+    // Instances' meshes have hierarchies of their own, built when they were loaded, which have to keep up with the settings (and costs) too.
+    // Their boxes don't change, so neither do the instances'.
+    int rebuiltMeshes = 0;
+    uint64_t meshKey = meshBuildKey();
+    for (auto &it: meshes) {
+        if (it.second->buildKey == meshKey) continue;
+        buildMesh(it.second);
+        rebuiltMeshes++;
+    }
+    if (rebuiltMeshes != 0) std::printf("Rebuilt %d instanced meshes\n", rebuiltMeshes);
+    pool->resetStats();
+    resetBuildStats();
     lastOptimizeTime = getTime();
-    if (accelIndex == Accel::Voxel) {
-        optimizedObj = splitVoxels(flatObj, level);
-    } else if (accelIndex == Accel::BiTree) {
-        optimizedObj = generateHierarchy(flatObj, accelIndex, false, level, 0, -1, 0, accelParam);
+    uint64_t cacheKey = accelCacheKey();
+    bool cached = false;
+    if (cacheKey != 0) {
+        linearBVH = loadBVHCache(accelCacheFile(cacheKey), cacheKey, flatObj);
+        if (linearBVH != NULL) {
+            optimizedObj = emptyContainer(flatObj);
+            countBuildMemory(sizeof(LinearBVH) + linearBVH->memoryUsage(), 4);
+            cached = true;
+            std::printf("Loaded hierarchy from cache %s\n", accelCacheFile(cacheKey).c_str());
+        }
+    }
+    // The build itself is a job too, so the time spent on the upper levels of the tree is counted in the utilization.
+    JobGroup build;
+    if (!cached) pool->submit(&build, [&]() {
+        if (!buildsContainerTree(accelIndex)) optimizedObj = emptyContainer(flatObj);
+        if (accelIndex == Accel::Voxel) {
+            uniformGrid = buildUniformGrid(flatObj, level, accelFloatParam, pool);
+        } else if (accelIndex == Accel::BiTree) {
+            optimizedObj = generateHierarchy(flatObj, accelIndex, false, level, 0, -1, accelParam, accelFloatParam);
+        } else if (accelIndex == Accel::FalseOctree) {
+            optimizedObj = generateOctreeHierarchy(flatObj, level, 0, accelParam);
+        } else if (accelIndex == Accel::BinnedSAH) {
+            optimizedObj = generateHierarchy(flatObj, accelIndex, true, level, 0, -1, accelParam, accelFloatParam, accelBins);
+        } else if (accelIndex == Accel::InPlaceSAH) {
+            linearBVH = buildLinearBVH(flatObj, level, accelParam, accelFloatParam, accelBins, pool);
+        } else if (accelIndex == Accel::SpatialSplitBVH) {
+            linearBVH = buildSBVH(flatObj, level, accelParam, accelFloatParam, accelBins, accelSplitAlpha, pool);
+        } else if (accelIndex == Accel::MortonBVH) {
+            linearBVH = buildLBVH(flatObj, level, accelParam, accelFloatParam, accelTreeletLevels, pool);
+        } else if (accelIndex == Accel::PLOC) {
+            linearBVH = buildPLOC(flatObj, level, accelParam, accelFloatParam, accelSearchRadius, pool);
+        } else if (accelIndex == Accel::TwoLevelGrid) {
+            twoLevelGrid = buildTwoLevelGrid(flatObj, level, accelParam, accelFloatParam, pool);
+        } else if (accelIndex == Accel::WideBVH) {
+            // Built as a binary SAH tree, then collapsed once flattened.
+            optimizedObj = generateHierarchy(flatObj, Accel::SAH, true, level, 0, -1, accelParam, accelFloatParam);
+        } else {
+            optimizedObj = generateHierarchy(flatObj, accelIndex, bvh, level, 0, -1, accelParam, accelFloatParam);
+        }
+    });
+    pool->wait(&build);
+    double buildTime = getTime() - lastOptimizeTime;
+    reportBuildUtilization(buildTime);
+    if (accelIndex == Accel::BiTree) {
+        kdTree = flattenKdTree(optimizedObj);
+        if (kdTree != NULL) {
+            countBuildMemory(sizeof(KdTree) + kdTree->memoryUsage(), 4);
+            std::printf("Flattened kd-tree: %zu nodes, %zu bytes\n", kdTree->nodes.size(), kdTree->memoryUsage());
+        }
     } else if (accelIndex == Accel::FalseOctree) {
-        optimizedObj = generateOctreeHierarchy(flatObj, level, 0, 0, accelParam);
-    } else {
-        optimizedObj = generateHierarchy(flatObj, accelIndex, bvh, level, 0, -1, 0, accelParam, accelFloatParam);
+        octree = flattenOctree(optimizedObj);
+        if (octree != NULL) {
+            countBuildMemory(sizeof(Octree) + octree->memoryUsage(), 4);
+            std::printf("Flattened octree: %zu nodes, %zu bytes\n", octree->nodes.size(), octree->memoryUsage());
+        }
+    }
+    if (uniformGrid != NULL) {
+        const Grid *g = &(uniformGrid->g);
+        std::printf("Uniform grid: %dx%dx%d, %zu references (%.2f per shape), %zu bytes, built in %.1fms\n",
+            g->res[0], g->res[1], g->res[2], uniformGrid->primIndices.size(),
+            double(uniformGrid->primIndices.size()) / std::max(size_t(1), uniformGrid->prims.size()), uniformGrid->memoryUsage(), buildTime*1000.0);
+    }
+    if (twoLevelGrid != NULL) {
+        const Grid *top = &(twoLevelGrid->grids[0]);
+        std::printf("Two-level grid: %dx%dx%d top, %zu sub-grids, %zu cells, %zu references (%.2f per shape), %zu bytes, built in %.1fms\n",
+            top->res[0], top->res[1], top->res[2], twoLevelGrid->grids.size()-1, twoLevelGrid->cells.size(), twoLevelGrid->primIndices.size(),
+            double(twoLevelGrid->primIndices.size()) / std::max(size_t(1), twoLevelGrid->prims.size()), twoLevelGrid->memoryUsage(), buildTime*1000.0);
+    }
+    if (accelIndex == Accel::SpatialSplitBVH && linearBVH != NULL) {
+        std::printf("SBVH: %zu references to %zu shapes (%.2f per shape)\n", linearBVH->primIndices.size(), linearBVH->prims.size(),
+            double(linearBVH->primIndices.size()) / std::max(size_t(1), linearBVH->prims.size()));
+    }
+    if (buildsContainerTree(accelIndex) && kdTree == NULL && octree == NULL && !cached) {
+        linearBVH = flattenHierarchy(optimizedObj);
+        if (linearBVH != NULL) countBuildMemory(sizeof(LinearBVH) + linearBVH->memoryUsage(), 4);
+    }
+    // Wide BVHs are cached before they're collapsed, as that's quick.
+    if (cacheKey != 0 && !cached && linearBVH != NULL) saveBVHCache(accelCacheFile(cacheKey), cacheKey, linearBVH);
+    if (linearBVH != NULL) std::printf("Flattened hierarchy: %zu nodes, %zu bytes\n", linearBVH->nodes.size(), linearBVH->memoryUsage());
+    if (accelIndex == Accel::WideBVH && linearBVH != NULL) {
+        if (accelWidth == 8) wideBVH8 = collapseBVH<8>(linearBVH);
+        else wideBVH4 = collapseBVH<4>(linearBVH);
+        if (wideBVH8 != NULL) std::printf("Collapsed to 8-wide: %zu nodes, %zu bytes\n", wideBVH8->nodes.size(), wideBVH8->memoryUsage());
+        if (wideBVH4 != NULL) std::printf("Collapsed to 4-wide: %zu nodes, %zu bytes\n", wideBVH4->nodes.size(), wideBVH4->memoryUsage());
+        // Traversal only needs the collapsed tree, the binary one's kept only if collapsing failed.
+        if (wideBVH4 != NULL || wideBVH8 != NULL) {
+            countBuildMemory(-int64_t(sizeof(LinearBVH) + linearBVH->memoryUsage()), 0);
+            delete linearBVH;
+            linearBVH = NULL;
+        }
+    }
+    if (linearBVH != NULL && kdTree == NULL && octree == NULL && (accelLayout != BVHLayout::AsBuilt || accelLayoutStats)) {
+        std::vector<Ray> rays;
+        BVHTraceStats before;
+        if (accelLayoutStats) {
+            rays = cameraRays(1 << 16);
+            before = measureBVH(linearBVH, rays);
+        }
+        double layoutStart = getTime();
+        size_t bytes = linearBVH->memoryUsage();
+        layoutBVH(linearBVH, accelLayout);
+        countBuildMemory(int64_t(linearBVH->memoryUsage()) - int64_t(bytes), 0);
+        if (accelLayout != BVHLayout::AsBuilt) std::printf("Laid out %s in %.1fms\n", bvhLayouts[accelLayout], (getTime() - layoutStart)*1000.0);
+        if (accelLayoutStats && !rays.empty()) {
+            BVHTraceStats after = measureBVH(linearBVH, rays);
+            std::printf("Per ray (%zu camera rays): %.1f nodes, %.1f shapes, %.1f cache lines (%.0f bytes) touched (%.1f lines, %.0f bytes as built)\n",
+                rays.size(), after.nodes, after.prims, after.lines, after.bytes, before.lines, before.bytes);
+        }
     }
+    builtRootSA = 0.f;
+    builtCost = hierarchyCost(&builtRootSA);
+    // A cached hierarchy's build time isn't worth comparing against.
+    if (accelIndex == Accel::SAH && !cached) {
+        splitSAHCost = builtCost;
+        splitSAHBuildTime = buildTime;
+    }
+    if (builtCost != 0.f && accelIndex != Accel::SAH && splitSAHCost != 0.f) {
+        std::printf("SAH cost: %.2f (%.2f for the splitSAH hierarchy, built in %.1fms)\n", builtCost, splitSAHCost, splitSAHBuildTime*1000.0);
+    } else if (builtCost != 0.f) {
+        std::printf("SAH cost: %.2f\n", builtCost);
+    }
+    lastBuildStats = getBuildStats();
+    std::printf("Build memory: %zu bytes peak, %zu allocations\n", lastBuildStats.peakBytes, lastBuildStats.allocations);
     lastOptimizeTime = getTime() - lastOptimizeTime;
     currentlyOptimizing = false;
 }
 
+void WorldMap::measureShapeCosts(bool remeasure) {
+    std::string path = accelCachePath.empty() ? "" : accelCachePath + "/" + SHAPE_COSTS_FILE;
+    if (!remeasure && !path.empty() && loadShapeCosts(path, shapeCosts)) {
+        std::printf("Loaded shape costs from %s: %s\n", path.c_str(), describeShapeCosts(shapeCosts).c_str());
+    } else {
+        calibrateShapeCosts(shapeCosts);
+        std::printf("Measured shape costs: %s\n", describeShapeCosts(shapeCosts).c_str());
+        if (!path.empty()) saveShapeCosts(path, shapeCosts);
+    }
+    shapeCostsMeasured = true;
+}
+
+// Primary rays through (up to around maxRays) pixels spread evenly over the camera's view, as castRays would cast them (without AA).
+std::vector<Ray> WorldMap::cameraRays(int maxRays) {
+    std::vector<Ray> rays;
+    if (cam == NULL || cam->w <= 0 || cam->h <= 0) return rays;
+    int stride = std::max(1, int(std::ceil(std::sqrt(double(cam->w)*cam->h / maxRays))));
+    rays.reserve((cam->w/stride + 1) * (cam->h/stride + 1));
+    for (int y = 0; y < cam->h; y += stride) {
+        for (int x = 0; x < cam->w; x += stride) {
+            rays.emplace_back(cam->position, cam->viewportCorner + float(y)*cam->viewportRow + float(x)*cam->viewportCol);
+        }
+    }
+    return rays;
+}
+
+// Key a hierarchy built with the current settings is cached under (see bvhcache.hpp), or 0 if it isn't cached: caching's off, or it won't be a LinearBVH.
+uint64_t WorldMap::accelCacheKey() {
+    if (accelCachePath.empty() || accelIndex == Accel::Voxel || accelIndex == Accel::TwoLevelGrid || accelIndex == Accel::BiTree || accelIndex == Accel::FalseOctree) return 0;
+    uint64_t h = hashGeometry(flatObj);
+    h = hashValue(accelIndex, h);
+    h = hashValue(optimizeLevel, h);
+    h = hashValue(bvh, h);
+    h = hashValue(accelParam, h);
+    // For the BVH builders, accelFloatParam is the triangle/sphere cost ratio, which measured costs replace.
+    if (!useMeasuredCosts) h = hashValue(accelFloatParam, h);
+    h = hashValue(accelBins, h);
+    h = hashValue(accelSplitAlpha, h);
+    h = hashValue(accelTreeletLevels, h);
+    h = hashValue(accelSearchRadius, h);
+    if (useMeasuredCosts) h = hashBytes(shapeCosts, sizeof(shapeCosts), h);
+    // 0 means "not cached".
+    return h == 0 ? 1 : h;
+}
+
+std::string WorldMap::accelCacheFile(uint64_t key) {
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.bvh", (unsigned long long)key);
+    return accelCachePath + "/" + name;
+}
+
+// SAH cost of whichever BVH is in use, or 0 if it isn't one. rootSA is as for bvhCost.
+float WorldMap::hierarchyCost(float *rootSA) {
+    if (wideBVH8 != NULL) return wideBvhCost(wideBVH8, accelFloatParam, rootSA);
+    if (wideBVH4 != NULL) return wideBvhCost(wideBVH4, accelFloatParam, rootSA);
+    if (linearBVH != NULL && kdTree == NULL && octree == NULL) return bvhCost(linearBVH, accelFloatParam, rootSA);
+    return 0.f;
+}
+
+bool WorldMap::refitMap(const std::vector<Shape*> &moved, double (*getTime)(void)) {
+    if (moved.empty() || flatObj == NULL || flatObj->size == 0) return false;
+    double start = getTime();
+    std::unordered_set<Shape*> movedSet;
+    for (Shape *sh: moved) {
+        // The editor only marks the transform dirty, so it's applied here rather than racing the render threads to it.
+        sh->applyTransform();
+        movedSet.insert(sh);
+    }
+    // Builders take shapes' bounds from flatObj, so they're updated there too, for whenever it's next rebuilt.
+    flatObj->min = Bound::forGrowing().min;
+    flatObj->max = Bound::forGrowing().max;
+    Bound *bo = flatObj->start;
+    while (bo != flatObj->end->next) {
+        if (movedSet.count(bo->s) != 0) bo->s->bounds(bo);
+        flatObj->grow(bo);
+        bo = bo->next;
+    }
+    // Grids and kd-trees/octrees bin shapes by where they are, so have to be rebuilt when they move.
+    if (builtCost == 0.f) return true;
+    // The prims of each structure are all taken from flatObj, so the same flags do for any of them.
+    const std::vector<Shape*> *prims = wideBVH8 != NULL ? &(wideBVH8->prims) : (wideBVH4 != NULL ? &(wideBVH4->prims) : &(linearBVH->prims));
+    std::vector<bool> dirty(prims->size(), false);
+    int count = 0;
+    for (size_t i = 0; i < prims->size(); i++) {
+        if (movedSet.count(prims->at(i)) == 0) continue;
+        dirty[i] = true;
+        count++;
+    }
+    if (count == 0) return false;
+    if (wideBVH8 != NULL) refitWideBVH(wideBVH8, dirty);
+    else if (wideBVH4 != NULL) refitWideBVH(wideBVH4, dirty);
+    else refitBVH(linearBVH, dirty);
+    debugOverlayStale = true;
+    // Relative to the root's area when built, as otherwise a shape moved outwards grows the root too, hiding how much worse the tree has got.
+    float rootSA = builtRootSA;
+    float cost = hierarchyCost(&rootSA);
+    std::printf("Refit %d shapes in %.2fms, SAH cost %.2f (%.2f when built)\n", count, (getTime() - start)*1000.0, cost, builtCost);
+    return cost > builtCost * refitRebuildRatio;
+}
+
+void WorldMap::reportBuildUtilization(double buildTime) {
+    std::vector<double> busy = pool->busyTimes();
+    buildUtilization.clear();
+    if (buildTime <= 0.0) return;
+    double total = 0.0;
+    std::printf("Build utilization:");
+    for (size_t i = 0; i < busy.size(); i++) {
+        buildUtilization.emplace_back(busy[i] / buildTime);
+        total += busy[i];
+        // The last entry is threads from outside the pool (i.e. this one) helping out.
+        if (i == busy.size()-1) std::printf(" caller %d%%", int(100.0 * buildUtilization[i]));
+        else std::printf(" %zu: %d%%", i, int(100.0 * buildUtilization[i]));
+    }
+    std::printf(" (%.2fx parallelism over %d workers)\n", total / buildTime, pool->size());
+}
+
 void WorldMap::loadFile(char const* path, double (*getTime)(void)) {
     currentlyLoading = true;
     std::printf("Frees: %d\n", unoptimizedObj.clear());
@@ -730,11 +1566,32 @@ void WorldMap::loadFile(char const* path, double (*getTime)(void)) {
         delete optimizedObj;
         optimizedObj = NULL;
     }
+    delete linearBVH;
+    linearBVH = NULL;
+    delete wideBVH4;
+    wideBVH4 = NULL;
+    delete wideBVH8;
+    wideBVH8 = NULL;
+    delete kdTree;
+    kdTree = NULL;
+    delete octree;
+    octree = NULL;
+    delete uniformGrid;
+    uniformGrid = NULL;
+    delete twoLevelGrid;
+    twoLevelGrid = NULL;
+    builtCost = 0.f;
+    builtRootSA = 0.f;
+    splitSAHCost = 0.f;
+    splitSAHBuildTime = 0.0;
+    clearDebugOverlay();
     if (flatObj != NULL) {
         flatObj->clear();
         delete flatObj;
         flatObj = NULL;
     }
+    // Only once every instance of them has been freed.
+    clearMeshes();
     obj = &unoptimizedObj;
 
     tex.clear();
@@ -742,6 +1599,12 @@ void WorldMap::loadFile(char const* path, double (*getTime)(void)) {
     refs.clear();
 
     if (getTime != NULL) lastLoadTime = getTime();
+    // Decode every texture up front in parallel, rather than one after another as the parser reaches them.
+    std::vector<std::string> texNames, normNames, refNames;
+    collectTextures(path, &texNames, &normNames, &refNames);
+    tex.preload(texNames, pool);
+    norms.preload(normNames, pool);
+    refs.preload(refNames, pool);
     loadObjFile(path);
     std::printf("Allocations: %d\n", mapStats.allocs);
     camPresetNames = new const char*[camPresets.size()];
@@ -812,9 +1675,28 @@ void WorldMap::genObjectList(Container *c) {
     }
 }
 
-#define APPEND(sh) if (c != NULL) { mapStats.allocs += c->append(sh); } else if (csg != NULL) { csg->append(sh); } else { mapStats.allocs += unoptimizedObj.append(sh); }
+// Finds the textures referenced by a map file and those it includes.
+void WorldMap::collectTextures(char const* path, std::vector<std::string> *t, std::vector<std::string> *n, std::vector<std::string> *r) {
+    std::ifstream in(path);
+    if (in.fail() || in.bad()) return;
+    std::string line;
+    while (std::getline(in, line)) {
+        std::stringstream lstream(line);
+        std::string token;
+        lstream >> token;
+        if (token == w_include) {
+            lstream >> token;
+            std::filesystem::path eval = std::filesystem::path(path).parent_path() / std::filesystem::path(token);
+            collectTextures(eval.c_str(), t, n, r);
+        } else if (token != w_comment) {
+            dec.collectTextures(line, t, n, r);
+        }
+    }
+}
+
+#define APPEND(sh) if (c != NULL) { mapStats.allocs += c->append(sh); } else if (csg != NULL) { csg->append(sh); } else { mapStats.allocs += dst->append(sh); }
 
-void WorldMap::loadObjFile(const char* path, Mat4 transform) {
+void WorldMap::loadObjFile(const char* path, Mat4 transform, Mesh *mesh) {
     std::ifstream in(path);
     if (in.fail() || in.bad()) {
         mapStats.missingObj += 1;
@@ -823,6 +1705,7 @@ void WorldMap::loadObjFile(const char* path, Mat4 transform) {
     std::string line;
     Container *c = NULL;
     CSG *csg = NULL;
+    Container *dst = mesh != NULL ? &(mesh->shapes) : &unoptimizedObj;
     while (std::getline(in, line)) {
         std::stringstream lstream(line);
         std::string token;
@@ -932,14 +1815,14 @@ void WorldMap::loadObjFile(const char* path, Mat4 transform) {
         */
         } else if (token == w_close) {
             if (c != NULL) {
-                mapStats.allocs += unoptimizedObj.append(c);
+                mapStats.allocs += dst->append(c);
                 c = NULL;
             } else if (dec.isUsingMaterial()) {
                 dec.endUsingMaterial();
             } else if (csg != NULL) {
                 dec.decodeShape(csg, line);
-                unoptimizedObj.append(csg);
-                mapStats.csgs++;
+                dst->append(csg);
+                if (mesh == NULL) mapStats.csgs++;
                 csg = NULL;
             }
         } else if (token == w_sphere || token == w_triangle || token == w_aab || token == w_cylinder || token == w_cone) {
@@ -952,7 +1835,7 @@ void WorldMap::loadObjFile(const char* path, Mat4 transform) {
                 // FIXME: Scale isn't applied to the radius!
                 sphere->oCenter = sphere->oCenter * transform;
                 APPEND(sphere);
-                if (csg == NULL) mapStats.spheres++;
+                if (csg == NULL && mesh == NULL) mapStats.spheres++;
             } else if (token == w_triangle) {
                 Triangle *triangle = dec.decodeTriangle(line);
                 if (tex.lastLoadFail) mapStats.missingTex += 1;
@@ -962,12 +1845,15 @@ void WorldMap::loadObjFile(const char* path, Mat4 transform) {
                 triangle->oA = triangle->oA * transform;
                 triangle->oB = triangle->oB * transform;
                 triangle->oC = triangle->oC * transform;
-                if (triangle->plane) {
+                if (triangle->unbounded() && mesh != NULL) {
+                    // Kept aside, to be placed in the map with each instance.
+                    mesh->planes.push_back(triangle);
+                } else if (triangle->unbounded()) {
                     mapStats.allocs += unoptimizable.append(triangle);
                     if (csg == NULL) mapStats.planes++;
                 } else {
                     APPEND(triangle);
-                    if (csg == NULL) mapStats.tris++;
+                    if (csg == NULL && mesh == NULL) mapStats.tris++;
                 }
             } else if (token == w_aab) {
                 AAB *aab = dec.decodeAAB(line);
@@ -978,7 +1864,7 @@ void WorldMap::loadObjFile(const char* path, Mat4 transform) {
                 aab->oMin = aab->oMin * transform;
                 aab->oMax = aab->oMax * transform;
                 APPEND(aab);
-                if (csg == NULL) mapStats.aabs++;
+                if (csg == NULL && mesh == NULL) mapStats.aabs++;
             } else if (token == w_cylinder) {
                 Cylinder *cylinder = dec.decodeCylinder(line);
                 if (tex.lastLoadFail) mapStats.missingTex += 1;
@@ -988,7 +1874,7 @@ void WorldMap::loadObjFile(const char* path, Mat4 transform) {
                 // FIXME: Scale isn't applied to the radius!
                 cylinder->oCenter = cylinder->oCenter * transform;
                 APPEND(cylinder);
-                if (csg == NULL) mapStats.cylinders++;
+                if (csg == NULL && mesh == NULL) mapStats.cylinders++;
             } else if (token == w_cone) {
                 Cone *cone = dec.decodeCone(line);
                 if (tex.lastLoadFail) mapStats.missingTex += 1;
@@ -998,13 +1884,17 @@ void WorldMap::loadObjFile(const char* path, Mat4 transform) {
                 // FIXME: Scale isn't applied to the radius!
                 cone->oCenter = cone->oCenter * transform;
                 APPEND(cone);
-                if (csg == NULL) mapStats.cones++;
+                if (csg == NULL && mesh == NULL) mapStats.cones++;
             }
         } else if (token == w_pointLight) {
             PointLight pl = dec.decodePointLight(line);
             pl.center = pl.center * transform;
-            pointLights.emplace_back(pl);
-            mapStats.lights++;
+            if (mesh != NULL) {
+                mesh->lights.emplace_back(pl);
+            } else {
+                pointLights.emplace_back(pl);
+                mapStats.lights++;
+            }
         } else if (token == w_campreset) {
             CamPreset cp = decodeCamPreset(line);
             camPresets.emplace_back(cp);
@@ -1044,11 +1934,79 @@ void WorldMap::loadObjFile(const char* path, Mat4 transform) {
                     break;
                 }
             }
-            loadObjFile(eval.c_str(), trans);
+            // Files included by an instanced file are part of its mesh.
+            if (mesh != NULL || !instanceIncludes) {
+                loadObjFile(eval.c_str(), trans, mesh);
+                continue;
+            }
+            Mesh *m = loadMesh(eval.string());
+            if (m == NULL) continue;
+            if (m->bvh != NULL) {
+                mapStats.allocs += unoptimizedObj.append(new Instance(m, trans));
+                mapStats.instances++;
+            }
+            for (PointLight pl: m->lights) {
+                pl.center = pl.center * trans;
+                pointLights.emplace_back(pl);
+                mapStats.lights++;
+            }
+            for (Triangle *p: m->planes) {
+                Triangle *placed = static_cast<Triangle*>(p->clone());
+                placed->oA = placed->oA * trans;
+                placed->oB = placed->oB * trans;
+                placed->oC = placed->oC * trans;
+                placed->transformDirty = true;
+                mapStats.allocs += unoptimizable.append(placed);
+                mapStats.planes++;
+            }
         }
     }
 }
 
+// Loads the file at "path" into a Mesh in its own space and builds its hierarchy, or returns the one already loaded for it.
+// Returns NULL if the file's missing.
+Mesh *WorldMap::loadMesh(const std::string &path) {
+    auto it = meshes.find(path);
+    if (it != meshes.end()) return it->second;
+    if (!std::filesystem::exists(path)) {
+        mapStats.missingObj += 1;
+        return NULL;
+    }
+    Mesh *m = new Mesh();
+    m->path = path;
+    loadObjFile(path.c_str(), mat44Identity, m);
+    // Costs are only set for the map's own hierarchy otherwise, so use whichever it was last built with.
+    setShapeCosts(useMeasuredCosts && shapeCostsMeasured ? shapeCosts : NULL);
+    buildMesh(m);
+    mapStats.instancedShapes += m->shapes.size;
+    meshes[path] = m;
+    return m;
+}
+
+// (Re)builds the hierarchy of a mesh with the map's current build settings, and the shape costs currently set.
+void WorldMap::buildMesh(Mesh *m) {
+    m->build(accelParam > 0 ? accelParam : 2, accelFloatParam, accelBins, pool);
+    m->buildKey = meshBuildKey();
+}
+
+// Identifies the settings meshes are built with: those buildLinearBVH takes from the map's own hierarchy, and the shape costs in use.
+uint64_t WorldMap::meshBuildKey() {
+    int leafSize = accelParam > 0 ? accelParam : 2;
+    uint64_t h = hashBytes(&leafSize, sizeof(leafSize));
+    h = hashValue(accelBins, h);
+    bool measured = useMeasuredCosts && shapeCostsMeasured;
+    h = hashValue(measured, h);
+    // Measured costs replace the triangle/sphere ratio.
+    if (measured) h = hashBytes(shapeCosts, sizeof(shapeCosts), h);
+    else h = hashValue(accelFloatParam, h);
+    return h;
+}
+
+void WorldMap::clearMeshes() {
+    for (auto &it: meshes) delete it.second;
+    meshes.clear();
+}
+
 WorldMap::~WorldMap() {
     delete cam;
     unoptimizedObj.clear();
@@ -1061,4 +2019,14 @@ WorldMap::~WorldMap() {
         flatObj->clear();
         delete flatObj;
     }
+    clearMeshes();
+    delete linearBVH;
+    delete wideBVH4;
+    delete wideBVH8;
+    delete kdTree;
+    delete octree;
+    delete uniformGrid;
+    delete twoLevelGrid;
+    clearDebugOverlay();
+    delete pool;
 }
@@ -0,0 +1,102 @@
+#include "octree.hpp"
+
+#include <cstdio>
+#include <unordered_map>
+
+namespace {
+    struct OctFlattener {
+        Octree *tree;
+        std::unordered_map<Shape*, uint32_t> primIds;
+        // Set if a node doesn't look like it came from generateOctreeHierarchy (children that aren't octants, or shapes alongside them).
+        bool notOctree;
+
+        // Shapes spanning more than one octant appear in each, but are only stored once.
+        uint32_t primId(Shape *s) {
+            auto it = primIds.find(s);
+            if (it != primIds.end()) return it->second;
+            uint32_t id = tree->prims.size();
+            tree->prims.emplace_back(s);
+            primIds[s] = id;
+            return id;
+        }
+
+        // generateOctreeHierarchy numbers each octant's Container (or the one it was split into) 11-18 ((parentId*10)+i+1, with parentId 1).
+        // Going by this rather than where its cell is means octants of a cell that's flat along an axis can still be told apart.
+        int octant(Container *c) {
+            int o = c->id - 11;
+            if (o < 0 || o > 7) return -1;
+            return o;
+        }
+
+        // Fills in nodes[idx] from "c".
+        void node(Container *c, uint32_t idx) {
+            Container *children[8] = {NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL};
+            int childMask = 0;
+            std::vector<Shape*> shapes;
+            if (c->size > 0) {
+                Bound *bo = c->start;
+                while (bo != c->end->next) {
+                    if (bo->s != NULL && !(bo->s->debug)) {
+                        Container *sub = dynamic_cast<Container*>(bo->s);
+                        if (sub == nullptr) {
+                            shapes.emplace_back(bo->s);
+                        } else {
+                            int o = octant(sub);
+                            if (o == -1 || children[o] != NULL) {
+                                notOctree = true;
+                                return;
+                            }
+                            children[o] = sub;
+                            childMask |= 1 << o;
+                        }
+                    }
+                    bo = bo->next;
+                }
+            }
+            if (childMask != 0 && !shapes.empty()) {
+                notOctree = true;
+                return;
+            }
+            if (childMask == 0) {
+                OctNode *n = &(tree->nodes[idx]);
+                n->offset = tree->primIndices.size();
+                n->primCount = shapes.size();
+                n->childMask = 0;
+                for (Shape *s: shapes) {
+                    tree->primIndices.emplace_back(primId(s));
+                }
+                return;
+            }
+
+            uint32_t first = tree->nodes.size();
+            tree->nodes.resize(first + std::popcount(uint32_t(childMask)));
+            OctNode *n = &(tree->nodes[idx]);
+            n->offset = first;
+            n->primCount = 0;
+            n->childMask = childMask;
+            uint32_t next = first;
+            for (int o = 0; o < 8; o++) {
+                if (children[o] != NULL) node(children[o], next++);
+            }
+        }
+    };
+}
+
+Octree *flattenOctree(Container *root) {
+    if (root == NULL) return NULL;
+    Octree *tree = new Octree();
+    tree->min = root->min;
+    tree->max = root->max;
+    tree->nodes.resize(1);
+    OctFlattener f = {tree, {}, false};
+    f.node(root, 0);
+    if (f.notOctree) {
+        std::printf("Hierarchy can't be flattened to an octree (not split like one)\n");
+        delete tree;
+        return NULL;
+    }
+    tree->nodes.shrink_to_fit();
+    tree->primIndices.shrink_to_fit();
+    tree->prims.shrink_to_fit();
+    return tree;
+}
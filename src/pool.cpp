@@ -0,0 +1,159 @@
+#include "pool.hpp"
+
+#include <algorithm>
+
+namespace {
+    using Clock = std::chrono::steady_clock;
+    // Index of the current thread in the pool that owns it, or -1 for threads outside a pool.
+    thread_local int workerIndex = -1;
+    thread_local ThreadPool *workerPool = NULL;
+    // Number of jobs the current thread is inside of, as jobs can run others while waiting.
+    thread_local int jobDepth = 0;
+    // Time the current thread has spent blocked in wait(), so it can be taken out of the job's busy time.
+    thread_local int64_t blockedTime = 0;
+
+    int64_t since(Clock::time_point t) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - t).count();
+    }
+}
+
+ThreadPool::ThreadPool(int nthreads) {
+    stopping = false;
+    nworkers = 0;
+    start(nthreads);
+}
+
+ThreadPool::~ThreadPool() {
+    stop();
+}
+
+void ThreadPool::start(int nthreads) {
+    if (nthreads == -1) nthreads = std::thread::hardware_concurrency();
+    if (nthreads < 1) nthreads = 1;
+    nworkers = nthreads;
+    busy.reset(new std::atomic<int64_t>[nthreads+1]);
+    resetStats();
+    workers.reserve(nthreads);
+    for (int i = 0; i < nthreads; i++) {
+        workers.emplace_back(&ThreadPool::worker, this, i);
+    }
+}
+
+void ThreadPool::stop() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    jobAvailable.notify_all();
+    for (auto &w: workers) {
+        w.join();
+    }
+    workers.clear();
+    nworkers = 0;
+    std::lock_guard<std::mutex> guard(lock);
+    stopping = false;
+}
+
+void ThreadPool::resize(int nthreads) {
+    std::lock_guard<std::mutex> guard(resizeLock);
+    stop();
+    start(nthreads);
+}
+
+void ThreadPool::submit(JobGroup *g, std::function<void()> job) {
+    g->pending++;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        jobs.push_back({g, std::move(job)});
+    }
+    jobAvailable.notify_one();
+    jobDone.notify_all();
+}
+
+void ThreadPool::run(Job &job) {
+    // Only time the outermost job, nested ones are already included in it.
+    bool outer = jobDepth++ == 0;
+    Clock::time_point t = Clock::now();
+    int64_t blockedBefore = blockedTime;
+    job.fn();
+    jobDepth--;
+    if (outer) {
+        int slot = (workerPool == this) ? workerIndex : nworkers;
+        busy[slot] += since(t) - (blockedTime - blockedBefore);
+    }
+    // Take the lock before notifying, otherwise a waiter could check pending, then miss the notification before it sleeps.
+    if (--(job.g->pending) == 0) {
+        std::lock_guard<std::mutex> guard(lock);
+        jobDone.notify_all();
+    }
+}
+
+// Runs a single queued job on the calling thread, returns false if there were none.
+bool ThreadPool::runOne() {
+    Job job;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (jobs.empty()) return false;
+        job = std::move(jobs.front());
+        jobs.pop_front();
+    }
+    run(job);
+    return true;
+}
+
+void ThreadPool::wait(JobGroup *g) {
+    while (g->pending > 0) {
+        if (runOne()) continue;
+        Clock::time_point t = Clock::now();
+        std::unique_lock<std::mutex> guard(lock);
+        jobDone.wait(guard, [&]{ return g->pending == 0 || !jobs.empty(); });
+        blockedTime += since(t);
+    }
+}
+
+std::vector<double> ThreadPool::busyTimes() {
+    std::vector<double> out(nworkers+1);
+    for (int i = 0; i <= nworkers; i++) {
+        out[i] = double(busy[i]) / 1e9;
+    }
+    return out;
+}
+
+void ThreadPool::resetStats() {
+    for (int i = 0; i <= nworkers; i++) {
+        busy[i] = 0;
+    }
+}
+
+void ThreadPool::worker(int index) {
+    workerIndex = index;
+    workerPool = this;
+    while (true) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            jobAvailable.wait(guard, [&]{ return stopping || !jobs.empty(); });
+            if (stopping) return;
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+        run(job);
+    }
+}
+
+uint32_t parallelChunks(ThreadPool *pool, uint32_t n, uint32_t chunk, std::function<void(uint32_t, uint32_t, uint32_t)> fn) {
+    uint32_t count = std::max(uint32_t(1), (n + chunk - 1) / chunk);
+    if (pool == NULL || count == 1) {
+        for (uint32_t c = 0; c < count; c++) {
+            fn(c, c * chunk, std::min(n, (c+1) * chunk));
+        }
+        return count;
+    }
+    JobGroup chunks;
+    for (uint32_t c = 0; c < count; c++) {
+        uint32_t begin = c * chunk, end = std::min(n, begin + chunk);
+        pool->submit(&chunks, [&fn, c, begin, end]() { fn(c, begin, end); });
+    }
+    pool->wait(&chunks);
+    return count;
+}
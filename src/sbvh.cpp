@@ -0,0 +1,414 @@
+#include "sbvh.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include "accel.hpp"
+#include "pool.hpp"
+
+namespace {
+    // Subtrees with fewer references than this are built on the current thread.
+    const uint32_t minParallelBuildSize = 4096;
+
+    // Ref: A reference to a shape (by its index in LinearBVH::prims), with its box clipped to the part of space it's been split into.
+    struct Ref {
+        Vec3 min, max;
+        uint32_t prim;
+        float centroid(int axis) const { return 0.5f * (min(axis) + max(axis)); };
+    };
+
+    void growBound(Bound *b, Vec3 min, Vec3 max) {
+        for (int i = 0; i < 3; i++) {
+            b->min(i) = std::min(b->min(i), min(i));
+            b->max(i) = std::max(b->max(i), max(i));
+        }
+    }
+
+    // Bounds of the part of triangle "t" between lo and hi on "axis", found by clipping it against each plane in turn (Sutherland-Hodgman).
+    // Inverted if nothing's left.
+    Bound clipTriangle(const Triangle *t, int axis, float lo, float hi) {
+        // Each plane can add at most one vertex.
+        Vec3 poly[2][5] = {{t->a, t->b, t->c}};
+        int n = 3;
+        int cur = 0;
+        for (int side = 0; side < 2 && n > 0; side++) {
+            int next = 0;
+            for (int i = 0; i < n; i++) {
+                Vec3 p = poly[cur][i], q = poly[cur][(i+1) % n];
+                // Distance inside the plane, for the lower plane and then the upper.
+                float dp = side == 0 ? p(axis) - lo : hi - p(axis);
+                float dq = side == 0 ? q(axis) - lo : hi - q(axis);
+                if (dp >= 0.f) poly[1-cur][next++] = p;
+                if ((dp < 0.f) != (dq < 0.f)) {
+                    Vec3 x = p + (dp / (dp - dq)) * (q - p);
+                    // Exactly on the plane, whatever rounding says.
+                    x(axis) = side == 0 ? lo : hi;
+                    poly[1-cur][next++] = x;
+                }
+            }
+            cur = 1 - cur;
+            n = next;
+        }
+        Bound b = Bound::forGrowing();
+        for (int i = 0; i < n; i++) {
+            growBound(&b, poly[cur][i], poly[cur][i]);
+        }
+        return b;
+    }
+
+    struct SBVHBuilder {
+        LinearBVH *bvh;
+        // Cost of intersecting each shape, and the shape as a Triangle if it is one (so it can be clipped exactly), indexed like prims.
+        std::vector<float> costs;
+        std::vector<const Triangle*> tris;
+        ThreadPool *pool;
+        int maxDepth, maxLeafSize, nBins;
+        // Surface area the children of an object split must overlap by before a spatial split's tried.
+        float minOverlap;
+        // Next free node (children are allocated in pairs) and entry of primIndices.
+        std::atomic<uint32_t> nodeCount;
+        std::atomic<uint32_t> indexCount;
+        // References that can still be made on top of one per shape.
+        std::atomic<int64_t> duplicatesLeft;
+        std::atomic<int> stackDepth;
+
+        struct Split {
+            float cost = 1e30f;
+            int axis = -1;
+            int bin = 0;
+            bool spatial = false;
+            // Bounds and total cost of each side.
+            Bound left, right;
+            float leftCost, rightCost;
+        };
+
+        int bin(float v, float min, float scale) {
+            return std::clamp(int((v - min) * scale), 0, nBins-1);
+        }
+
+        // The part of "r" between lo and hi on "axis".
+        Ref clip(const Ref &r, int axis, float lo, float hi) {
+            Ref out = r;
+            const Triangle *t = tris[r.prim];
+            if (t != NULL) {
+                Bound b = clipTriangle(t, axis, lo, hi);
+                if (b.min(axis) <= b.max(axis)) {
+                    // The triangle's box may have been clipped by earlier splits already.
+                    for (int i = 0; i < 3; i++) {
+                        out.min(i) = std::max(out.min(i), b.min(i));
+                        out.max(i) = std::min(out.max(i), b.max(i));
+                    }
+                }
+            }
+            out.min(axis) = std::max(out.min(axis), lo);
+            out.max(axis) = std::min(out.max(axis), hi);
+            return out;
+        }
+
+        void leaf(BVHNode *n, const std::vector<Ref> &refs) {
+            uint32_t offset = indexCount.fetch_add(refs.size());
+            for (size_t i = 0; i < refs.size(); i++) {
+                bvh->primIndices[offset + i] = refs[i].prim;
+            }
+            n->offset = offset;
+            n->primCount = refs.size();
+            n->childCount = 0;
+            n->axis = UINT8_MAX;
+        }
+
+        // Binned SAH over the references' centroids, as buildLinearBVH does.
+        void objectSplit(const std::vector<Ref> &refs, const Bound &centroids, float parentSA, Split *best) {
+            struct Bin {
+                Bound bound;
+                float cost;
+                uint32_t count;
+            };
+            std::vector<Bin> bins(nBins);
+            std::vector<Bound> rightBounds(nBins);
+            std::vector<float> rightCosts(nBins);
+            for (int axis = 0; axis < 3; axis++) {
+                float extent = centroids.max(axis) - centroids.min(axis);
+                if (extent <= 0.f) continue;
+                float scale = float(nBins) / extent;
+                std::fill(bins.begin(), bins.end(), Bin{Bound::forGrowing(), 0.f, 0});
+                for (const Ref &r: refs) {
+                    Bin *b = &(bins[bin(r.centroid(axis), centroids.min(axis), scale)]);
+                    growBound(&(b->bound), r.min, r.max);
+                    b->cost += costs[r.prim];
+                    b->count++;
+                }
+                Bound right = Bound::forGrowing();
+                float rightCost = 0.f;
+                for (int i = nBins-1; i > 0; i--) {
+                    right.grow(&(bins[i].bound));
+                    rightCost += bins[i].cost;
+                    rightBounds[i] = right;
+                    rightCosts[i] = rightCost;
+                }
+                Bound left = Bound::forGrowing();
+                float leftCost = 0.f;
+                uint32_t leftCount = 0;
+                for (int i = 0; i < nBins-1; i++) {
+                    left.grow(&(bins[i].bound));
+                    leftCost += bins[i].cost;
+                    leftCount += bins[i].count;
+                    if (leftCount == 0 || leftCount == refs.size()) continue;
+                    float cost = 1.f + (aabbSA(left.min, left.max)*leftCost + aabbSA(rightBounds[i+1].min, rightBounds[i+1].max)*rightCosts[i+1]) / parentSA;
+                    if (cost < best->cost) {
+                        *best = {cost, axis, i, false, left, rightBounds[i+1], leftCost, rightCosts[i+1]};
+                    }
+                }
+            }
+        }
+
+        // Binned SAH over equal-width slabs of the node's box, with each reference clipped into every slab it crosses.
+        // A reference counts towards the cost of each side it ends up in.
+        void spatialSplit(const std::vector<Ref> &refs, const Bound &box, float parentSA, Split *best) {
+            struct Bin {
+                Bound bound;
+                float entryCost, exitCost;
+                uint32_t entries, exits;
+            };
+            std::vector<Bin> bins(nBins);
+            std::vector<Bound> rightBounds(nBins);
+            std::vector<float> rightCosts(nBins);
+            std::vector<uint32_t> rightCounts(nBins);
+            for (int axis = 0; axis < 3; axis++) {
+                float lo = box.min(axis);
+                float extent = box.max(axis) - lo;
+                if (extent <= 0.f) continue;
+                float scale = float(nBins) / extent;
+                std::fill(bins.begin(), bins.end(), Bin{Bound::forGrowing(), 0.f, 0.f, 0, 0});
+                for (const Ref &r: refs) {
+                    int first = bin(r.min(axis), lo, scale);
+                    int last = bin(r.max(axis), lo, scale);
+                    bins[first].entryCost += costs[r.prim];
+                    bins[first].entries++;
+                    bins[last].exitCost += costs[r.prim];
+                    bins[last].exits++;
+                    for (int i = first; i <= last; i++) {
+                        if (first == last) {
+                            growBound(&(bins[i].bound), r.min, r.max);
+                        } else {
+                            Ref c = clip(r, axis, lo + i/scale, i == nBins-1 ? box.max(axis) : lo + (i+1)/scale);
+                            growBound(&(bins[i].bound), c.min, c.max);
+                        }
+                    }
+                }
+                Bound right = Bound::forGrowing();
+                float rightCost = 0.f;
+                uint32_t rightCount = 0;
+                for (int i = nBins-1; i > 0; i--) {
+                    right.grow(&(bins[i].bound));
+                    rightCost += bins[i].exitCost;
+                    rightCount += bins[i].exits;
+                    rightBounds[i] = right;
+                    rightCosts[i] = rightCost;
+                    rightCounts[i] = rightCount;
+                }
+                Bound left = Bound::forGrowing();
+                float leftCost = 0.f;
+                uint32_t leftCount = 0;
+                for (int i = 0; i < nBins-1; i++) {
+                    left.grow(&(bins[i].bound));
+                    leftCost += bins[i].entryCost;
+                    leftCount += bins[i].entries;
+                    if (leftCount == 0 || rightCounts[i+1] == 0) continue;
+                    float cost = 1.f + (aabbSA(left.min, left.max)*leftCost + aabbSA(rightBounds[i+1].min, rightBounds[i+1].max)*rightCosts[i+1]) / parentSA;
+                    if (cost < best->cost) {
+                        *best = {cost, axis, i, true, left, rightBounds[i+1], leftCost, rightCosts[i+1]};
+                    }
+                }
+            }
+        }
+
+        // Sorts the references to either side of a spatial split. One crossing the split is only duplicated if that's cheaper than
+        // moving it entirely to one side ("reference unsplitting"), and there's budget left for it.
+        void partitionSpatial(std::vector<Ref> &refs, const Bound &box, const Split &s, std::vector<Ref> *left, std::vector<Ref> *right) {
+            float lo = box.min(s.axis);
+            float scale = float(nBins) / (box.max(s.axis) - lo);
+            float plane = lo + (s.bin+1)/scale;
+            Bound lb = s.left, rb = s.right;
+            float lc = s.leftCost, rc = s.rightCost;
+            for (const Ref &r: refs) {
+                int first = bin(r.min(s.axis), lo, scale);
+                int last = bin(r.max(s.axis), lo, scale);
+                if (last <= s.bin) {
+                    left->emplace_back(r);
+                    continue;
+                } else if (first > s.bin) {
+                    right->emplace_back(r);
+                    continue;
+                }
+                float cost = costs[r.prim];
+                Bound lr = lb, rr = rb;
+                growBound(&lr, r.min, r.max);
+                growBound(&rr, r.min, r.max);
+                float splitCost = aabbSA(lb.min, lb.max)*lc + aabbSA(rb.min, rb.max)*rc;
+                float leftOnly = aabbSA(lr.min, lr.max)*lc + aabbSA(rb.min, rb.max)*(rc - cost);
+                float rightOnly = aabbSA(lb.min, lb.max)*(lc - cost) + aabbSA(rr.min, rr.max)*rc;
+                bool duplicate = splitCost < std::min(leftOnly, rightOnly);
+                if (duplicate && duplicatesLeft.fetch_sub(1) <= 0) {
+                    duplicatesLeft++;
+                    duplicate = false;
+                }
+                if (duplicate) {
+                    left->emplace_back(clip(r, s.axis, r.min(s.axis), plane));
+                    right->emplace_back(clip(r, s.axis, plane, r.max(s.axis)));
+                } else if (leftOnly <= rightOnly) {
+                    left->emplace_back(r);
+                    lb = lr;
+                    rc -= cost;
+                } else {
+                    right->emplace_back(r);
+                    rb = rr;
+                    lc -= cost;
+                }
+            }
+        }
+
+        // Builds nodes[idx] from "refs" (which it empties). "entries" is the number of entries already on the traversal stack when it's visited.
+        void node(uint32_t idx, std::vector<Ref> &refs, int depth, int entries) {
+            BVHNode *n = &(bvh->nodes[idx]);
+            Bound box = Bound::forGrowing();
+            Bound centroids = Bound::forGrowing();
+            float leafCost = 0.f;
+            for (const Ref &r: refs) {
+                growBound(&box, r.min, r.max);
+                Vec3 c = {r.centroid(0), r.centroid(1), r.centroid(2)};
+                growBound(&centroids, c, c);
+                leafCost += costs[r.prim];
+            }
+            n->min = box.min;
+            n->max = box.max;
+            uint32_t count = refs.size();
+            // A leaf can't hold more than UINT16_MAX references, so past that we have to keep splitting.
+            bool mustSplit = count > UINT16_MAX;
+            if (count <= 1 || (depth >= maxDepth && !mustSplit)) {
+                leaf(n, refs);
+                return;
+            }
+
+            float parentSA = aabbSA(box.min, box.max);
+            Split best;
+            objectSplit(refs, centroids, parentSA, &best);
+            // Only worth trying to split space where the children of an object split would overlap, e.g. around large shapes.
+            if (duplicatesLeft > 0 && parentSA > 0.f) {
+                Bound overlap = best.left;
+                for (int i = 0; i < 3; i++) {
+                    overlap.min(i) = std::max(best.left.min(i), best.right.min(i));
+                    overlap.max(i) = std::min(best.left.max(i), best.right.max(i));
+                }
+                bool overlaps = best.axis == -1 || (overlap.min.x <= overlap.max.x && overlap.min.y <= overlap.max.y && overlap.min.z <= overlap.max.z && aabbSA(overlap.min, overlap.max) > minOverlap);
+                if (overlaps) spatialSplit(refs, box, parentSA, &best);
+            }
+
+            if (!mustSplit && (best.axis == -1 || (int(count) <= maxLeafSize && best.cost >= leafCost))) {
+                leaf(n, refs);
+                return;
+            }
+
+            std::vector<Ref> left, right;
+            if (best.spatial) {
+                partitionSpatial(refs, box, best, &left, &right);
+                n->axis = best.axis;
+            }
+            if (!best.spatial || left.empty() || right.empty()) {
+                left.clear();
+                right.clear();
+                if (best.axis == -1 || best.spatial) {
+                    // Every centroid's in the same place (or the spatial split came to nothing), so any split is as good as another.
+                    left.assign(refs.begin(), refs.begin() + count/2);
+                    right.assign(refs.begin() + count/2, refs.end());
+                    n->axis = UINT8_MAX;
+                } else {
+                    float cmin = centroids.min(best.axis);
+                    float scale = float(nBins) / (centroids.max(best.axis) - cmin);
+                    for (const Ref &r: refs) {
+                        if (bin(r.centroid(best.axis), cmin, scale) <= best.bin) left.emplace_back(r);
+                        else right.emplace_back(r);
+                    }
+                    // Left holds the lower bins, so children are already in the order traversal expects.
+                    n->axis = best.axis;
+                }
+            }
+            std::vector<Ref>().swap(refs);
+
+            uint32_t children = nodeCount.fetch_add(2);
+            n->offset = children;
+            n->primCount = 0;
+            n->childCount = 2;
+            int deepest = stackDepth;
+            while (entries + 2 > deepest && !stackDepth.compare_exchange_weak(deepest, entries + 2));
+
+            JobGroup leftJob;
+            if (pool != NULL && left.size() >= minParallelBuildSize) {
+                pool->submit(&leftJob, [&, children]() { node(children, left, depth+1, entries+1); });
+            } else {
+                node(children, left, depth+1, entries+1);
+            }
+            node(children+1, right, depth+1, entries+1);
+            if (pool != NULL) pool->wait(&leftJob);
+        }
+    };
+}
+
+LinearBVH *buildSBVH(Container *flat, int maxDepth, int maxLeafSize, float costTriSphereRatio, int nBins, float alpha, ThreadPool *pool) {
+    if (flat == NULL) return NULL;
+    LinearBVH *bvh = new LinearBVH();
+    SBVHBuilder b;
+    b.bvh = bvh;
+    std::vector<Ref> refs;
+    refs.reserve(flat->size);
+    bvh->prims.reserve(flat->size);
+    if (flat->size > 0) {
+        Bound *bo = flat->start;
+        while (bo != flat->end->next) {
+            if (bo->s != NULL && !(bo->s->debug)) {
+                refs.push_back({bo->min, bo->max, uint32_t(bvh->prims.size())});
+                bvh->prims.emplace_back(bo->s);
+                b.costs.emplace_back(shapeCost(bo->s->type(), costTriSphereRatio));
+                Triangle *t = dynamic_cast<Triangle*>(bo->s);
+                b.tris.emplace_back(t != nullptr && !(t->plane) ? t : NULL);
+            }
+            bo = bo->next;
+        }
+    }
+    int64_t maxDuplicates = int64_t(SBVH_MAX_DUPLICATION * refs.size());
+    // A binary tree over n references has at most 2n-1 nodes.
+    size_t maxRefs = refs.size() + maxDuplicates;
+    bvh->nodes.resize(std::max(size_t(1), 2*maxRefs));
+    bvh->primIndices.resize(maxRefs);
+    countBuildMemory(sizeof(LinearBVH) + bvh->prims.capacity()*sizeof(Shape*) + bvh->nodes.capacity()*sizeof(BVHNode) + bvh->primIndices.capacity()*sizeof(uint32_t), 4);
+
+    b.pool = pool;
+    b.maxDepth = maxDepth;
+    b.maxLeafSize = std::max(1, maxLeafSize);
+    b.nBins = std::clamp(nBins, 2, BVH_MAX_BINS);
+    b.minOverlap = alpha * aabbSA(flat->min, flat->max);
+    b.nodeCount = 1;
+    b.indexCount = 0;
+    b.duplicatesLeft = maxDuplicates;
+    b.stackDepth = 1;
+    if (refs.empty()) {
+        bvh->nodes[0].min = flat->min;
+        bvh->nodes[0].max = flat->max;
+        b.leaf(&(bvh->nodes[0]), refs);
+    } else {
+        b.node(0, refs, 0, 0);
+    }
+    int64_t freed = (bvh->nodes.size() - b.nodeCount) * sizeof(BVHNode) + (bvh->primIndices.size() - b.indexCount) * sizeof(uint32_t);
+    bvh->nodes.resize(b.nodeCount);
+    bvh->nodes.shrink_to_fit();
+    bvh->primIndices.resize(b.indexCount);
+    bvh->primIndices.shrink_to_fit();
+    countBuildMemory(-freed, 0);
+    bvh->stackDepth = b.stackDepth;
+
+    if (bvh->stackDepth > BVH_STACK_SIZE) {
+        std::printf("Hierarchy can't be traversed (needs a stack of %d)\n", bvh->stackDepth);
+        delete bvh;
+        return NULL;
+    }
+    return bvh;
+}
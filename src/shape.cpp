@@ -216,6 +216,21 @@ Material *Decoder::decodeMaterial(std::string in, bool definition) {
     return m;
 }
 
+void Decoder::collectTextures(std::string in, std::vector<std::string> *t, std::vector<std::string> *n, std::vector<std::string> *r) {
+    std::stringstream stream(in);
+    do {
+        std::string w;
+        stream >> w;
+        if (w == w_tex) {
+            t->emplace_back(collectWordOrString(stream));
+        } else if (w == w_norm) {
+            n->emplace_back(collectWordOrString(stream));
+        } else if (w == w_refmap) {
+            r->emplace_back(collectWordOrString(stream));
+        }
+    } while (stream);
+}
+
 /*std::string Decoder::encodeSphere(Shape *sh) {
     std::ostringstream fmt;
     fmt << "sphere ";
@@ -662,8 +677,6 @@ int Container::clear(bool deleteShapes) {
     Bound *bo = start;
     Bound *e = NULL;
     if (end != NULL) e = end->next;
-    int boundCounter = 0;
-    int boundLimit = voxelSubdiv*voxelSubdiv*voxelSubdiv;
     while (bo != e) {
         Shape *current = bo->s;
         freeCounter += current->clear(deleteShapes);
@@ -679,19 +692,9 @@ int Container::clear(bool deleteShapes) {
         }
 
         Bound *next = bo->next;
-        if (voxelSubdiv != 0) {
-            next = bo + 1;
-            boundCounter++;
-            if (boundCounter >= boundLimit) next = NULL;
-        } else {
-            delete bo;
-        }
+        delete bo;
         bo = next;
     }
-    // Voxel containers have their "start" set to a voxelSubdiv^3 size array.
-    if (voxelSubdiv != 0) {
-        delete[] start;
-    }
     size = 0;
     start = NULL;
     end = NULL;
@@ -781,7 +784,7 @@ void AAB::bounds(Bound *bo) {
     bo->centroid = min + 0.5f * (max - min);
 }
 
-float AAB::intersect(Vec3 p0, Vec3 delta, Vec3 *normal, Vec2 *uv, float *t1, Vec3 *normal1, Vec2 *uv1) {
+float AAB::intersect(const Ray &r, Vec3 *normal, Vec2 *uv, float *t1, Vec3 *normal1, Vec2 *uv1) {
     // Based on the "slab method".
     // Find the distance along (delta) you'd have to travel to hit the planes of each pair of parallel faces,
     // then select the largest distance to one of the nearer faces, and the shortest distance to one of the furthest faces.
@@ -789,20 +792,20 @@ float AAB::intersect(Vec3 p0, Vec3 delta, Vec3 *normal, Vec2 *uv, float *t1, Vec
     // Where the ray actually intersects the AABB, the latter (furthest) should be greater than the former (nearest).
     // and therefore if a nearer face appears to be closer than a farther face, we do not intersect.
     
-    // Pre-divide, since multiplication is faster and we use it twice
-    float d[3] = {1.f/delta.x, 1.f/delta.y, 1.f/delta.z};
+    // The ray's reciprocal direction and signs are precomputed, so the near and far planes are known without dividing or comparing.
+    const Vec3 &p0 = r.p0;
+    const Vec3 &delta = r.delta;
+    Vec3 bounds[2] = {min, max};
     float tmin = -9999.f;
     float tmax = 9999.f;
     int nminIdx = -1, nmaxIdx = -1;
     for (int i = 0; i < 3; i++) {
-        float t0 = (min(i) - p0(i)) * d[i];
-        float t1 = (max(i) - p0(i)) * d[i];
-        float mn = std::min(t0, t1);
+        float mn = (bounds[r.sign[i]](i) - p0(i)) * r.invDelta(i);
+        float mx = (bounds[1-r.sign[i]](i) - p0(i)) * r.invDelta(i);
         if (mn >= tmin) {
             tmin = mn;
             nminIdx = i;
         }
-        float mx = std::max(t0, t1);
         if (mx <= tmax) {
             tmax = mx;
             nmaxIdx = i;
@@ -836,34 +839,8 @@ float AAB::intersect(Vec3 p0, Vec3 delta, Vec3 *normal, Vec2 *uv, float *t1, Vec
     // normal->idx(normIdx) = 1.f;
 }
 
-// Note: this is essentially the same impl as above, except with no normal/UV stuff. Used for BVHs and such.
-// Putting it here rather than "ray" or something so that the two versions are centralised.
-float meetAABB(Vec3 p0, Vec3 delta, Vec3 a, Vec3 b) {
-    // Based on the "slab method".
-    // Find the distance along (delta) you'd have to travel to hit the planes of each pair of parallel faces,
-    // then select the largest distance to one of the nearer faces, and the shortest distance to one of the furthest faces.
-    // If the latter is negative, we're looking in the wrong direction.
-    // Where the ray actually intersects the AABB, the latter (furthest) should be greater than the former (nearest).
-    // and therefore if a nearer face appears to be closer than a farther face, we do not intersect.
-    
-    // Pre-divide, since multiplication is faster and we have a loop
-    float d[3] = {1.f/delta.x, 1.f/delta.y, 1.f/delta.z};
-    float tmin = -9999.f;
-    float tmax = 9999.f;
-    for (int i = 0; i < 3; i++) {
-        float t0 = (a(i) - p0(i)) * d[i];
-        float t1 = (b(i) - p0(i)) * d[i];
-        tmin = std::max(tmin, std::min(t0, t1));
-        tmax = std::min(tmax, std::max(t0, t1));
-    }
-
-    if (tmax < 0) return -9999.f;
-    if (tmin > tmax) return -9998.f;
-    return tmin;
-}
-
-bool AAB::intersects(Vec3 p0, Vec3 delta) {
-    return intersect(p0, delta) < -9990.f ? false : true;
+bool AAB::intersects(const Ray &r) {
+    return intersect(r) < -9990.f ? false : true;
 }
 
 Vec2 AAB::getUV(Vec3 hit, Vec3 normal) {
@@ -976,11 +953,13 @@ void Sphere::bounds(Bound *bo) {
     bo->centroid = center;
 };
 
-float Sphere::intersect(Vec3 p0, Vec3 delta, Vec3 *normal, Vec2 *uv, float *t1, Vec3 *normal1, Vec2 *uv1) {
+float Sphere::intersect(const Ray &r, Vec3 *normal, Vec2 *uv, float *t1, Vec3 *normal1, Vec2 *uv1) {
     // CG:PaP 2nd ed. in C, p. 703, eq. 15.17 is an expanded sphere equation with
     // substituted values for the camera position (x/y/z_0),
     // pixel vec from camera (delta x/y/z),
     // and normalized distance along pixel vector (t).
+    const Vec3 &p0 = r.p0;
+    const Vec3 &delta = r.delta;
     Vec3 originToSphere = p0 - center;
     float a = dot(delta, delta);
     float b = 2.f * dot(delta, originToSphere);
@@ -1018,8 +997,8 @@ float Sphere::intersect(Vec3 p0, Vec3 delta, Vec3 *normal, Vec2 *uv, float *t1,
     return t;
 }
 
-bool Sphere::intersects(Vec3 p0, Vec3 delta) {
-    return intersect(p0, delta) >= 0;
+bool Sphere::intersects(const Ray &r) {
+    return intersect(r) >= 0;
 }
 
 Vec2 Sphere::getUV(Vec3 hit) {
@@ -1078,7 +1057,7 @@ void Sphere::refractSolid(float r0, float r1, Vec3 p0, Vec3 delta, Vec3 *p1, Vec
     tir = true;
     while (tir) {
         p0 = p0 + (EPSILON * r);
-        float t = intersect(p0, r);
+        float t = intersect(Ray(p0, r));
         p0 = p0 + (t * r);
         Vec3 n = -1.f*(p0 - center);
         Vec3 r2 = Refract(r1, r0, r, n, &tir);
@@ -1122,7 +1101,7 @@ void Sphere::refract(float ri, Vec3 p0, Vec3 delta, Vec3 *p1, Vec3 *delta1) {
     innerSphere.thickness = 1.f;
     while (!escaped) {
         // Hit the inner sphere
-        float t = innerSphere.intersect(*p1, *delta1);
+        float t = innerSphere.intersect(Ray(*p1, *delta1));
         if (t < 0) { // Missing the internal sphere means we can ignore it entirely.
             refractSolid(RI_AIR, ri, p0, delta, p1, delta1);
             return;
@@ -1134,7 +1113,7 @@ void Sphere::refract(float ri, Vec3 p0, Vec3 delta, Vec3 *p1, Vec3 *delta1) {
         *p1 = p2;
         *delta1 = r;
         // Hit the outer sphere
-        t = intersect(*p1, *delta1);
+        t = intersect(Ray(*p1, *delta1));
         *p1 = *p1 + (t * *delta1);
         normal = -1.f * (*p1 - center);
         // Out of the outer sphere (RI_SPHERE -> RI_AIR)
@@ -1184,17 +1163,17 @@ Vec3 Triangle::visibleNormal(Vec3 delta) {
     else return norm(cross(a-c, b-c));
 }
 
-float Triangle::intersectsPlane(Vec3 p0, Vec3 delta, Vec3 normal) {
+float Triangle::intersectsPlane(const Ray &r, Vec3 normal) {
     // dot product of a line on the plane with the normal is zero, hence (p - t.a) \dot norm = 0, where p is a random point (x, y, z)
     // p \dot norm = t.a \dot norm
     // (p0 + t(delta)) \dot norm = t.a \dot norm
     // t(delta \dot norm) = (t.a - p0) \dot norm
     // divide and get t!
-    float denom = dot(normal, delta);
+    float denom = dot(normal, r.delta);
     if (denom == 0) { // Plane parallel to ray, ignore
         return -1;
     }
-    return dot((a - p0), normal) / denom;
+    return dot((a - r.p0), normal) / denom;
 }
 
 bool Triangle::projectAndPiP(Vec3 normal, Vec3 hit) {
@@ -1283,17 +1262,17 @@ bool Triangle::PiP(Vec2 projHit, Vec2 projA, Vec2 projB, Vec2 projC) {
 // Default method: Muller-Trumbore
 // Faster triangle collision algorithm which calculates barycentric coordinates to determine t.
 // https://en.wikipedia.org/wiki/M%C3%B6ller%E2%80%93Trumbore_intersection_algorithm
-float Triangle::intersectMT(Vec3 p0, Vec3 delta, Vec3 *bary) {
+float Triangle::intersectMT(const Ray &r, Vec3 *bary) {
     Vec3 e1 = b - a;
     Vec3 e2 = c - a;
-    Vec3 rayEdge = cross(delta, e2);
+    Vec3 rayEdge = cross(r.delta, e2);
     float det = dot(e1, rayEdge);
 
     // Uncomment for sided-ness
     // if (det <= 0.f) return -1.f;
 
     float invDet = 1.f / det;
-    Vec3 ap0 = p0 - a;
+    Vec3 ap0 = r.p0 - a;
     // u
     bary->x = invDet * dot(ap0, rayEdge);
 
@@ -1301,7 +1280,7 @@ float Triangle::intersectMT(Vec3 p0, Vec3 delta, Vec3 *bary) {
 
     Vec3 ap0Edge = cross(ap0, e1);
     // v
-    bary->y = invDet * dot(delta, ap0Edge);
+    bary->y = invDet * dot(r.delta, ap0Edge);
 
     if (bary->y < 0.f || bary->x + bary->y > 1.f) return -1.f;
 
@@ -1320,23 +1299,23 @@ float Triangle::intersectMT(Vec3 p0, Vec3 delta, Vec3 *bary) {
 // intersected, only their plane was, but the potential for a collision recorded and used too
 // decide whether to cast another ray through a transparent object.
 // While the old tri collision is mostly useless now, potentially add back?
-float Triangle::intersect(Vec3 p0, Vec3 delta, Vec3 *normal, Vec2 *uv, float* /*t1*/, Vec3* /*normal1*/, Vec2* /*uv1*/) {
+float Triangle::intersect(const Ray &r, Vec3 *normal, Vec2 *uv, float* /*t1*/, Vec3* /*normal1*/, Vec2* /*uv1*/) {
     // FIXME: Normal calculation might not be necessary
-    Vec3 n = visibleNormal(delta);
+    Vec3 n = visibleNormal(r.delta);
     if (normal != NULL) *normal = n;
 #ifdef PREFER_MT
     if (!plane) {
         Vec3 bary;
-        float t = intersectMT(p0, delta, &bary);
+        float t = intersectMT(r, &bary);
         if (uv != NULL && material != NULL && material->hasTexture()) {
             *uv = bary.z*UVs[0] + bary.x*UVs[1] + bary.y*UVs[2];
         }
         return t;
     } else {
 #endif
-        float t = intersectsPlane(p0, delta, n);
+        float t = intersectsPlane(r, n);
         if (t < 0) return t;
-        Vec3 hit = p0 + (t * delta);
+        Vec3 hit = r.p0 + (t * r.delta);
         if (plane || projectAndPiP(norm(n), hit)) {
             return t;
         }
@@ -1346,8 +1325,8 @@ float Triangle::intersect(Vec3 p0, Vec3 delta, Vec3 *normal, Vec2 *uv, float* /*
 #endif
 };
 
-bool Triangle::intersects(Vec3 p0, Vec3 delta) {
-    return intersect(p0, delta, NULL, NULL) >= 0;
+bool Triangle::intersects(const Ray &r) {
+    return intersect(r, NULL, NULL) >= 0;
 }
 
 void Triangle::applyTransform() {
@@ -1441,26 +1420,26 @@ void CSG::bounds(Bound *bo) {
     std::memcpy(bo, &gb, sizeof(Bound));
 };
 
-float CSG::intersect(Vec3 p0, Vec3 delta, Vec3 *normal, Vec2 *uv, float *t1, Vec3* normal1, Vec2* uv1) {
+float CSG::intersect(const Ray &r, Vec3 *normal, Vec2 *uv, float *t1, Vec3* normal1, Vec2* uv1) {
     switch (relation) {
         case Union:
-            return intersectUnion(p0, delta, normal, uv, t1, normal1, uv1);
+            return intersectUnion(r, normal, uv, t1, normal1, uv1);
         case Difference:
         case DifferenceHollowSubject:
-            return intersectDifference(p0, delta, normal, uv, t1, normal1, uv1);
+            return intersectDifference(r, normal, uv, t1, normal1, uv1);
         case Intersection:
-            return intersectIntersection(p0, delta, normal, uv, t1, normal1, uv1);
+            return intersectIntersection(r, normal, uv, t1, normal1, uv1);
     }
     return -1;
 }
 
-float CSG::intersectUnion(Vec3 p0, Vec3 delta, Vec3 *normal, Vec2 *uv, float* /*t1*/, Vec3* /*normal1*/, Vec2* /*uv1*/) {
+float CSG::intersectUnion(const Ray &r, Vec3 *normal, Vec2 *uv, float* /*t1*/, Vec3* /*normal1*/, Vec2* /*uv1*/) {
     Vec3 n;
     Vec2 u;
     Vec3 *nptr = normal == NULL ? NULL : &n;
     Vec2 *uptr = uv == NULL ? NULL : &u;
-    float tA = a->intersect(p0, delta, normal, uv);
-    float tB = b->intersect(p0, delta, nptr, uptr);
+    float tA = a->intersect(r, normal, uv);
+    float tB = b->intersect(r, nptr, uptr);
     // FIXME: Correctly set t1, normal1 and uv1 by getting them from A and B!
     if (tA > 0 && (tB < 0 || tA < tB)) {
         return tA;
@@ -1536,7 +1515,7 @@ int csgDifference(float tA, float t1A, float tB, float t1B, bool hollowSubject)
     return 0;
 }
 
-float CSG::intersectDifference(Vec3 p0, Vec3 delta, Vec3 *normal, Vec2 *uv, float* /*t1*/, Vec3* /*normal1*/, Vec2* /*uv1*/) {
+float CSG::intersectDifference(const Ray &r, Vec3 *normal, Vec2 *uv, float* /*t1*/, Vec3* /*normal1*/, Vec2* /*uv1*/) {
     Vec3 n;
     Vec2 u;
     Vec3 *nptr = normal == NULL ? NULL : &n;
@@ -1553,9 +1532,9 @@ float CSG::intersectDifference(Vec3 p0, Vec3 delta, Vec3 *normal, Vec2 *uv, floa
     Vec2 *u1Bptr = uv == NULL ? NULL : &u1B;
 
     float t1A = -1;
-    float tA = a->intersect(p0, delta, normal, uv, &t1A, n1Aptr, u1Aptr);
+    float tA = a->intersect(r, normal, uv, &t1A, n1Aptr, u1Aptr);
     float t1B = -1;
-    float tB = b->intersect(p0, delta, nptr, uptr, &t1B, n1Bptr, u1Bptr);
+    float tB = b->intersect(r, nptr, uptr, &t1B, n1Bptr, u1Bptr);
     int decision = csgDifference(tA, t1A, tB, t1B, relation == DifferenceHollowSubject ? true : false);
     switch (decision) {
         case 0:
@@ -1590,7 +1569,7 @@ int csgIntersection(float tA, float t1A, float tB, float t1B) {
     return 2;
 }
 
-float CSG::intersectIntersection(Vec3 p0, Vec3 delta, Vec3 *normal, Vec2 *uv, float* /*t1*/, Vec3* /*normal1*/, Vec2* /*uv1*/) {
+float CSG::intersectIntersection(const Ray &r, Vec3 *normal, Vec2 *uv, float* /*t1*/, Vec3* /*normal1*/, Vec2* /*uv1*/) {
     Vec3 n;
     Vec2 u;
     Vec3 *nptr = normal == NULL ? NULL : &n;
@@ -1607,9 +1586,9 @@ float CSG::intersectIntersection(Vec3 p0, Vec3 delta, Vec3 *normal, Vec2 *uv, fl
     Vec2 *u1Bptr = uv == NULL ? NULL : &u1B;
 
     float t1A = -1;
-    float tA = a->intersect(p0, delta, normal, uv, &t1A, n1Aptr, u1Aptr);
+    float tA = a->intersect(r, normal, uv, &t1A, n1Aptr, u1Aptr);
     float t1B = -1;
-    float tB = b->intersect(p0, delta, nptr, uptr, &t1B, n1Bptr, u1Bptr);
+    float tB = b->intersect(r, nptr, uptr, &t1B, n1Bptr, u1Bptr);
     int decision = csgIntersection(tA, t1A, tB, t1B);
     switch (decision) {
         case 0:
@@ -1630,8 +1609,8 @@ float CSG::intersectIntersection(Vec3 p0, Vec3 delta, Vec3 *normal, Vec2 *uv, fl
     return -1;
 }
 
-bool CSG::intersects(Vec3 p0, Vec3 delta) {
-    return intersect(p0, delta, NULL) >= 0;
+bool CSG::intersects(const Ray &r) {
+    return intersect(r, NULL) >= 0;
 }
 
 Vec3 CSG::sampleTexture(Vec2 uv, Texture *tx) {
@@ -1704,7 +1683,9 @@ void Cylinder::bounds(Bound *bo) {
     bo->centroid = center;
 };
 
-float Cylinder::intersect(Vec3 p0, Vec3 delta, Vec3 *normal, Vec2 *uv, float *t1, Vec3 *normal1, Vec2 *uv1) {
+float Cylinder::intersect(const Ray &r, Vec3 *normal, Vec2 *uv, float *t1, Vec3 *normal1, Vec2 *uv1) {
+    const Vec3 &p0 = r.p0;
+    const Vec3 &delta = r.delta;
     float a = 0;
     float b = 0;
     float c = -(radius*radius);
@@ -1749,7 +1730,7 @@ float Cylinder::intersect(Vec3 p0, Vec3 delta, Vec3 *normal, Vec2 *uv, float *t1
         Vec3 capN1;
         Vec2 capU1;
         // The nearest intersection should be the end cap, the farthest will likely be inside the cylinder.
-        t[primaryIdx] = intersectFlatEndCaps(p0, delta, normal, uv, t1 != NULL ? &capT1 : NULL, normal1 != NULL ? &capN1 : NULL, uv1 != NULL ? &capU1 : NULL);
+        t[primaryIdx] = intersectFlatEndCaps(r, normal, uv, t1 != NULL ? &capT1 : NULL, normal1 != NULL ? &capN1 : NULL, uv1 != NULL ? &capU1 : NULL);
         if (capT1 > 0.f) {
             t[!primaryIdx] = capT1;
             if (normal1 != NULL) *normal1 = capN1;
@@ -1782,18 +1763,20 @@ float Cylinder::intersect(Vec3 p0, Vec3 delta, Vec3 *normal, Vec2 *uv, float *t1
     return t[primaryIdx];
 }
 
-float Cylinder::intersectFlatEndCaps(Vec3 p0, Vec3 delta, Vec3 *normal, Vec2 *uv, float *t1, Vec3 *normal1, Vec2 *uv1) {
+float Cylinder::intersectFlatEndCaps(const Ray &r, Vec3 *normal, Vec2 *uv, float *t1, Vec3 *normal1, Vec2 *uv1) {
     // END CAPS: 
     // Solve for ray(axis) hitting center(axis) +/- length.
     // If mag(hit(!axis) - center(!axis)) < radius, cap it!
     // p0(axis) + t*delta(axis) = center(axis) + sign*length
     // t = (center(axis) + sign*length(axis) - p0(axis)) / delta(axis)
     
+    const Vec3 &p0 = r.p0;
+    const Vec3 &delta = r.delta;
     float t[2] = {-1, -1};
     int signs[2] = {-1, 1};
     int idx = 0;
     for (int sign = -1; sign < 2; sign += 2) {
-        t[idx] = (center(axis) + sign*length - p0(axis)) / delta(axis);
+        t[idx] = (center(axis) + sign*length - p0(axis)) * r.invDelta(axis);
         // center of cylinder to collision point
         Vec3 hit = (p0 + t[idx]*delta) - center;
         hit(axis) = 0.f;
@@ -1826,8 +1809,8 @@ float Cylinder::intersectFlatEndCaps(Vec3 p0, Vec3 delta, Vec3 *normal, Vec2 *uv
     return t[0];
 }
 
-bool Cylinder::intersects(Vec3 p0, Vec3 delta) {
-    return intersect(p0, delta) >= 0;
+bool Cylinder::intersects(const Ray &r) {
+    return intersect(r) >= 0;
 }
 
 Vec2 Cylinder::getUV(Vec3 hit) {
@@ -1892,7 +1875,7 @@ void Cylinder::refractSolid(float r0, float r1, Vec3 p0, Vec3 delta, Vec3 *p1, V
     tir = true;
     while (tir) {
         p0 = p0 + (EPSILON * r);
-        float t = intersect(p0, r);
+        float t = intersect(Ray(p0, r));
         p0 = p0 + (t * r);
         Vec3 n = -1.f*(p0 - center);
         n(axis) = 0.f;
@@ -1938,7 +1921,7 @@ void Cylinder::refract(float ri, Vec3 p0, Vec3 delta, Vec3 *p1, Vec3 *delta1) {
     innerSphere.thickness = 1.f;
     while (!escaped) {
         // Hit the inner sphere
-        float t = innerSphere.intersect(*p1, *delta1);
+        float t = innerSphere.intersect(Ray(*p1, *delta1));
         if (t < 0) { // Missing the internal sphere means we can ignore it entirely.
             refractSolid(RI_AIR, ri, p0, delta, p1, delta1);
             return;
@@ -1950,7 +1933,7 @@ void Cylinder::refract(float ri, Vec3 p0, Vec3 delta, Vec3 *p1, Vec3 *delta1) {
         *p1 = p2;
         *delta1 = r;
         // Hit the outer sphere
-        t = intersect(*p1, *delta1);
+        t = intersect(Ray(*p1, *delta1));
         *p1 = *p1 + (t * *delta1);
         normal = -1.f * (*p1 - center);
         normal(axis) = 0.f;
@@ -2011,7 +1994,9 @@ struct Hit {
 
 static Hit emptyHit() { return Hit{-1.f, {0.f, 0.f, 0.f}, 0.f, {0.f, 0.f, 0.f}, {0.f, 0.f}}; };
 
-float Cone::intersect(Vec3 p0, Vec3 delta, Vec3 *normal, Vec2 *uv, float *t1, Vec3 *normal1, Vec2 *uv1) {
+float Cone::intersect(const Ray &r, Vec3 *normal, Vec2 *uv, float *t1, Vec3 *normal1, Vec2 *uv1) {
+    const Vec3 &p0 = r.p0;
+    const Vec3 &delta = r.delta;
     Vec2 *uvPtrs[2] = {uv, uv1};
     Vec3 *normalPtrs[2] = {normal, normal1};
 
@@ -2079,7 +2064,7 @@ float Cone::intersect(Vec3 p0, Vec3 delta, Vec3 *normal, Vec2 *uv, float *t1, Ve
     Hit hc = emptyHit();
     // Distance from p0 to anywhere an axis-aligned distance of (length) away from the tip.
     hc.toCenter = length;
-    hc.t = ((center(axis) + length) - p0(axis)) / delta(axis);
+    hc.t = ((center(axis) + length) - p0(axis)) * r.invDelta(axis);
     hc.calcHit(p0, delta);
     Vec3 centerToHit = hc.hit - center;
     centerToHit(axis) = 0.f;
@@ -2123,8 +2108,8 @@ float Cone::intersect(Vec3 p0, Vec3 delta, Vec3 *normal, Vec2 *uv, float *t1, Ve
     return h[0].t;
 }
 
-bool Cone::intersects(Vec3 p0, Vec3 delta) {
-    return intersect(p0, delta) >= 0;
+bool Cone::intersects(const Ray &r) {
+    return intersect(r) >= 0;
 }
 
 Vec2 Cone::getUV(Vec3 hit) {
@@ -2189,7 +2174,7 @@ void Cone::refractSolid(float r0, float r1, Vec3 p0, Vec3 delta, Vec3 *p1, Vec3
     tir = true;
     while (tir) {
         p0 = p0 + (EPSILON * r);
-        float t = intersect(p0, r);
+        float t = intersect(Ray(p0, r));
         p0 = p0 + (t * r);
         Vec3 n = -1.f*(p0 - center);
         n(axis) = 0.f;
@@ -2235,7 +2220,7 @@ void Cone::refract(float ri, Vec3 p0, Vec3 delta, Vec3 *p1, Vec3 *delta1) {
     innerSphere.thickness = 1.f;
     while (!escaped) {
         // Hit the inner sphere
-        float t = innerSphere.intersect(*p1, *delta1);
+        float t = innerSphere.intersect(Ray(*p1, *delta1));
         if (t < 0) { // Missing the internal sphere means we can ignore it entirely.
             refractSolid(RI_AIR, ri, p0, delta, p1, delta1);
             return;
@@ -2247,7 +2232,7 @@ void Cone::refract(float ri, Vec3 p0, Vec3 delta, Vec3 *p1, Vec3 *delta1) {
         *p1 = p2;
         *delta1 = r;
         // Hit the outer sphere
-        t = intersect(*p1, *delta1);
+        t = intersect(Ray(*p1, *delta1));
         *p1 = *p1 + (t * *delta1);
         normal = -1.f * (*p1 - center);
         normal(axis) = 0.f;
@@ -1,8 +1,11 @@
 #include "test.hpp"
-#include "util.hpp"
+#include "kdtree.hpp"
 #include "ray.hpp"
 #include "vec.hpp"
+#include "widebvh.hpp"
+#include <algorithm>
 #include <chrono>
+#include <cstdio>
 #include <random>
 #include <vector>
 
@@ -18,14 +21,14 @@ Triangle *triList(int n, int *seed) {
     std::mt19937 gen(*seed);
     std::uniform_int_distribution<> distrib(-9998, 9999);
 
-    Triangle *t = (Triangle*)alloc(sizeof(Triangle)*n);
-    if (t == NULL) return t;
+    // Triangles have a vtable, so must be constructed rather than just allocated and filled in.
+    Triangle *t = new Triangle[n];
     for (int i = 0; i < n; i++) {
-        // Triangle is just Vec3 a, b, c, so just treat it as a 9 float array.
+        Vec3 *v[3] = {&(t[i].oA), &(t[i].oB), &(t[i].oC)};
         for (int j = 0; j < 9; j++) {
-            float *v = ((float*)(t+i))+j;
-            *v = float(distrib(gen)) / 1000.f;
+            (*v[j/3])(j%3) = float(distrib(gen)) / 1000.f;
         }
+        t[i].applyTransform();
     }
     return t;
 }
@@ -43,20 +46,90 @@ Sphere *sphereList(int n, int *seed) {
     std::uniform_int_distribution<> center(-9998, 9999);
     std::uniform_int_distribution<> radius(1, 9999);
 
-    Sphere *t = (Sphere*)alloc(sizeof(Sphere)*n);
-    if (t == NULL) return t;
+    Sphere *t = new Sphere[n];
     for (int i = 0; i < n; i++) {
-        // Similar thing as triList, but just for the center Vec3.
         for (int j = 0; j < 3; j++) {
-            float *v = ((float*)(t+i))+j;
-            *v = float(center(gen)) / 1000.f;
+            t[i].oCenter(j) = float(center(gen)) / 1000.f;
         }
-        (t+i)->radius = float(radius(gen)) / 1000.f;
-        (t+i)->thickness = 1.f;
+        t[i].oRadius = float(radius(gen)) / 1000.f;
+        t[i].thickness = 1.f;
+        t[i].applyTransform();
     }
     return t;
 }
 
+std::vector<Shape*> shapeList(int type, int n, int *seed) {
+    int genSeed = 0;
+    if (seed == NULL) {
+        seed = &genSeed;
+    }
+    if (*seed == -9998) {
+        std::random_device rd;
+        *seed = rd();
+    }
+    std::mt19937 gen(*seed);
+    std::uniform_int_distribution<> coord(-9998, 9999);
+    std::uniform_int_distribution<> size(1, 9999);
+    auto point = [&]() { return Vec3{float(coord(gen)) / 1000.f, float(coord(gen)) / 1000.f, float(coord(gen)) / 1000.f}; };
+    auto length = [&]() { return float(size(gen)) / 1000.f; };
+
+    std::vector<Shape*> shapes;
+    for (int i = 0; i < n; i++) {
+        Shape *sh = NULL;
+        if (type == ShapeType::Sphere) {
+            Sphere *s = new Sphere();
+            s->oCenter = point();
+            s->oRadius = length();
+            sh = s;
+        } else if (type == ShapeType::Triangle) {
+            Triangle *t = new Triangle();
+            t->oA = point();
+            t->oB = point();
+            t->oC = point();
+            sh = t;
+        } else if (type == ShapeType::AAB) {
+            AAB *b = new AAB();
+            Vec3 p = point(), q = point();
+            for (int j = 0; j < 3; j++) {
+                b->oMin(j) = std::min(p(j), q(j));
+                b->oMax(j) = std::max(p(j), q(j));
+            }
+            sh = b;
+        } else if (type == ShapeType::CSG) {
+            // Two overlapping spheres, in each of the relations in turn.
+            CSG *c = new CSG();
+            for (int j = 0; j < 2; j++) {
+                Sphere *s = new Sphere();
+                s->oCenter = point();
+                s->oRadius = length();
+                c->append(s);
+            }
+            static_cast<Sphere*>(c->b)->oCenter = static_cast<Sphere*>(c->a)->oCenter + static_cast<Sphere*>(c->a)->oRadius;
+            c->relation = CSG::Relation(i % CSG::RelationCount);
+            sh = c;
+        } else if (type == ShapeType::Cylinder) {
+            Cylinder *cl = new Cylinder();
+            cl->oCenter = point();
+            cl->oRadius = length() / 2.f;
+            cl->oLength = length();
+            cl->axis = i % 3;
+            sh = cl;
+        } else if (type == ShapeType::Cone) {
+            Cone *co = new Cone();
+            co->oCenter = point();
+            co->oRadius = length() / 2.f;
+            co->oLength = length();
+            co->axis = i % 3;
+            sh = co;
+        } else {
+            break;
+        }
+        sh->applyTransform();
+        shapes.emplace_back(sh);
+    }
+    return shapes;
+}
+
 struct SimpleBound {
     Vec3 min, max;
 };
@@ -91,7 +164,7 @@ double traverseAll(Triangle *t, int n) {
         Triangle *tri  = t+i;
         Vec3 ray = rays.at(i);
         Vec3 normal;
-        /*float t = */tri->intersect({0,0,0}, ray, &normal);
+        /*float t = */tri->intersect(Ray({0,0,0}, ray), &normal);
     }
     auto end = std::chrono::high_resolution_clock::now();
     std::chrono::duration<double, std::milli> ms = end - start;
@@ -125,9 +198,124 @@ double traverseAll(Sphere *s, int n) {
         Sphere *sphere = s+i;
         Vec3 ray = rays.at(i);
         Vec3 normal;
-        /*float t = */sphere->intersect({0,0,0}, ray, &normal);
+        /*float t = */sphere->intersect(Ray({0,0,0}, ray), &normal);
     }
     auto end = std::chrono::high_resolution_clock::now();
     std::chrono::duration<double, std::milli> ms = end - start;
     return ms.count();
 }
+
+double traverseAll(const std::vector<Shape*> &shapes, int *seed) {
+    std::vector<Ray> rays;
+
+    // Rays from the origin to random points in the bounds of each shape, as above.
+    int genSeed = 0;
+    if (seed == NULL) {
+        seed = &genSeed;
+    }
+    if (*seed == -9998) {
+        std::random_device rd;
+        *seed = rd();
+    }
+    std::mt19937 gen(*seed);
+
+    for (Shape *sh: shapes) {
+        Bound b;
+        sh->bounds(&b);
+        Vec3 ray = {0,0,0};
+        for (int j = 0; j < 3; j++) {
+            std::uniform_real_distribution<> distrib(b.min(j), b.max(j));
+            ray(j) = distrib(gen);
+        }
+        rays.emplace_back(Vec3{0,0,0}, ray);
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < shapes.size(); i++) {
+        Vec3 normal;
+        shapes[i]->intersect(rays[i], &normal);
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double, std::milli> ms = end - start;
+    return ms.count();
+}
+
+double traverseAll(const std::vector<BVHNode> &nodes, int *hits, int *seed) {
+    std::vector<Ray> rays;
+
+    // Rays from the origin to random points in each node, as above.
+    int genSeed = 0;
+    if (seed == NULL) {
+        seed = &genSeed;
+    }
+    if (*seed == -9998) {
+        std::random_device rd;
+        *seed = rd();
+    }
+    std::mt19937 gen(*seed);
+
+    for (const BVHNode &n: nodes) {
+        Vec3 ray = {0,0,0};
+        for (int j = 0; j < 3; j++) {
+            std::uniform_real_distribution<> distrib(n.min(j), n.max(j));
+            ray(j) = distrib(gen);
+        }
+        rays.emplace_back(Vec3{0,0,0}, ray);
+    }
+
+    int met = 0;
+    float t;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < nodes.size(); i++) {
+        met += meetsNode(&(nodes[i]), rays[i], &t);
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    *hits = met;
+    std::chrono::duration<double, std::milli> ms = end - start;
+    return ms.count();
+}
+
+bool checkSignedZeroRays() {
+    Vec3 min = {-1, -1, -1}, max = {1, 1, 1};
+    AAB box;
+    box.oMin = min;
+    box.oMax = max;
+    box.applyTransform();
+    BVHNode node = {min, 0, max, 0, 0, UINT8_MAX};
+    KdTree kd;
+    kd.min = min;
+    kd.max = max;
+    WideBVHNode<4> wide;
+    for (int i = 0; i < 3; i++) {
+        for (int c = 0; c < 4; c++) {
+            wide.bounds[0][i][c] = min(i);
+            wide.bounds[1][i][c] = max(i);
+        }
+    }
+
+    bool ok = true;
+    // From just inside the box along each axis, with the other two components +0 then -0.
+    for (int axis = 0; axis < 3; axis++) {
+        float results[2][5];
+        for (int neg = 0; neg < 2; neg++) {
+            Vec3 delta = {neg ? -0.f : 0.f, neg ? -0.f : 0.f, neg ? -0.f : 0.f};
+            delta(axis) = 1.f;
+            Vec3 p0 = {0.5f, 0.5f, 0.5f};
+            p0(axis) = -5.f;
+            Ray r(p0, delta);
+            float t, t0, t1, wt[4];
+            results[neg][0] = meetAABB(r, min, max);
+            results[neg][1] = meetsNode(&node, r, &t) ? t : -1.f;
+            results[neg][2] = box.intersect(r);
+            results[neg][3] = kd.clip(r, &t0, &t1) ? t0 : -1.f;
+            results[neg][4] = (meetsChildren<4>(&wide, r, wt) & 1) ? wt[0] : -1.f;
+        }
+        const char *tests[5] = {"meetAABB", "meetsNode", "AAB::intersect", "KdTree::clip", "meetsChildren"};
+        for (int i = 0; i < 5; i++) {
+            if (results[0][i] == results[1][i]) continue;
+            std::printf("%s along axis %d: %f with +0, %f with -0\n", tests[i], axis, results[0][i], results[1][i]);
+            ok = false;
+        }
+    }
+    return ok;
+}
@@ -1,6 +1,7 @@
 #include "tex.hpp"
 #include "img.hpp"
 #include "tga.hpp"
+#include "pool.hpp"
 
 #include <cstring>
 #include <string>
@@ -60,6 +61,41 @@ int TexStore::load(std::string fname) {
     return i;
 }
 
+void TexStore::preload(std::vector<std::string> &names, ThreadPool *pool) {
+    std::vector<std::string> toLoad;
+    for (auto &fname: names) {
+        if (id(fname) != -1) continue;
+        bool queued = false;
+        for (auto &q: toLoad) {
+            if (q == fname) {
+                queued = true;
+                break;
+            }
+        }
+        if (!queued) toLoad.emplace_back(fname);
+    }
+    if (toLoad.empty()) return;
+
+    std::vector<Texture*> loaded(toLoad.size(), NULL);
+    JobGroup group;
+    for (size_t i = 0; i < toLoad.size(); i++) {
+        pool->submit(&group, [&, i]() {
+            try {
+                loaded[i] = new Texture(toLoad[i]);
+            } catch (ImgLoadException &e) {
+                loaded[i] = NULL;
+            }
+        });
+    }
+    pool->wait(&group);
+
+    for (size_t i = 0; i < toLoad.size(); i++) {
+        if (loaded[i] == NULL) continue;
+        texes.emplace_back(loaded[i]);
+        fnames.emplace_back(toLoad[i]);
+    }
+}
+
 Texture *TexStore::from(std::string fname) {
     for (int i = 0; i < int(fnames.size()); i++) {
         if (fnames.at(i) == fname) return texes.at(i);
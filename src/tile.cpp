@@ -0,0 +1,89 @@
+#include "tile.hpp"
+
+#include <algorithm>
+#include <vector>
+
+namespace {
+    // Spreads the lower 16 bits of v out so there is a zero between each.
+    unsigned int spreadBits(unsigned int v) {
+        v &= 0x0000ffff;
+        v = (v | (v << 8)) & 0x00ff00ff;
+        v = (v | (v << 4)) & 0x0f0f0f0f;
+        v = (v | (v << 2)) & 0x33333333;
+        v = (v | (v << 1)) & 0x55555555;
+        return v;
+    }
+}
+
+unsigned int mortonCode2D(unsigned int x, unsigned int y) {
+    return spreadBits(x) | (spreadBits(y) << 1);
+}
+
+TileScheduler::TileScheduler(int width, int height, int nthreads, int tileSize) {
+    if (nthreads < 1) nthreads = 1;
+    if (tileSize < 1) tileSize = 1;
+    nqueues = nthreads;
+    queues = new Queue[nqueues];
+    steals = 0;
+
+    int tilesW = (width + tileSize - 1) / tileSize;
+    int tilesH = (height + tileSize - 1) / tileSize;
+    tileCount = tilesW * tilesH;
+
+    std::vector<std::pair<unsigned int, Tile>> order;
+    order.reserve(tileCount);
+    for (int ty = 0; ty < tilesH; ty++) {
+        for (int tx = 0; tx < tilesW; tx++) {
+            Tile t = {
+                tx*tileSize, std::min((tx+1)*tileSize, width),
+                ty*tileSize, std::min((ty+1)*tileSize, height)
+            };
+            order.emplace_back(mortonCode2D(tx, ty), t);
+        }
+    }
+    std::sort(order.begin(), order.end(), [](auto &a, auto &b) { return a.first < b.first; });
+
+    // Give each thread an (almost) equal, contiguous section of the curve.
+    int perThread = tileCount / nqueues;
+    int remainder = tileCount % nqueues;
+    int idx = 0;
+    for (int i = 0; i < nqueues; i++) {
+        int n = perThread + (i < remainder ? 1 : 0);
+        for (int j = 0; j < n; j++) {
+            queues[i].tiles.push_back(order[idx].second);
+            idx++;
+        }
+    }
+}
+
+TileScheduler::~TileScheduler() {
+    delete[] queues;
+}
+
+bool TileScheduler::next(int thread, Tile *t) {
+    Queue *q = queues + thread;
+    {
+        std::lock_guard<std::mutex> guard(q->lock);
+        if (!q->tiles.empty()) {
+            *t = q->tiles.front();
+            q->tiles.pop_front();
+            return true;
+        }
+    }
+    return steal(thread, t);
+}
+
+bool TileScheduler::steal(int thread, Tile *t) {
+    // Start with our neighbour on the curve, as its work is most likely to be nearby (and so coherent with ours).
+    for (int i = 1; i < nqueues; i++) {
+        Queue *q = queues + ((thread + i) % nqueues);
+        std::lock_guard<std::mutex> guard(q->lock);
+        if (q->tiles.empty()) continue;
+        // Take from the back, the work the owner will get to last.
+        *t = q->tiles.back();
+        q->tiles.pop_back();
+        steals++;
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,207 @@
+#include "widebvh.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <limits>
+#include "accel.hpp"
+
+namespace {
+    template <int W>
+    struct Collapser {
+        const LinearBVH *src;
+        WideBVH<W> *dst;
+        // Set if a node of src has more children than fit in a wide node.
+        bool tooWide;
+
+        // Fills in dst->nodes[idx] from the binary node src->nodes[b]. "depth" is the number of entries already on the traversal stack when this node is visited.
+        void node(uint32_t idx, uint32_t b, int depth) {
+            const BVHNode *n = &(src->nodes[b]);
+            uint32_t open[W];
+            int count = 0;
+            if (n->leaf()) {
+                open[count++] = b;
+            } else if (n->childCount > W) {
+                tooWide = true;
+                return;
+            } else {
+                for (int i = 0; i < n->childCount; i++) {
+                    open[count++] = n->offset + i;
+                }
+            }
+
+            // Replace the largest interior child with its own children while there's room for them.
+            // The larger a box is, the more likely a ray is to enter it, so it's the one most worth skipping a level for.
+            while (true) {
+                int best = -1;
+                float bestSA = -1.f;
+                for (int i = 0; i < count; i++) {
+                    const BVHNode *c = &(src->nodes[open[i]]);
+                    if (c->leaf() || count - 1 + c->childCount > W) continue;
+                    float sa = aabbSA(c->min, c->max);
+                    if (sa > bestSA) {
+                        bestSA = sa;
+                        best = i;
+                    }
+                }
+                if (best == -1) break;
+                const BVHNode *c = &(src->nodes[open[best]]);
+                open[best] = c->offset;
+                for (int i = 1; i < c->childCount; i++) {
+                    open[count++] = c->offset + i;
+                }
+            }
+
+            // Empty leaves can't be hit, so aren't worth a slot.
+            int kept = 0;
+            for (int i = 0; i < count; i++) {
+                const BVHNode *c = &(src->nodes[open[i]]);
+                if (c->leaf() && c->primCount == 0) continue;
+                open[kept++] = open[i];
+            }
+            count = kept;
+
+            int interior = 0;
+            for (int i = 0; i < count; i++) {
+                if (!src->nodes[open[i]].leaf()) interior++;
+            }
+            uint32_t first = dst->nodes.size();
+            dst->nodes.resize(first + interior);
+
+            WideBVHNode<W> *w = &(dst->nodes[idx]);
+            for (int i = 0; i < 3; i++) {
+                for (int j = 0; j < W; j++) {
+                    w->bounds[0][i][j] = std::numeric_limits<float>::infinity();
+                    w->bounds[1][i][j] = -std::numeric_limits<float>::infinity();
+                }
+            }
+            for (int j = 0; j < W; j++) {
+                w->child[j] = 0;
+                w->primCount[j] = 0;
+            }
+            w->childCount = count;
+            dst->stackDepth = std::max(dst->stackDepth, depth + count);
+
+            uint32_t next = first;
+            uint32_t children[W];
+            for (int j = 0; j < count; j++) {
+                const BVHNode *c = &(src->nodes[open[j]]);
+                for (int i = 0; i < 3; i++) {
+                    w->bounds[0][i][j] = c->min(i);
+                    w->bounds[1][i][j] = c->max(i);
+                }
+                if (c->leaf()) {
+                    w->child[j] = c->offset;
+                    w->primCount[j] = c->primCount;
+                } else {
+                    w->child[j] = next++;
+                }
+                children[j] = w->child[j];
+            }
+
+            for (int j = 0; j < count; j++) {
+                const BVHNode *c = &(src->nodes[open[j]]);
+                if (!c->leaf()) node(children[j], open[j], depth + count - 1);
+            }
+        }
+    };
+}
+
+template <int W>
+WideBVH<W> *collapseBVH(const LinearBVH *bvh) {
+    if (bvh == NULL || bvh->nodes.empty()) return NULL;
+    WideBVH<W> *wide = new WideBVH<W>();
+    wide->stackDepth = 1;
+    wide->nodes.resize(1);
+    // Leaves reference the same ranges of primIndices as before.
+    wide->primIndices = bvh->primIndices;
+    wide->prims = bvh->prims;
+    countBuildMemory(sizeof(WideBVH<W>) + wide->primIndices.capacity()*sizeof(uint32_t) + wide->prims.capacity()*sizeof(Shape*), 3);
+    Collapser<W> c = {bvh, wide, false};
+    c.node(0, 0, 0);
+    if (c.tooWide || wide->stackDepth > BVH_STACK_SIZE) {
+        std::printf("Hierarchy can't be collapsed to %d-wide nodes (node too wide, or needs a stack of %d)\n", W, wide->stackDepth);
+        countBuildMemory(-int64_t(sizeof(WideBVH<W>) + wide->primIndices.capacity()*sizeof(uint32_t) + wide->prims.capacity()*sizeof(Shape*)), 0);
+        delete wide;
+        return NULL;
+    }
+    wide->nodes.shrink_to_fit();
+    countBuildMemory(wide->nodes.capacity()*sizeof(WideBVHNode<W>), 1);
+    return wide;
+}
+
+template WideBVH<4> *collapseBVH<4>(const LinearBVH *bvh);
+template WideBVH<8> *collapseBVH<8>(const LinearBVH *bvh);
+
+template <int W>
+void refitWideBVH(WideBVH<W> *bvh, const std::vector<bool> &dirty) {
+    if (bvh == NULL) return;
+    // As in refitBVH, children come after their parents, so a backwards pass sees them first.
+    std::vector<bool> changed(bvh->nodes.size(), false);
+    for (size_t idx = bvh->nodes.size(); idx-- > 0;) {
+        WideBVHNode<W> *n = &(bvh->nodes[idx]);
+        for (int j = 0; j < n->childCount; j++) {
+            Bound box = Bound::forGrowing();
+            if (n->primCount[j] != 0) {
+                bool moved = false;
+                for (int i = 0; i < n->primCount[j]; i++) {
+                    if (dirty[bvh->primIndices[n->child[j] + i]]) moved = true;
+                }
+                if (!moved) continue;
+                for (int i = 0; i < n->primCount[j]; i++) {
+                    Bound b;
+                    bvh->prims[bvh->primIndices[n->child[j] + i]]->bounds(&b);
+                    box.grow(&b);
+                }
+            } else {
+                if (!changed[n->child[j]]) continue;
+                const WideBVHNode<W> *c = &(bvh->nodes[n->child[j]]);
+                for (int k = 0; k < c->childCount; k++) {
+                    Bound b({c->bounds[0][0][k], c->bounds[0][1][k], c->bounds[0][2][k]}, {c->bounds[1][0][k], c->bounds[1][1][k], c->bounds[1][2][k]});
+                    box.grow(&b);
+                }
+            }
+            for (int i = 0; i < 3; i++) {
+                n->bounds[0][i][j] = box.min(i);
+                n->bounds[1][i][j] = box.max(i);
+            }
+            changed[idx] = true;
+        }
+    }
+}
+
+template <int W>
+float wideBvhCost(const WideBVH<W> *bvh, float costTriSphereRatio, float *rootSA) {
+    if (bvh == NULL || bvh->nodes.empty()) return 0.f;
+    float area = rootSA != NULL ? *rootSA : 0.f;
+    if (area <= 0.f) {
+        // The root has no box of its own, so it's the union of its children's.
+        const WideBVHNode<W> *root = &(bvh->nodes[0]);
+        Bound rootBox = Bound::forGrowing();
+        for (int j = 0; j < root->childCount; j++) {
+            Bound b({root->bounds[0][0][j], root->bounds[0][1][j], root->bounds[0][2][j]}, {root->bounds[1][0][j], root->bounds[1][1][j], root->bounds[1][2][j]});
+            rootBox.grow(&b);
+        }
+        area = aabbSA(rootBox.min, rootBox.max);
+    }
+    if (rootSA != NULL) *rootSA = area;
+    if (area <= 0.f) return 0.f;
+    float cost = 1.f;
+    for (const WideBVHNode<W> &n: bvh->nodes) {
+        for (int j = 0; j < n.childCount; j++) {
+            float visit = 1.f;
+            if (n.primCount[j] != 0) {
+                visit = 0.f;
+                for (int i = 0; i < n.primCount[j]; i++) {
+                    visit += shapeCost(bvh->prims[bvh->primIndices[n.child[j] + i]]->type(), costTriSphereRatio);
+                }
+            }
+            cost += visit * aabbSA({n.bounds[0][0][j], n.bounds[0][1][j], n.bounds[0][2][j]}, {n.bounds[1][0][j], n.bounds[1][1][j], n.bounds[1][2][j]}) / area;
+        }
+    }
+    return cost;
+}
+
+template void refitWideBVH<4>(WideBVH<4> *bvh, const std::vector<bool> &dirty);
+template void refitWideBVH<8>(WideBVH<8> *bvh, const std::vector<bool> &dirty);
+template float wideBvhCost<4>(const WideBVH<4> *bvh, float costTriSphereRatio, float *rootSA);
+template float wideBvhCost<8>(const WideBVH<8> *bvh, float costTriSphereRatio, float *rootSA);
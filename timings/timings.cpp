@@ -1,4 +1,5 @@
 #include "test.hpp"
+#include "costs.hpp"
 #include "shape.hpp"
 #include "util.hpp"
 #include <getopt.h>
@@ -26,6 +27,8 @@ int main(int argc, char **argv) {
               break;
         }
     }
+    if (!checkSignedZeroRays()) std::printf("Box tests disagree on rays with -0 direction components!\n");
+
     std::printf("Initializing shape lists of size %d\n", n);
     int seed = -9998;
     Triangle *t = triList(n, &seed);
@@ -54,5 +57,10 @@ int main(int argc, char **argv) {
     std::printf("%d & Triangle & %f & %f & %f\\\\\n\\midrule\n", n, tTmin, tTa, tTmax);
     std::printf("%d & Sphere   & %f & %f & %f\\\\\n\\midrule\n", n, tSmin, tSa, tSmax);
     std::printf("%d & \\makecell{$\\frac{Triangle}{Sphere}$} & %f & %f & %f\\\\\n\\midrule\n", n, tRmin, tRa, tRmax);
+
+    // The same, for every shape type, as used by the SAH builders.
+    float costs[ShapeType::Count];
+    calibrateShapeCosts(costs, n);
+    std::printf("Cost relative to a BVH node: %s\n", describeShapeCosts(costs).c_str());
 }
 